@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+
+/*
+ * Unpacking of MIPI CSI-2 packed Bayer rows to one uint16_t per pixel, the
+ * value keeps the sensor bit depth (0-1023 or 0-4095).
+ *
+ *   RAW10: 4 pixels in 5 bytes, the high 8 bits of each pixel then one byte
+ *          with the 2 low bits of the four, pixel 0 in bits 1:0.
+ *   RAW12: 2 pixels in 3 bytes, the high 8 bits of each pixel then one byte
+ *          with the 4 low bits of the two, pixel 0 in bits 3:0.
+ *
+ * The scalar versions are the reference, the NEON (AArch64) and SSSE3 ones
+ * must give the same result bit for bit. The vector loops read up to 16 bytes
+ * at a time, they stop early enough to stay inside a row of whole groups and
+ * leave the tail to the scalar code.
+ */
+
+inline void unpackRaw10Scalar(const uint8_t *src, uint16_t *dst, size_t pixels) {
+    for (size_t i = 0; i < pixels; i++) {
+        const uint8_t *group = src + (i / 4) * 5;
+        unsigned int j = i % 4;
+        dst[i] = (group[j] << 2) | ((group[4] >> (2 * j)) & 0x3);
+    }
+}
+
+inline void unpackRaw12Scalar(const uint8_t *src, uint16_t *dst, size_t pixels) {
+    for (size_t i = 0; i < pixels; i++) {
+        const uint8_t *group = src + (i / 2) * 3;
+        unsigned int j = i % 2;
+        dst[i] = (group[j] << 4) | ((group[2] >> (4 * j)) & 0xf);
+    }
+}
+
+inline void unpackRaw10(const uint8_t *src, uint16_t *dst, size_t pixels) {
+    size_t i = 0;
+
+#if defined(__aarch64__)
+    // Eight pixels, two groups, out of each 16 byte load
+    static const uint8_t highIndex[8] = { 0, 1, 2, 3, 5, 6, 7, 8 };
+    static const uint8_t lowIndex[8] = { 4, 4, 4, 4, 9, 9, 9, 9 };
+    static const int16_t lowShift[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+    const uint8x8_t high = vld1_u8(highIndex);
+    const uint8x8_t low = vld1_u8(lowIndex);
+    const int16x8_t shift = vld1q_s16(lowShift);
+    const uint16x8_t mask = vdupq_n_u16(0x3);
+
+    for (; i + 16 <= pixels; i += 8) {
+        uint8x16_t bytes = vld1q_u8(src + i / 4 * 5);
+        uint16x8_t value = vshll_n_u8(vqtbl1_u8(bytes, high), 2);
+        uint16x8_t bits = vshlq_u16(vmovl_u8(vqtbl1_u8(bytes, low)), shift);
+        vst1q_u16(dst + i, vorrq_u16(value, vandq_u16(bits, mask)));
+    }
+#elif defined(__SSSE3__)
+    // Each 16 bit lane gets its high byte above the byte holding its low bits
+    const __m128i shuffle = _mm_setr_epi8(4, 0, 4, 1, 4, 2, 4, 3, 9, 5, 9, 6, 9, 7, 9, 8);
+    // Moves the low bits of lane j to bits 7:6, multiplication being the only per-lane shift
+    const __m128i scale = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+    const __m128i lowByte = _mm_set1_epi16(0x00ff);
+    const __m128i mask = _mm_set1_epi16(0x3);
+
+    for (; i + 16 <= pixels; i += 8) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i / 4 * 5));
+        __m128i lanes = _mm_shuffle_epi8(bytes, shuffle);
+        __m128i value = _mm_slli_epi16(_mm_srli_epi16(lanes, 8), 2);
+        __m128i bits = _mm_mullo_epi16(_mm_and_si128(lanes, lowByte), scale);
+        bits = _mm_and_si128(_mm_srli_epi16(bits, 6), mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(value, bits));
+    }
+#endif
+
+    // i is a multiple of 4 here, the tail starts on a group boundary
+    unpackRaw10Scalar(src + i / 4 * 5, dst + i, pixels - i);
+}
+
+inline void unpackRaw12(const uint8_t *src, uint16_t *dst, size_t pixels) {
+    size_t i = 0;
+
+#if defined(__ARM_NEON)
+    // vld3 splits 8 groups into the even highs, the odd highs and the low nibbles
+    for (; i + 16 <= pixels; i += 16) {
+        uint8x8x3_t bytes = vld3_u8(src + i / 2 * 3);
+        uint16x8x2_t value;
+        value.val[0] = vorrq_u16(vshll_n_u8(bytes.val[0], 4), vmovl_u8(vand_u8(bytes.val[2], vdup_n_u8(0xf))));
+        value.val[1] = vorrq_u16(vshll_n_u8(bytes.val[1], 4), vmovl_u8(vshr_n_u8(bytes.val[2], 4)));
+        vst2q_u16(dst + i, value);
+    }
+#elif defined(__SSSE3__)
+    // Each 16 bit lane gets its high byte above the byte holding its low nibble
+    const __m128i shuffle = _mm_setr_epi8(2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10);
+    // Even pixels take the low nibble, odd ones the high nibble that the shift leaves in place
+    const __m128i highMask = _mm_setr_epi16(0x0ff0, 0x0fff, 0x0ff0, 0x0fff, 0x0ff0, 0x0fff, 0x0ff0, 0x0fff);
+    const __m128i lowMask = _mm_setr_epi16(0x000f, 0, 0x000f, 0, 0x000f, 0, 0x000f, 0);
+
+    for (; i + 16 <= pixels; i += 8) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i / 2 * 3));
+        __m128i lanes = _mm_shuffle_epi8(bytes, shuffle);
+        __m128i value = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(lanes, 4), highMask),
+                                     _mm_and_si128(lanes, lowMask));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), value);
+    }
+#endif
+
+    // i is even here, the tail starts on a group boundary
+    unpackRaw12Scalar(src + i / 2 * 3, dst + i, pixels - i);
+}
+
+inline void unpackRaw(unsigned int bitDepth, const uint8_t *src, uint16_t *dst, size_t pixels) {
+    if (bitDepth == 10)
+        unpackRaw10(src, dst, pixels);
+    else
+        unpackRaw12(src, dst, pixels);
+}
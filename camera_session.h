@@ -0,0 +1,436 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include <errno.h>
+#include <glob.h>
+#include <limits.h>
+
+#include <libcamera/libcamera.h>
+#include <libcamera/control_ids.h>
+#include <libcamera/property_ids.h>
+
+#include "mapped_buffer.h"
+
+/*
+ * Sensor readout of a mode, the crop is in full array pixels. The modes are
+ * the driver's, found when the camera is opened. The four the apps always
+ * had keep their -m index, any other mode follows them: highest bit depth
+ * first, then largest output first.
+ */
+struct SensorMode {
+    int bitDepth;
+    int width;
+    int height;
+    int binning;
+    int cropLeft;
+    int cropTop;
+    int cropWidth;
+    int cropHeight;
+    int fps;
+};
+
+/* Bit depth and size of modes 0 to 3 before they were read from the driver */
+inline constexpr int kLegacyModes[][3] = {
+        { 12, 4056, 3040 },
+        { 12, 2028, 1520 },
+        { 12, 2028, 1080 },
+        { 10, 1332, 990 }
+};
+
+inline constexpr int kNumLegacyModes = sizeof(kLegacyModes) / sizeof(kLegacyModes[0]);
+
+inline int legacyModeIndex(const SensorMode &mode) {
+    for (int i = 0; i < kNumLegacyModes; i++) {
+        if (mode.bitDepth == kLegacyModes[i][0] && mode.width == kLegacyModes[i][1] &&
+            mode.height == kLegacyModes[i][2])
+            return i;
+    }
+    return kNumLegacyModes;
+}
+
+/* What a session needs to know to open and set up its camera */
+struct SessionConfig {
+    // libcamera id or index of the camera, the first one when empty
+    std::string cameraId;
+    int mode = 0;
+    int width = 0;
+    int height = 0;
+    bool hflip = false;
+    bool vflip = false;
+    // Manual exposure (us) and analogue gain, -1 leaves them to the AE
+    int exposure = -1;
+    double analogueGain = -1;
+    // XVS trigger mode of the sensor: 0 standalone, 1 source, 2 sink, -1 the driver's own
+    int triggerMode = -1;
+};
+
+/*
+ * One camera of the process with everything that belongs to it: the
+ * configuration, the buffers and their mappings. Sessions share the single
+ * CameraManager libcamera allows, which lives as long as one of them does,
+ * so several can run side by side each with its own threads.
+ *
+ * open() generates the configuration for the given roles with the sensor
+ * mode and orientation applied, the owner then tailors the streams and calls
+ * configure(). Completed requests are handed to requestCompleted, on the
+ * libcamera thread.
+ */
+class CameraSession {
+    public:
+        std::function<void(libcamera::Request *request)> requestCompleted;
+
+        explicit CameraSession(const SessionConfig &sessionConfig) : config(sessionConfig) {}
+
+        ~CameraSession() {
+            close();
+        }
+
+        bool open(const std::vector<libcamera::StreamRole> &roles) {
+            if (cam)
+                return false;
+
+            manager = sharedManager();
+            if (!manager)
+                return false;
+
+            if (manager->cameras().empty()) {
+                std::cerr << "No Camera detected" << std::endl;
+                return false;
+            }
+            for (auto const &camera : manager->cameras())
+                std::cout << camera->id() << std::endl;
+
+            cam = findCamera();
+            if (!cam) {
+                std::cerr << "Camera " << config.cameraId << " not found" << std::endl;
+                return false;
+            }
+            if (cam->acquire() < 0) {
+                std::cerr << "Camera " << cam->id() << " is in use" << std::endl;
+                cam.reset();
+                return false;
+            }
+
+            modes = discoverModes();
+            if (modes.empty()) {
+                std::cerr << "Camera " << cam->id() << " has no raw sensor modes" << std::endl;
+                close();
+                return false;
+            }
+            if (config.mode < 0 || config.mode >= static_cast<int>(modes.size())) {
+                std::cerr << "Mode " << config.mode << " not available, camera " << cam->id() << " has:" << std::endl;
+                printModes(std::cerr);
+                close();
+                return false;
+            }
+
+            cameraConfig = cam->generateConfiguration(roles);
+            if (!cameraConfig || cameraConfig->size() != roles.size()) {
+                std::cerr << "Camera " << cam->id() << " can't provide the streams" << std::endl;
+                close();
+                return false;
+            }
+            cam->requestCompleted.connect(this, &CameraSession::onRequestCompleted);
+
+            if (config.hflip)
+                cameraConfig->orientation = cameraConfig->orientation * libcamera::Transform::HFlip;
+            if (config.vflip)
+                cameraConfig->orientation = cameraConfig->orientation * libcamera::Transform::VFlip;
+
+            const SensorMode &mode = sensorMode();
+            libcamera::SensorConfiguration sensorConfig;
+            sensorConfig.analogCrop = libcamera::Rectangle(mode.cropLeft, mode.cropTop, mode.cropWidth, mode.cropHeight);
+            sensorConfig.bitDepth = mode.bitDepth;
+            sensorConfig.binning.binX = mode.binning;
+            sensorConfig.binning.binY = mode.binning;
+            sensorConfig.skipping.xOddInc = 1;
+            sensorConfig.skipping.xEvenInc = 1;
+            sensorConfig.skipping.yOddInc = 1;
+            sensorConfig.skipping.yEvenInc = 1;
+            sensorConfig.outputSize = libcamera::Size(mode.width, mode.height);
+            if (!sensorConfig.isValid()) {
+                std::cerr << "Sensor configuration not available" << std::endl;
+                close();
+                return false;
+            }
+            cameraConfig->sensorConfig = std::optional<libcamera::SensorConfiguration>(sensorConfig);
+
+            // Read by the driver when streaming starts, the sensor is still off here
+            if (config.triggerMode >= 0 && !setTriggerMode(config.triggerMode)) {
+                std::cerr << "Camera " << cam->id() << " trigger mode can't be set" << std::endl;
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        /* Apply the configuration once its streams are validated */
+        bool configure() {
+            if (cam->configure(cameraConfig.get()) < 0) {
+                std::cerr << "Camera " << cam->id() << " configuration failed" << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* Buffers for every stream of the configuration, each of them mapped */
+        int allocate() {
+            allocator = std::make_unique<libcamera::FrameBufferAllocator>(cam);
+            for (libcamera::StreamConfiguration &streamConfig : *cameraConfig) {
+                if (allocator->allocate(streamConfig.stream()) < 0) {
+                    std::cerr << "Could not allocate buffer" << std::endl;
+                    return -ENOMEM;
+                }
+                for (const std::unique_ptr<libcamera::FrameBuffer> &buffer : allocator->buffers(streamConfig.stream())) {
+                    if (mapped.map(buffer.get()) < 0)
+                        return -ENOMEM;
+                }
+            }
+            return 0;
+        }
+
+        /* Controls of the manual exposure and gain, if any, for the first request */
+        void setExposureControls(libcamera::ControlList &controls) const {
+            if (config.exposure == -1 && config.analogueGain == -1)
+                return;
+            controls.set(libcamera::controls::AeEnable, false);
+            if (config.exposure != -1)
+                controls.set(libcamera::controls::ExposureTime, config.exposure);
+            if (config.analogueGain != -1)
+                controls.set(libcamera::controls::AnalogueGain, config.analogueGain);
+        }
+
+        void close() {
+            if (!cam) {
+                manager.reset();
+                return;
+            }
+            mapped.unmapAll();
+            if (allocator) {
+                for (libcamera::StreamConfiguration &streamConfig : *cameraConfig)
+                    allocator->free(streamConfig.stream());
+                allocator.reset();
+            }
+            cam->requestCompleted.disconnect(this, &CameraSession::onRequestCompleted);
+            if (config.triggerMode >= 0)
+                setTriggerMode(-1);
+            cam->release();
+            cam.reset();
+            cameraConfig.reset();
+            // The last session to go stops the manager
+            manager.reset();
+        }
+
+        libcamera::Camera *camera() const { return cam.get(); }
+        libcamera::CameraConfiguration *configuration() const { return cameraConfig.get(); }
+        const SessionConfig &sessionConfig() const { return config; }
+        const SensorMode &sensorMode() const { return modes[config.mode]; }
+        const std::vector<SensorMode> &sensorModes() const { return modes; }
+        const MappedBufferCache &mappedBuffers() const { return mapped; }
+
+        const std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers(libcamera::Stream *stream) const {
+            return allocator->buffers(stream);
+        }
+
+        /*
+         * Sysfs directory of the camera's sensor on the I2C bus, found by the
+         * device tree node libcamera names the camera after. With a single
+         * IMX477 it is that one whatever the id. Empty when not found.
+         */
+        std::string sensorDevice() const {
+            std::string device;
+            glob_t paths;
+            if (glob("/sys/bus/i2c/drivers/imx477/*/of_node", 0, nullptr, &paths) != 0)
+                return device;
+            for (size_t i = 0; i < paths.gl_pathc && device.empty(); i++) {
+                char node[PATH_MAX];
+                if (!realpath(paths.gl_pathv[i], node))
+                    continue;
+                std::string path = node;
+                const std::string root = "/sys/firmware/devicetree";
+                if ((path.compare(0, root.size(), root) == 0 && path.substr(root.size()) == cam->id()) ||
+                    paths.gl_pathc == 1) {
+                    device = paths.gl_pathv[i];
+                    device.erase(device.rfind('/'));
+                }
+            }
+            globfree(&paths);
+            return device;
+        }
+
+        /* Trigger mode of the driver for the sensor's next start, see SessionConfig */
+        bool setTriggerMode(int mode) const {
+            std::string device = sensorDevice();
+            if (device.empty())
+                return false;
+            std::ofstream file(device + "/trigger_mode");
+            file << mode << std::endl;
+            return static_cast<bool>(file);
+        }
+
+        void printModes(std::ostream &out) const {
+            for (size_t i = 0; i < modes.size(); i++) {
+                const SensorMode &mode = modes[i];
+                out << "\t" << i << ": " << mode.width << "x" << mode.height << " " << mode.bitDepth << "-bit, "
+                    << mode.binning << "x" << mode.binning << " binning, crop (" << mode.cropLeft << ","
+                    << mode.cropTop << ")/" << mode.cropWidth << "x" << mode.cropHeight << ", "
+                    << mode.fps << " fps" << std::endl;
+            }
+        }
+
+        /* The modes of the camera the config selects, for the apps' list option */
+        static bool listModes(const SessionConfig &sessionConfig, std::ostream &out) {
+            SessionConfig probe = sessionConfig;
+            probe.mode = 0;
+            CameraSession session(probe);
+            if (!session.open({ libcamera::StreamRole::Raw }))
+                return false;
+            out << "Sensor modes of " << session.camera()->id() << ":" << std::endl;
+            session.printModes(out);
+            return true;
+        }
+
+    private:
+        SessionConfig config;
+        std::shared_ptr<libcamera::CameraManager> manager;
+        std::shared_ptr<libcamera::Camera> cam;
+        std::unique_ptr<libcamera::CameraConfiguration> cameraConfig;
+        std::unique_ptr<libcamera::FrameBufferAllocator> allocator;
+        MappedBufferCache mapped;
+        std::vector<SensorMode> modes;
+
+        /* The process wide CameraManager, started for the first session */
+        static std::shared_ptr<libcamera::CameraManager> sharedManager() {
+            static std::mutex lock;
+            static std::weak_ptr<libcamera::CameraManager> current;
+
+            std::lock_guard<std::mutex> guard(lock);
+            std::shared_ptr<libcamera::CameraManager> manager = current.lock();
+            if (manager)
+                return manager;
+
+            std::unique_ptr<libcamera::CameraManager> started = std::make_unique<libcamera::CameraManager>();
+            if (started->start()) {
+                std::cerr << "Camera Manager could not be launched" << std::endl;
+                return nullptr;
+            }
+            manager = std::shared_ptr<libcamera::CameraManager>(started.release(), [](libcamera::CameraManager *cm) {
+                cm->stop();
+                delete cm;
+            });
+            current = manager;
+            return manager;
+        }
+
+        std::shared_ptr<libcamera::Camera> findCamera() const {
+            const std::vector<std::shared_ptr<libcamera::Camera>> cameras = manager->cameras();
+            if (config.cameraId.empty())
+                return cameras[0];
+            if (config.cameraId.find_first_not_of("0123456789") == std::string::npos) {
+                // An index too long for unsigned long is no camera either
+                errno = 0;
+                unsigned long index = strtoul(config.cameraId.c_str(), nullptr, 10);
+                return !errno && index < cameras.size() ? cameras[index] : nullptr;
+            }
+            return manager->get(config.cameraId);
+        }
+
+        /*
+         * Configure a Raw stream with every size of every raw format and read
+         * back the mode the pipeline picked: its crop and its fastest frame.
+         * That takes a configuration per mode, so the result is kept per camera
+         * for the sessions that follow.
+         */
+        std::vector<SensorMode> discoverModes() const {
+            static std::mutex lock;
+            static std::map<std::string, std::vector<SensorMode>> discovered;
+
+            std::lock_guard<std::mutex> guard(lock);
+            auto cached = discovered.find(cam->id());
+            if (cached != discovered.end())
+                return cached->second;
+
+            std::vector<SensorMode> found;
+            std::unique_ptr<libcamera::CameraConfiguration> raw = cam->generateConfiguration({ libcamera::StreamRole::Raw });
+            if (!raw || raw->empty())
+                return found;
+            libcamera::StreamConfiguration &stream = raw->at(0);
+            const libcamera::StreamFormats formats = stream.formats();
+
+            // The crop is reported relative to the active area, the modes are in array pixels
+            libcamera::Rectangle active;
+            const auto activeAreas = cam->properties().get(libcamera::properties::PixelArrayActiveAreas);
+            if (activeAreas && !activeAreas->empty())
+                active = (*activeAreas)[0];
+
+            for (const libcamera::PixelFormat &format : formats.pixelformats()) {
+                // SRGGB10_CSI2P, SBGGR12... the compressed formats carry no bit depth
+                const std::string name = format.toString();
+                size_t digits = name.find_first_of("0123456789");
+                int bitDepth = digits == std::string::npos ? 0 : std::atoi(name.c_str() + digits);
+                if (bitDepth < 8 || bitDepth > 16)
+                    continue;
+
+                for (const libcamera::Size &size : formats.sizes(format)) {
+                    bool known = std::any_of(found.begin(), found.end(), [&](const SensorMode &mode) {
+                        return mode.bitDepth == bitDepth && mode.width == static_cast<int>(size.width) &&
+                               mode.height == static_cast<int>(size.height);
+                    });
+                    if (known)
+                        continue;
+
+                    stream.pixelFormat = format;
+                    stream.size = size;
+                    if (raw->validate() == libcamera::CameraConfiguration::Invalid || !(stream.size == size) ||
+                        cam->configure(raw.get()) < 0)
+                        continue;
+
+                    const auto crop = cam->properties().get(libcamera::properties::ScalerCropMaximum);
+                    auto limits = cam->controls().find(&libcamera::controls::FrameDurationLimits);
+                    if (!crop || !crop->width || limits == cam->controls().end())
+                        continue;
+                    int64_t minDuration = limits->second.min().get<int64_t>();
+                    if (minDuration <= 0)
+                        continue;
+
+                    found.push_back({
+                        .bitDepth = bitDepth,
+                        .width = static_cast<int>(size.width),
+                        .height = static_cast<int>(size.height),
+                        .binning = static_cast<int>(std::lround(static_cast<double>(crop->width) / size.width)),
+                        .cropLeft = active.x + crop->x,
+                        .cropTop = active.y + crop->y,
+                        .cropWidth = static_cast<int>(crop->width),
+                        .cropHeight = static_cast<int>(crop->height),
+                        .fps = static_cast<int>(std::lround(1e6 / minDuration)),
+                    });
+                }
+            }
+
+            // Scripts and --benchmark runs name modes by index, new ones must not renumber the old
+            std::sort(found.begin(), found.end(), [](const SensorMode &a, const SensorMode &b) {
+                return std::make_tuple(-legacyModeIndex(a), a.bitDepth, a.width * a.height) >
+                       std::make_tuple(-legacyModeIndex(b), b.bitDepth, b.width * b.height);
+            });
+            if (!found.empty())
+                discovered[cam->id()] = found;
+            return found;
+        }
+
+        void onRequestCompleted(libcamera::Request *request) {
+            if (requestCompleted)
+                requestCompleted(request);
+        }
+};
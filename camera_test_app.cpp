@@ -5,6 +5,10 @@
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <cstdio>
+#include <fstream>
 #include <sys/mman.h>
 #include <syslog.h>
 
@@ -14,44 +18,48 @@
 #include <opencv2/opencv.hpp>
 #include <libcamera/control_ids.h>
 
+#include "camera_session.h"
+#include "frame_stats.h"
+#include "image_writer.h"
+#include "mapped_buffer.h"
 
 using namespace libcamera;
 using namespace std::chrono_literals;
 
-int height; 
-int width;
-bool hflip;
-bool vflip;
-
-double analog_gain;
-int exposure;
-int mode;
-
-
-struct mode_struct {
-        int bitDepth;
-        int width;
-        int height;
-        int binning;
-        int cropLeft;
-        int cropTop;
-        int cropWidth;
-        int cropHeight;
-};
+struct StillConfig : SessionConfig {
+    // Burst/timelapse: shots to take and the minimum time between two of them, 0 for every frame
+    int shotCount;
+    int shotInterval;
+    ImageWriter::Options writerOptions;
 
-static const mode_struct modes[] = {
-        {.bitDepth= 12, .width= 4056, .height= 3040, .binning = 1, .cropLeft =   8, .cropTop =  16, .cropWidth = 4056, .cropHeight = 3040},
-        {.bitDepth= 12, .width= 2028, .height= 1520, .binning = 2, .cropLeft =   8, .cropTop =  16, .cropWidth = 4056, .cropHeight = 3040},
-        {.bitDepth= 12, .width= 2028, .height= 1080, .binning = 2, .cropLeft =   8, .cropTop = 456, .cropWidth = 4056, .cropHeight = 2160},
-        {.bitDepth= 10, .width= 1332, .height= 990 , .binning = 2, .cropLeft = 704, .cropTop = 544, .cropWidth = 2664, .cropHeight = 1980}
-    
+    // Save the sensor Bayer data from the Raw stream instead of the ISP output
+    bool rawStream;
+    bool rawUnpack;
+
+    // Captures to run, the camera stopped for capturePause ms between two of them
+    int captures;
+    int capturePause;
 };
+
+/*
+ * Runtime PM state of the session's IMX477 as the driver left it:
+ * "suspended" when the next start powers it up, "active" while it waits in
+ * warm standby. Empty when the driver isn't there.
+ */
+static std::string sensorPowerState(const CameraSession &session) {
+    std::string state;
+    std::string device = session.sensorDevice();
+    if (device.empty())
+        return state;
+    std::ifstream file(device + "/power/runtime_status");
+    std::getline(file, state);
+    return state;
+}
  
 class CameraTestApp {
     
     public:
-        CameraTestApp() {
-            cameraManager = std::make_unique<CameraManager>();
+        explicit CameraTestApp(const StillConfig &stillConfig) : config(stillConfig), session(stillConfig) {
             stop = 1;
         };
 
@@ -63,31 +71,16 @@ class CameraTestApp {
             if(stop != 1)
                 return false;
 
-            int ret;
-            ret = cameraManager->start();
-            if(ret){
-                std::cerr << "Camera Manager could not be launched" << std::endl;
+            if (!session.open({ config.rawStream ? StreamRole::Raw : StreamRole::StillCapture }))
                 return false;
-            }
-
-            if(cameraManager->cameras().empty()){
-                std::cerr << "No Camera detected" << std::endl;
-                return false; 
-            }
-
-            for (auto const &camera : cameraManager->cameras()){
-                std::cout << camera->id() << std::endl;
-            }
-
-            camera = cameraManager->cameras()[0];
-            camera->acquire();
-            cameraConfig = camera->generateConfiguration( { StreamRole::StillCapture } );
+            camera = session.camera();
+            cameraConfig = session.configuration();
             for(auto it = cameraConfig->begin(); it != cameraConfig->end(); it++){
                 std::cout << (*it).toString() << std::endl;
             }
 
             streamConfig = &(cameraConfig->at(0));
-            camera->requestCompleted.connect(this, &CameraTestApp::onRequestCompleted);
+            session.requestCompleted = [this](Request *request) { onRequestCompleted(request); };
 
             stop = 0;
 
@@ -95,93 +88,206 @@ class CameraTestApp {
         };
 
         int allocateFrameBuffer(){
-            allocator = new FrameBufferAllocator(camera);
-            if(allocator->allocate(streamConfig->stream()) < 0) {
-                std::cerr << "Could not allocate buffer" << std::endl;
-                return -ENOMEM;
-            }
-            size_t allocated = allocator->buffers(streamConfig->stream()).size();
-            return 0;
+            return session.allocate();
         }
 
+        /*
+         * Take shotCount pictures without stopping the camera in between.
+         * Every buffer stays queued, frames arriving before the next shot is
+         * due go straight back to the camera.
+         */
         void capureImage(const std::string &filePath){
             Stream * stream = streamConfig->stream();
-            const std::vector<std::unique_ptr<FrameBuffer>>& buffers = allocator->buffers(stream);
-            std::unique_ptr<libcamera::Request> request = camera->createRequest();
-            if(!request){
-                std::cerr << "Could not create request" << std::endl;
-                return;
-            }
+            const std::vector<std::unique_ptr<FrameBuffer>>& buffers = session.buffers(stream);
 
-            if(exposure != -1 || analog_gain != -1){
-                request->controls().set(controls::AeEnable, false); 
-                if(exposure != -1){
-                    request->controls().set(controls::ExposureTime, exposure); 
+            for (size_t i = 0; i < buffers.size(); i++) {
+                std::unique_ptr<libcamera::Request> request = camera->createRequest(i);
+                if(!request){
+                    std::cerr << "Could not create request" << std::endl;
+                    return;
                 }
-                if(analog_gain != -1) {
-                    request->controls().set(controls::AnalogueGain, analog_gain);
+                if(request->addBuffer(stream, buffers[i].get()) < 0){
+                    std::cerr << "Could not add buffer to request" << std::endl;
+                    return;
                 }
+                requests.push_back(std::move(request));
             }
 
-            request->addBuffer(stream, buffers[0].get());
+            // Controls only need to travel with the first request, the pipeline keeps them
+            Request *first = requests.front().get();
+            session.setExposureControls(first->controls());
+
+            // With shotCount 1 the name stays the single capture one
+            std::string base = filePath.substr(0, filePath.rfind('.'));
+            std::string extension = filePath.substr(filePath.rfind('.'));
+
+            writer = std::make_unique<ImageWriter>(config.writerOptions);
+            writer->written = [this](const ImageWriter::Image &image, bool ok) {
+                if (ok)
+                    frameStats.stamp(image.sequence, FrameStats::Written);
+                // Written straight from the camera buffer, it can be filled again now
+                if (image.cookie) {
+                    heldByWriter--;
+                    queueAgain(static_cast<Request *>(image.cookie));
+                }
+            };
+            // Keep two buffers with the sensor, bursts copy the frames that would take those
+            maxHeldByWriter = buffers.size() > 2 ? buffers.size() - 2 : 1;
+            heldByWriter = 0;
+
+            completed.clear();
+            streaming = true;
+            // Time to first frame, from an application asking for a picture to the sensor delivering it
+            std::string powerState = sensorPowerState(session);
+            auto startTime = std::chrono::steady_clock::now();
             camera->start();
-            camera->queueRequest(request.get());
-            waitForRequest();
+            for (std::unique_ptr<Request> &request : requests)
+                camera->queueRequest(request.get());
+            auto started = std::chrono::steady_clock::now();
+            bool firstFrame = true;
+
+            LatencyHistogram shotToShot;
+            int64_t lastShot = 0;
+            auto nextShot = std::chrono::steady_clock::now();
+            int shots = 0;
+            while (shots < config.shotCount) {
+                Request *request = waitForRequest();
+                if (request->status() == Request::RequestCancelled) {
+                    std::cerr << "Request failed or cancelled" << std::endl;
+                    break;
+                }
+
+                FrameBuffer *buffer = request->buffers().at(stream);
+                if (firstFrame) {
+                    firstFrame = false;
+                    reportFirstFrame(powerState, startTime, started, buffer->metadata().timestamp);
+                }
+                bool due = std::chrono::steady_clock::now() >= nextShot;
+                bool held = false;
+                if (due && buffer->metadata().status == FrameMetadata::FrameSuccess) {
+                    std::string name = filePath;
+                    if (config.shotCount > 1) {
+                        char index[16];
+                        snprintf(index, sizeof(index), "_%04d", shots);
+                        name = base + index + extension;
+                    }
+                    held = processBuffer(request, name);
+
+                    // Sensor time between two shots, what the burst actually sustains
+                    int64_t timestamp = buffer->metadata().timestamp;
+                    if (lastShot)
+                        shotToShot.record(timestamp - lastShot);
+                    lastShot = timestamp;
+                    nextShot += std::chrono::milliseconds(config.shotInterval);
+                    shots++;
+
+                    // A slow shot skips the slots it overran instead of catching up in a burst
+                    auto now = std::chrono::steady_clock::now();
+                    if (config.shotInterval > 0 && nextShot <= now) {
+                        auto interval = std::chrono::milliseconds(config.shotInterval);
+                        int64_t missed = (now - nextShot) / interval + 1;
+                        nextShot += missed * interval;
+                        std::cerr << "Shot " << shots - 1 << " overran the interval, " << missed
+                                  << " slots missed" << std::endl;
+                        syslog(LOG_WARNING, "shot %d overran the interval, %lld slots missed", shots - 1,
+                               static_cast<long long>(missed));
+                    }
+                }
 
-            processBuffer(buffers[0].get());
+                if (!held)
+                    queueAgain(request);
+            }
+
+            // The writers may still hold camera buffers, they go back before stopping
+            writer->flush();
+            streaming = false;
             camera->stop();
+            requests.clear();
+
+            const LatencyHistogram &writeTime = writer->writeTime();
+            std::cout << "Wrote " << writer->writtenCount() << " pictures (" << writer->failedCount()
+                      << " failed) with " << config.writerOptions.threads << " writer threads: p50 "
+                      << writeTime.percentile(0.5) / 1e6 << " ms, max " << writeTime.max() / 1e6
+                      << " ms per picture" << std::endl;
+            writer.reset();
+
+            if (shotToShot.count()) {
+                std::cout << "Shot to shot over " << shots << " shots: p50 " << shotToShot.percentile(0.5) / 1e6
+                          << " ms, p99 " << shotToShot.percentile(0.99) / 1e6 << " ms, max "
+                          << shotToShot.max() / 1e6 << " ms" << std::endl;
+                syslog(LOG_INFO, "%d shots, shot to shot p50 %.2f ms max %.2f ms", shots,
+                       shotToShot.percentile(0.5) / 1e6, shotToShot.max() / 1e6);
+            }
+
+            std::cout << "Frame timings:" << std::endl << frameStats.summary();
+            frameStats.log();
         }
         
         void stopCamera(){
             if(camera && stop == 0){
-                allocator->free(streamConfig->stream());
-                delete allocator;
-                camera->release();
-                camera.reset();
-                cameraManager->stop();
+                session.close();
+                camera = nullptr;
                 stop = 1;
             }
         };
 
     private:
-        std::shared_ptr<CameraManager> cameraManager;
-        std::shared_ptr<Camera> camera;
-        std::unique_ptr<CameraConfiguration> cameraConfig;
+        StillConfig config;
+        CameraSession session;
+        Camera * camera = nullptr;
+        CameraConfiguration * cameraConfig;
         StreamConfiguration * streamConfig;
-        FrameBufferAllocator * allocator;
-        SensorConfiguration sensorConfig;
         
         int stop;
 
+        std::vector<std::unique_ptr<Request>> requests;
+        std::unique_ptr<ImageWriter> writer;
+        std::atomic<bool> streaming;
+        std::atomic<unsigned int> heldByWriter;
+        unsigned int maxHeldByWriter;
+        unsigned int rawBitDepth = 0;
+        std::string rawOrder;
+
         std::mutex mtx;
         std::condition_variable cond_variable;
-        bool requestResult;
+        std::deque<Request *> completed;
+        FrameStats frameStats;
+
+        /*
+         * Time to first frame of this capture. The sensor timestamp, the start
+         * of the frame readout, shares CLOCK_MONOTONIC with steady_clock.
+         */
+        void reportFirstFrame(const std::string &powerState, std::chrono::steady_clock::time_point startTime,
+                              std::chrono::steady_clock::time_point started, uint64_t sensorTimestamp) {
+            auto now = std::chrono::steady_clock::now();
+            int64_t start = std::chrono::duration_cast<std::chrono::nanoseconds>(startTime.time_since_epoch()).count();
+            double startMs = std::chrono::duration<double, std::milli>(started - startTime).count();
+            double sensorMs = (static_cast<int64_t>(sensorTimestamp) - start) / 1e6;
+            double firstFrameMs = std::chrono::duration<double, std::milli>(now - startTime).count();
+
+            // Cold when the sensor had to be powered, warm when it was in standby
+            const char *kind = powerState == "suspended" ? "cold" : powerState == "active" ? "warm" : "unknown";
+            std::cout << "Time to first frame (" << kind << " start): " << firstFrameMs << " ms, start() "
+                      << startMs << " ms, sensor frame at " << sensorMs << " ms" << std::endl;
+            syslog(LOG_INFO, "%s start, time to first frame %.2f ms, start() %.2f ms, sensor frame at %.2f ms",
+                   kind, firstFrameMs, startMs, sensorMs);
+        }
 
+        /* Orientation and sensor mode are the session's, the stream is ours */
         bool setConfig(){
-            
-            if (hflip)
-                cameraConfig->orientation = cameraConfig->orientation * libcamera::Transform::HFlip;
-            if(vflip)
-                cameraConfig->orientation = cameraConfig->orientation * libcamera::Transform::VFlip;
-            
-            sensorConfig.analogCrop = Rectangle(modes[mode].cropLeft, modes[mode].cropTop, modes[mode].cropWidth, modes[mode].cropHeight);
-            sensorConfig.bitDepth = modes[mode].bitDepth;
-            sensorConfig.binning.binX = modes[mode].binning;
-            sensorConfig.binning.binY = modes[mode].binning;
-            sensorConfig.skipping.xOddInc = 1;
-            sensorConfig.skipping.xEvenInc = 1;
-            sensorConfig.skipping.yOddInc = 1;
-            sensorConfig.skipping.yEvenInc = 1;
-            sensorConfig.outputSize = Size(modes[mode].width, modes[mode].height);
-
-            if(!sensorConfig.isValid()){
-                return false;
+            const SensorMode &mode = session.sensorMode();
+            if (config.rawStream) {
+                // The Raw stream is the sensor output itself, at the size of the mode
+                streamConfig->size = Size(mode.width, mode.height);
+                streamConfig->pixelFormat = mode.bitDepth == 10 ? formats::SRGGB10_CSI2P : formats::SRGGB12_CSI2P;
+            } else {
+                streamConfig->size.width = config.width;
+                streamConfig->size.height = config.height;
+                streamConfig->pixelFormat = formats::XRGB8888;
             }
-        
-            cameraConfig->sensorConfig = std::optional<SensorConfiguration>(sensorConfig);
-            streamConfig->size.width = width;
-            streamConfig->size.height = height;
-            streamConfig->pixelFormat = formats::XRGB8888;
+            // A buffer being saved, one being filled and spares for the sensor to keep streaming
+            if (config.shotCount > 1 && streamConfig->bufferCount < 4)
+                streamConfig->bufferCount = 4;
 
             CameraConfiguration::Status res = cameraConfig->validate();
             if (res == CameraConfiguration::Invalid){
@@ -189,82 +295,123 @@ class CameraTestApp {
                 return false;
             } 
 
-            camera->configure(cameraConfig.get());
-            return true;
+            // Validation sets the Bayer order matching the flips, e.g. SBGGR12_CSI2P
+            if (config.rawStream) {
+                std::string name = streamConfig->pixelFormat.toString();
+                const std::string suffix = "_CSI2P";
+                if (name.size() != 1 + 4 + 2 + suffix.size() || name[0] != 'S' ||
+                    name.compare(7, suffix.size(), suffix) != 0) {
+                    std::cerr << "Raw format " << name << " not supported, must be CSI-2 packed Bayer" << std::endl;
+                    return false;
+                }
+                rawOrder = name.substr(1, 4);
+                rawBitDepth = std::stoi(name.substr(5, 2));
+            }
+
+            return session.configure();
         }
 
         void onRequestCompleted(Request * request){
-            if(request->status() == Request::RequestCancelled){
-                requestResult = false; 
-            } else {
-                requestResult = true;
+            if(request->status() != Request::RequestCancelled){
+                const FrameMetadata &metadata = request->buffers().at(streamConfig->stream())->metadata();
+                frameStats.begin(metadata.sequence, metadata.timestamp);
+                frameStats.stamp(metadata.sequence, FrameStats::Completed);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                completed.push_back(request);
             }
             cond_variable.notify_one();
         }
 
-        void waitForRequest() {
+        void queueAgain(Request *request) {
+            if (!streaming)
+                return;
+            request->reuse(Request::ReuseBuffers);
+            camera->queueRequest(request);
+        }
+
+        Request *waitForRequest() {
             std::unique_lock<std::mutex> lock(mtx);
-            cond_variable.wait(lock, [this]() { return requestResult; });
+            cond_variable.wait(lock, [this]() { return !completed.empty(); });
+            Request *request = completed.front();
+            completed.pop_front();
+            return request;
         }
 
-        void processBuffer(FrameBuffer * buffer) {
-           // Access the first plane of the FrameBuffer
-            FrameBuffer::Plane plane = buffer->planes()[0];
-            
-            // Get the DMA-BUF file descriptor
-            int fd = plane.fd.get();
-            
-            // Get the length of the plane data
-            size_t length = plane.length;
-            size_t offset = plane.offset;
-            // Map the DMA-BUF to memory at the correct offset
-            uint8_t *mappedData = static_cast<uint8_t *>(mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset));
-            if (mappedData == MAP_FAILED) {
-                std::cerr << "Failed to mmap buffer" << std::endl;
-                return;
-            }
-            // Allocate a contiguous buffer for the image data
-            size_t rowSize = width * 4; // Assuming 4 bytes per pixel (XRGB8888)
-
-            int numberUnsuedBytes = (0x40 - (rowSize % 0x40)) % 0x40 ;
-            size_t paddedRowSize = rowSize + numberUnsuedBytes; // Padded row size
-            uint8_t *contiguousData = new uint8_t[height * rowSize];
-            
-            // Copy data from the padded buffer to the contiguous buffer
-            for (int y = 0; y < height; ++y) {
-                std::memcpy(contiguousData + y * rowSize, mappedData + y * paddedRowSize, rowSize);
+        /*
+         * Hand the frame of a request to the writers. Returns true when they
+         * write it from the camera buffer itself, the request then goes back
+         * to the camera once the picture is written.
+         */
+        bool processBuffer(Request *request, const std::string &fileName) {
+            FrameBuffer *buffer = request->buffers().at(streamConfig->stream());
+            // The first plane was mapped, at its offset, when the buffers were allocated
+            const std::vector<MappedBufferCache::Plane> &planes = session.mappedBuffers().find(buffer);
+            if (planes.empty()) {
+                std::cerr << "Buffer is not mapped" << std::endl;
+                return false;
             }
-
-            try {
-                // Create a cv::Mat object from the contiguous data
-                cv::Mat img(height, width, CV_8UC4, contiguousData);
-
-                // Save the image as PNG
-                if (!cv::imwrite("output_image.png", img)) {
-                    std::cerr << "Failed to write image file" << std::endl;
-                }
-            } catch (const cv::Exception &e) {
-                std::cerr << "OpenCV exception: " << e.what() << std::endl;
+            unsigned int sequence = buffer->metadata().sequence;
+            frameStats.stamp(sequence, FrameStats::Mapped);
+
+            // Blocks while every pool image is still being written
+            ImageWriter::Image *image = writer->acquire();
+            image->width = streamConfig->size.width;
+            image->height = streamConfig->size.height;
+            image->fileName = fileName;
+            image->sequence = sequence;
+            image->bitDepth = config.rawStream ? rawBitDepth : 0;
+            image->bayerOrder = rawOrder;
+            image->unpack = config.rawUnpack;
+            image->timestamp = buffer->metadata().timestamp;
+
+            // cv::Mat and the raw writer both follow the stride, the mapped rows are used as they are
+            if (heldByWriter < maxHeldByWriter) {
+                heldByWriter++;
+                image->data = planes[0].data;
+                image->stride = streamConfig->stride;
+                image->cookie = request;
+                writer->submit(image);
+                return true;
             }
 
-            // Clean up
-            delete[] contiguousData;
-
-            // Unmap the memory
-            if (munmap(mappedData, length) == -1) {
-                std::cerr << "Failed to unmap buffer" << std::endl;
-            }
+            // Out of spare camera buffers, copy so this one can go back to the sensor at once
+            size_t rowSize = config.rawStream ? image->width * rawBitDepth / 8 : image->width * 4;
+            // Only allocates the first time each pool image is used
+            image->pixels.resize(image->height * rowSize);
+            for (int y = 0; y < image->height; ++y)
+                std::memcpy(image->pixels.data() + y * rowSize, planes[0].data + y * streamConfig->stride, rowSize);
+            image->data = image->pixels.data();
+            image->stride = rowSize;
+            image->cookie = nullptr;
+            frameStats.stamp(sequence, FrameStats::Converted);
+
+            writer->submit(image);
+            return false;
         }
 
 };
 
-int imageProcessing() {
-    CameraTestApp cam;
+int imageProcessing(const StillConfig &config) {
+    CameraTestApp cam(config);
     if(!cam.startCamera())
         return EXIT_FAILURE;
     if(cam.allocateFrameBuffer() != 0)
         return EXIT_FAILURE;
-    cam.capureImage("test.jpeg");
+    std::string extension = config.rawStream ? ".raw" : ImageWriter::extension(config.writerOptions.format);
+    for (int capture = 0; capture < config.captures; capture++) {
+        // The camera is stopped in between, the driver keeps the sensor in standby or powers it off
+        if (capture > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(config.capturePause));
+        std::string name = "output_image";
+        if (config.captures > 1) {
+            char index[16];
+            snprintf(index, sizeof(index), "_c%02d", capture);
+            name += index;
+        }
+        cam.capureImage(name + extension);
+    }
     cam.stopCamera();
     
     return 0;
@@ -281,74 +428,173 @@ int main(int argc, char * argv[]){
                         << "\t-H Horizontal flip" << std::endl
                         << "\t-e exposure time"<< std::endl
                         << "\t-a analogue gain"<< std::endl
-                        << "\t-m functioning mode"<< std::endl;
+                        << "\t-m sensor mode, an index of the -l list (default: 0)"<< std::endl
+                        << "\t-l list the sensor modes of the camera and exit" << std::endl
+                        << "\t-C camera, libcamera id or index (default: the first one)" << std::endl
+                        << "\t-n number of pictures, numbered from output_image_0000.png (default: 1)" << std::endl
+                        << "\t-t minimum milliseconds between pictures (default: 0, every frame)" << std::endl
+                        << "\t-F picture format: png (default), jpeg or raw" << std::endl
+                        << "\t-c png compression level, 0-9 (default: 1)" << std::endl
+                        << "\t-q jpeg quality, 0-100 (default: 90)" << std::endl
+                        << "\t-W writer threads (default: 2)" << std::endl
+                        << "\t-R save the sensor Bayer data of the Raw stream, CSI-2 packed, with a header" << std::endl
+                        << "\t-U with -R, unpack to 16 bits per pixel" << std::endl
+                        << "\t-r number of captures, stopping the camera in between, for the time to first frame (default: 1)" << std::endl
+                        << "\t-p milliseconds the camera stays stopped between two captures (default: 0)" << std::endl;
             // Add other options here
             return 0;
         }
     }
 
-    height = 1024; 
-    width = 1024;
-    hflip = 0;
-    vflip = 0;
-
-    mode = 0;
-    exposure = -1;
-    analog_gain = -1;
+    StillConfig config;
+    config.height = 1024; 
+    config.width = 1024;
+    config.hflip = 0;
+    config.vflip = 0;
+
+    config.mode = 0;
+    config.exposure = -1;
+    config.analogueGain = -1;
+    config.shotCount = 1;
+    config.shotInterval = 0;
+    config.writerOptions = ImageWriter::Options();
+    config.rawStream = false;
+    config.rawUnpack = false;
+    config.captures = 1;
+    config.capturePause = 0;
+    bool listModes = false;
 
     int opt;
     optind = 1;
     double exp_mult;
-    while((opt = getopt(argc,argv, "h:w:VHi:j:e:m:a:")) != -1){
+    while((opt = getopt(argc,argv, "h:w:VHi:j:e:m:a:n:t:F:c:q:W:RUC:r:p:l")) != -1){
         switch(opt){
             case 'h':
-                height = atoi(optarg);
-                if (height <= 0) {
+                config.height = atoi(optarg);
+                if (config.height <= 0) {
                     std::cerr << "Height not valid, must be positive integer greather than 0" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
             case 'w':
-                width = atoi(optarg);
-                if (width <= 0) {
+                config.width = atoi(optarg);
+                if (config.width <= 0) {
                     std::cerr << "Width not valid, must be positive integer greather than 0" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
             case 'V':
-                vflip = 1;
+                config.vflip = 1;
                 break;
             case 'H':
-                hflip = 1;
+                config.hflip = 1;
                 break;
             case 'e':
                 exp_mult = atof(optarg);
-                exposure = exp_mult * 10000;
-                if(exposure < 0) {
+                config.exposure = exp_mult * 10000;
+                if(config.exposure < 0) {
                     std::cerr << "Exposure is not valid, must be positive integer" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
             case 'm':
-                mode = atoi(optarg);
-                if(mode < 0 || mode >= 4) {
-                    std::cerr << "There is only four modes (0-3) available" << std::endl;
+                config.mode = atoi(optarg);
+                if(config.mode < 0) {
+                    std::cerr << "Mode not valid, must be positive integer or 0, see -l" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
             case 'a':
-                analog_gain = atof(optarg);
-                if(analog_gain < 0) {
+                config.analogueGain = atof(optarg);
+                if(config.analogueGain < 0) {
                     std::cerr << "Analog Gain is not valid, must be positive integer" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
+            case 'n':
+                config.shotCount = atoi(optarg);
+                if (config.shotCount <= 0) {
+                    std::cerr << "Number of pictures not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't':
+                config.shotInterval = atoi(optarg);
+                if (config.shotInterval < 0) {
+                    std::cerr << "Interval not valid, must be positive integer or 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'F':
+                if (strcmp(optarg, "png") == 0) {
+                    config.writerOptions.format = ImageWriter::Format::PNG;
+                } else if (strcmp(optarg, "jpeg") == 0) {
+                    config.writerOptions.format = ImageWriter::Format::JPEG;
+                } else if (strcmp(optarg, "raw") == 0) {
+                    config.writerOptions.format = ImageWriter::Format::Raw;
+                } else {
+                    std::cerr << "Picture format not valid, must be png, jpeg or raw" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'c':
+                config.writerOptions.pngLevel = atoi(optarg);
+                if (config.writerOptions.pngLevel < 0 || config.writerOptions.pngLevel > 9) {
+                    std::cerr << "PNG compression level not valid, must be between 0 and 9" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'q':
+                config.writerOptions.jpegQuality = atoi(optarg);
+                if (config.writerOptions.jpegQuality < 0 || config.writerOptions.jpegQuality > 100) {
+                    std::cerr << "JPEG quality not valid, must be between 0 and 100" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'W':
+                if (atoi(optarg) <= 0) {
+                    std::cerr << "Writer threads not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                config.writerOptions.threads = atoi(optarg);
+                break;
+            case 'R':
+                config.rawStream = true;
+                break;
+            case 'U':
+                config.rawUnpack = true;
+                break;
+            case 'C':
+                config.cameraId = optarg;
+                break;
+            case 'r':
+                config.captures = atoi(optarg);
+                if (config.captures <= 0) {
+                    std::cerr << "Number of captures not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'p':
+                config.capturePause = atoi(optarg);
+                if (config.capturePause < 0) {
+                    std::cerr << "Pause not valid, must be positive integer or 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'l':
+                listModes = true;
+                break;
         }
     }
 
+    if (listModes)
+        return CameraSession::listModes(config, std::cout) ? 0 : EXIT_FAILURE;
+
 
     openlog("imx477-client", LOG_PID | LOG_CONS, LOG_USER);
-    int ret = imageProcessing();
+    // Enough images for every writer to be busy while the next picture is copied
+    config.writerOptions.images = config.writerOptions.threads + 2;
+    int ret = imageProcessing(config);
     closelog();
     return ret;
 }
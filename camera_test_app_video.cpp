@@ -1,4 +1,6 @@
 #include <iomanip>
+#include <cmath>
+#include <getopt.h>
 #include <unistd.h>
 #include <iostream>
 #include <memory>
@@ -6,7 +8,15 @@
 #include <mutex>
 #include <chrono>
 #include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <random>
+#include <sstream>
+#include <pthread.h>
+#include <time.h>
 #include <sys/mman.h>
+#include <signal.h>
 #include <syslog.h>
 
 extern "C" {
@@ -22,163 +32,770 @@ extern "C" {
 #include <opencv2/opencv.hpp>
 #include <libcamera/control_ids.h>
 
+#include "camera_session.h"
+#include "colour_convert.h"
+#include "control_channel.h"
+#include "embedded_data.h"
+#include "frame_pairer.h"
+#include "frame_publisher.h"
+#include "frame_queue.h"
+#include "frame_stats.h"
+#include "mapped_buffer.h"
+#include "metadata_log.h"
+#include "preview_sink.h"
+#include "segmented_output.h"
+#include "thread_util.h"
+#include "v4l2_encoder.h"
 
 using namespace libcamera;
 using namespace std::chrono_literals;
 
-int height; 
-int width;
-bool hflip;
-bool vflip;
+enum class EncoderBackend { Software, V4L2 };
+// --benchmark sweeps every mode with each of these sizes and formats
+enum class BenchmarkOutput { None, CSV, JSON };
+// libx264 tuning, the hardware encoder only follows bitrate, gop and rate control
+enum class RateControl { ABR, CBR, CRF };
+
+constexpr unsigned int kPreviewBuffers = 4;
+
+/* Everything a recording session is set up from, filled in by main() */
+struct VideoConfig : SessionConfig {
+    int durationSeconds;
+    int statsInterval;
+    int warmupSeconds;
+    const char *outputFile;
+    // Container, guessed from the file name unless set, "null" discards everything
+    const char *outputFormat;
+    // Per-frame sensor metadata file next to the recording, off when null
+    const char *metadataFile;
+    // Segment length, disk cap and pre-roll of the output, none of them set writes a single file
+    int segmentSeconds;
+    uint64_t maxDiskBytes;
+    int preRollSeconds;
+    int postRollSeconds;
+    int queueDepth;
+    int ringSize;
+    PixelFormat pixelFormat;
+
+    EncoderBackend encoderBackend;
+    const char *encoderDevice;
+    int bitrate;
+    int gopSize;
+
+    // Low resolution Viewfinder stream next to the recording one, off when previewSize is null
+    Size previewSize;
+    PixelFormat previewFormat;
+    int previewFps;
+    const char *previewShm;
+    // Unix socket lending the preview buffers to other processes, off when null
+    const char *publishSocket;
+
+    BenchmarkOutput benchmarkOutput;
+    std::vector<Size> benchmarkSizes;
+    std::vector<PixelFormat> benchmarkFormats;
+
+    RateControl rateControl;
+    int crf;
+    const char *preset;
+    const char *tune;
+    int encoderThreads;
+    int threadType;
+    // Threads converting XRGB8888 input, the encoder thread included, 0 for automatic
+    int convertThreads;
+
+    // Exposure, gain and frame rate commands read from stdin while recording
+    bool controlStdin;
+
+    // Sensor embedded data into the metadata file, from embeddedNode or the node found by name when null
+    bool embeddedData;
+    const char *embeddedNode;
+
+    // Cameras recorded together, the first one the XVS source unless the trigger is off
+    std::vector<std::string> syncCameras;
+    bool hardwareTrigger;
+    // Frames of the cameras paired by sensor timestamp, off when null
+    const char *pairFile;
+
+    // CPU affinity and priority of the pipeline's threads by stage, see ThreadRegistry
+    std::map<std::string, ThreadPolicy> threadPolicies;
+};
 
-int durationSeconds;
+// SIGUSR1 count, every encoder with a pre-roll turns a new one into a trigger
+static std::atomic<unsigned int> triggerSignals{0};
 
-double analog_gain;
-int exposure;
-int mode;
+static void releaseNothing(void *, uint8_t *) {}
 
+/* Bands of the XRGB8888 conversion, one per core up to 4 unless set */
+static unsigned int convertThreads(const VideoConfig &config) {
+    if (config.convertThreads > 0)
+        return config.convertThreads;
+    return std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+}
 
-struct mode_struct {
-        int bitDepth;
-        int width;
-        int height;
-        int binning;
-        int cropLeft;
-        int cropTop;
-        int cropWidth;
-        int cropHeight;
-        int fps;
-};
+/*
+ * H.264 encoding and muxing of one session, with libx264 or the V4L2 mem2mem
+ * encoder, into a single file or a segmented output. Frame timings go to the
+ * session's FrameStats.
+ */
+class VideoEncoder {
+    public:
+        VideoEncoder(const VideoConfig &videoConfig, const CameraSession &cameraSession, FrameStats &stats)
+            : config(videoConfig), session(cameraSession), frameStats(stats) {}
 
-static const mode_struct modes[] = {
-        {.bitDepth= 12, .width= 4056, .height= 3040, .binning = 1, .cropLeft =   8, .cropTop =  16, .cropWidth = 4056, .cropHeight = 3040, .fps = 10},
-        {.bitDepth= 12, .width= 2028, .height= 1520, .binning = 2, .cropLeft =   8, .cropTop =  16, .cropWidth = 4056, .cropHeight = 3040, .fps = (30 / 10)},
-        {.bitDepth= 12, .width= 2028, .height= 1080, .binning = 2, .cropLeft =   8, .cropTop = 456, .cropWidth = 4056, .cropHeight = 2160, .fps = (40 / 10)},
-        {.bitDepth= 10, .width= 1332, .height= 990 , .binning = 2, .cropLeft = 704, .cropTop = 544, .cropWidth = 2664, .cropHeight = 1980, .fps = (120 / 10)}
-    
-};
+        ~VideoEncoder() {
+            cleanupFFmpeg();
+        }
 
-AVFormatContext *formatContext = nullptr;
-AVCodecContext *codecContext = nullptr;
-AVStream *videoStream = nullptr;
-SwsContext *swsContext = nullptr;
-AVFrame *yuvFrame = nullptr;
-int64_t pts = 0;
-
-void initFFmpeg(const char *filename) {
-    if (avformat_alloc_output_context2(&formatContext, nullptr, nullptr, filename) < 0)
-        throw std::runtime_error("Could not allocate format context");
-
-    const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
-    if (!codec)
-        throw std::runtime_error("H.264 encoder not found");
-
-    codecContext = avcodec_alloc_context3(codec);
-    codecContext->width = width;
-    codecContext->height = height;
-    codecContext->time_base = {1, modes[mode].fps};
-    codecContext->framerate = {modes[mode].fps, 1};
-    codecContext->pix_fmt = AV_PIX_FMT_YUV420P;
-    codecContext->bit_rate = 400'000;
-
-    if (formatContext->oformat->flags & AVFMT_GLOBALHEADER)
-        codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
-    
-    AVDictionary* param = nullptr;
-    av_dict_set(&param, "present", "ultrafast", 0);
+        // Hardware backend, taking the camera buffers and handing them back through inputDone
+        V4L2Encoder v4l2Encoder;
+
+        bool hardwareEncoder() const { return hardware; }
+        bool isSegmented() const { return segmented; }
+        const SegmentedOutput &segments() const { return segmentedOutput; }
+        int64_t warmupFrames() const { return warmupLength; }
+        uint64_t warmupAllocations() const { return warmupAllocs; }
+        uint64_t steadyAllocations() const { return steadyAllocs; }
+
+        /* Pts of a frame in encoderTimeBase, from its sensor timestamp */
+        int64_t framePts(const FrameBuffer *buffer) {
+            int64_t timestamp = buffer->metadata().timestamp;
+            if (firstTimestamp < 0)
+                firstTimestamp = timestamp;
+
+            // The muxer needs strictly increasing pts, even if two timestamps round the same
+            int64_t framePts = (timestamp - firstTimestamp) / 1000;
+            if (framePts <= lastPts)
+                framePts = lastPts + 1;
+            lastPts = framePts;
+            return framePts;
+        }
 
-    if (avcodec_open2(codecContext, codec, &param) < 0)
-        throw std::runtime_error("Failed to open codec");
+        void initFFmpeg(const char *filename, const StreamConfiguration &stream,
+                        const std::vector<std::unique_ptr<FrameBuffer>> &buffers, const MappedBufferCache &mapped) {
+            openOutput(filename);
+
+            const AVCodec *codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+            if (!codec)
+                throw std::runtime_error("H.264 encoder not found");
+
+            inputFormat = stream.pixelFormat;
+            inputStride = stream.stride;
+
+            codecContext = avcodec_alloc_context3(codec);
+            codecContext->width = stream.size.width;
+            codecContext->height = stream.size.height;
+            codecContext->time_base = encoderTimeBase;
+            codecContext->framerate = {fps(), 1};
+            codecContext->pix_fmt = inputFormat == formats::NV12 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+            if (config.gopSize > 0)
+                codecContext->gop_size = config.gopSize;
+            codecContext->thread_count = config.encoderThreads;
+            codecContext->thread_type = config.threadType;
+
+            if (formatContext->oformat->flags & AVFMT_GLOBALHEADER)
+                codecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+            
+            AVDictionary* param = nullptr;
+            av_dict_set(&param, "preset", config.preset, 0);
+            if (config.tune)
+                av_dict_set(&param, "tune", config.tune, 0);
+
+            switch (config.rateControl) {
+                case RateControl::ABR:
+                    codecContext->bit_rate = config.bitrate;
+                    break;
+                case RateControl::CBR:
+                    // Same rate for the average, the ceiling and the VBV buffer (one second)
+                    codecContext->bit_rate = config.bitrate;
+                    codecContext->rc_min_rate = config.bitrate;
+                    codecContext->rc_max_rate = config.bitrate;
+                    codecContext->rc_buffer_size = config.bitrate;
+                    av_dict_set(&param, "nal-hrd", "cbr", 0);
+                    break;
+                case RateControl::CRF:
+                    av_dict_set_int(&param, "crf", config.crf, 0);
+                    break;
+            }
 
-    videoStream = avformat_new_stream(formatContext, nullptr);
-    if (!videoStream)
-        throw std::runtime_error("Failed to create stream");
+            int ret = avcodec_open2(codecContext, codec, &param);
+            // Anything left over wasn't recognised, x264 would otherwise ignore it silently
+            AVDictionaryEntry *unused = nullptr;
+            while ((unused = av_dict_get(param, "", unused, AV_DICT_IGNORE_SUFFIX)))
+                std::cerr << "Encoder option " << unused->key << "=" << unused->value << " not used" << std::endl;
+            av_dict_free(&param);
+            if (ret < 0)
+                throw std::runtime_error("Failed to open codec");
+
+            std::cout << "Encoding with " << codec->name << ", config.preset " << config.preset
+                      << ", config.tune " << (config.tune ? config.tune : "none") << ", "
+                      << (codecContext->thread_count ? std::to_string(codecContext->thread_count) : "auto")
+                      << " " << (config.threadType == FF_THREAD_SLICE ? "slice" : "frame") << " threads" << std::endl;
+
+            if (avcodec_parameters_from_context(videoStream->codecpar, codecContext) < 0)
+                throw std::runtime_error("Failed to copy codec parameters");
+
+            writeHeader();
+            startMuxer();
+
+            encoderPacket = av_packet_alloc();
+            if (!encoderPacket)
+                throw std::runtime_error("Failed to allocate AVPacket");
+            warmupLength = fps();
+            warmupAllocs = 0;
+            steadyAllocs = 0;
+
+            // YUV input goes to the encoder as it is, one frame wrapping each camera buffer
+            if (inputFormat != formats::XRGB8888) {
+                for (const std::unique_ptr<FrameBuffer> &buffer : buffers) {
+                    AVFrame *frame = wrapFrameBuffer(mapped.find(buffer.get()));
+                    if (!frame)
+                        throw std::runtime_error("Failed to wrap frame buffer");
+                    wrappedFrames[buffer.get()] = frame;
+                }
+                return;
+            }
 
-    videoStream->time_base = codecContext->time_base;
-    if (avcodec_parameters_from_context(videoStream->codecpar, codecContext) < 0)
-        throw std::runtime_error("Failed to copy codec parameters");
+            converter.start(convertThreads(config));
+            std::cout << "Converting XRGB8888 with " << converter.threads() << " threads, "
+                      << colourConvertKernel() << " kernel" << std::endl;
 
-    if (avio_open(&formatContext->pb, filename, AVIO_FLAG_WRITE) < 0)
-        throw std::runtime_error("Failed to open output file");
+            // One frame being encoded and one being converted, frame threading holds more
+            int poolSize = config.threadType == FF_THREAD_FRAME ? std::max(codecContext->thread_count, 1) + 1 : 2;
+            for (int i = 0; i < poolSize; i++) {
+                if (!allocConvertFrame())
+                    throw std::runtime_error("Failed to allocate frame buffer");
+            }
+        }
 
-    if (avformat_write_header(formatContext, nullptr) < 0)
-        throw std::runtime_error("Failed to write header");
+        /*
+         * Open the V4L2 mem2mem encoder, which imports the camera dmabufs directly.
+         * Returns false, leaving nothing behind, when the device or the stream format
+         * can't be used so the caller can fall back to software encoding.
+         */
+        bool initV4L2Encoder(const char *filename, const StreamConfiguration &stream) {
+            uint32_t fourcc;
+            if (stream.pixelFormat == formats::YUV420) {
+                fourcc = V4L2_PIX_FMT_YUV420;
+            } else if (stream.pixelFormat == formats::NV12) {
+                fourcc = V4L2_PIX_FMT_NV12;
+            } else {
+                std::cerr << "Hardware encoder needs YUV420 or NV12 input" << std::endl;
+                return false;
+            }
 
-    swsContext = sws_getContext(codecContext->width, codecContext->height, AV_PIX_FMT_RGB32,
-                                codecContext->width, codecContext->height, AV_PIX_FMT_YUV420P,
-                                SWS_BILINEAR, nullptr, nullptr, nullptr);
+            V4L2Encoder::Config encoderConfig = {
+                .device = config.encoderDevice,
+                .width = static_cast<int>(stream.size.width),
+                .height = static_cast<int>(stream.size.height),
+                .stride = static_cast<int>(stream.stride),
+                .fourcc = fourcc,
+                .bitrate = config.bitrate,
+                .constantBitrate = config.rateControl == RateControl::CBR,
+                .gop = config.gopSize,
+                .fps = fps(),
+            };
+            v4l2Encoder.outputReady = [this](const uint8_t *data, size_t size, int64_t pts, bool keyframe) {
+                writeEncodedFrame(data, size, pts, keyframe);
+            };
+            if (v4l2Encoder.open(encoderConfig) < 0)
+                return false;
 
-    yuvFrame = av_frame_alloc();
-    yuvFrame->format = AV_PIX_FMT_YUV420P;
-    yuvFrame->width = codecContext->width;
-    yuvFrame->height = codecContext->height;
-    if (av_frame_get_buffer(yuvFrame, 32) < 0)
-        throw std::runtime_error("Failed to allocate frame buffer");
-}
+            openOutput(filename);
+            AVCodecParameters *par = videoStream->codecpar;
+            par->codec_type = AVMEDIA_TYPE_VIDEO;
+            par->codec_id = AV_CODEC_ID_H264;
+            par->width = stream.size.width;
+            par->height = stream.size.height;
+            par->format = fourcc == V4L2_PIX_FMT_NV12 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+            par->bit_rate = config.bitrate;
+
+            encodedPacket = av_packet_alloc();
+            inputFormat = stream.pixelFormat;
+            inputStride = stream.stride;
+            hardware = true;
+            startMuxer();
+            return true;
+        }
 
-void cleanupFFmpeg() {
-    // Flush encoder
-    avcodec_send_frame(codecContext, nullptr);
+        /*
+         * Hand a frame to the hardware encoder, which reads the dmabuf itself and
+         * gives the cookie back through v4l2Encoder.inputDone once done. Negative
+         * when the encoder can't take it, the buffer is then still ours.
+         */
+        int submitHardware(const FrameBuffer *buffer, size_t frameSize, int64_t pts, void *cookie) {
+            const FrameBuffer::Plane &plane = buffer->planes()[0];
+            submittedFrames++;
+            frameStats.submitted(buffer->metadata().sequence, pts);
+            return v4l2Encoder.encode(plane.fd.get(), plane.offset, frameSize, pts, cookie);
+        }
 
-    AVPacket *pkt = av_packet_alloc();
-    if (!pkt) {
-        std::cerr << "Failed to allocate AVPacket\n";
-        return;
-    }
+        void cleanupFFmpeg() {
+            if (hardware) {
+                // Drains the frames still in flight through writeEncodedFrame()
+                v4l2Encoder.close();
+                stopMuxer();
+                closeOutput();
+                av_packet_free(&encodedPacket);
+                hardware = false;
+                return;
+            }
 
-    while (avcodec_receive_packet(codecContext, pkt) == 0) {
-        av_interleaved_write_frame(formatContext, pkt);
-        av_packet_unref(pkt);
-    }
+            if (!codecContext)
+                return;
 
-    av_packet_free(&pkt);  // Free the allocated packet
+            // Flush encoder
+            avcodec_send_frame(codecContext, nullptr);
 
-    av_write_trailer(formatContext);
-    avcodec_free_context(&codecContext);
-    avio_closep(&formatContext->pb);
-    avformat_free_context(formatContext);
-    av_frame_free(&yuvFrame);
-    sws_freeContext(swsContext);
-}
+            AVPacket *pkt = encoderPacket;
+            while (avcodec_receive_packet(codecContext, pkt) == 0) {
+                queuePacket(pkt);
+                av_packet_unref(pkt);
+            }
 
-void encodeFrame(uint8_t *paddedData)
-{
-    size_t rowSize = width * 4;
-    int numberUnusedBytes = (0x40 - (rowSize % 0x40)) % 0x40;
-    size_t paddedRowSize = rowSize + numberUnusedBytes;
+            av_packet_free(&encoderPacket);
 
-    uint8_t *src[1] = { paddedData };
-    int srcStride[1] = { static_cast<int>(paddedRowSize) };
+            stopMuxer();
+            closeOutput();
+            avcodec_free_context(&codecContext);
+            converter.stop();
+            for (AVFrame *&frame : convertFrames)
+                av_frame_free(&frame);
+            convertFrames.clear();
 
-    sws_scale(swsContext, src, srcStride, 0, height,
-              yuvFrame->data, yuvFrame->linesize);
+            for (auto &[buffer, frame] : wrappedFrames)
+                av_frame_free(&frame);
+            wrappedFrames.clear();
+        }
 
-    yuvFrame->pts = pts++;
+        /* Whether the encoder dropped every reference it took to the buffer */
+        bool frameReleased(const FrameBuffer *buffer) {
+            auto it = wrappedFrames.find(buffer);
+            if (it == wrappedFrames.end())
+                return true;
 
-    AVPacket *pkt = av_packet_alloc();
-    if (!pkt) {
-        std::cerr << "Failed to allocate AVPacket\n";
-        return;
-    }
+            AVFrame *frame = it->second;
+            for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+                if (av_buffer_get_ref_count(frame->buf[i]) > 1)
+                    return false;
+            }
+            return true;
+        }
+
+        /*
+         * Encode one camera buffer as the frame of the given pts. Returns false when
+         * the encoder still references the buffer after the call, it must then not go
+         * back to the camera until frameReleased() says so.
+         */
+        bool encodeFrame(const FrameBuffer *buffer, const std::vector<MappedBufferCache::Plane> &planes, int64_t pts)
+        {
+            AVFrame *frame;
+
+            if (inputFormat == formats::XRGB8888) {
+                frame = freeConvertFrame();
+                if (!frame) {
+                    std::cerr << "Failed to allocate frame buffer\n";
+                    return true;
+                }
+                // Straight into the encoder's frame, the bands of the other threads alongside this one
+                converter.convert(planes[0].data, inputStride, codecContext->width, codecContext->height,
+                                  frame->data, frame->linesize, false);
+                frameStats.stamp(buffer->metadata().sequence, FrameStats::Converted);
+            } else {
+                auto it = wrappedFrames.find(buffer);
+                if (it == wrappedFrames.end()) {
+                    std::cerr << "Frame buffer not wrapped\n";
+                    return true;
+                }
+                frame = it->second;
+            }
+
+            frame->pts = pts;
+            submittedFrames++;
+            frameStats.submitted(buffer->metadata().sequence, frame->pts);
+
+            AVPacket *pkt = encoderPacket;
+            if (avcodec_send_frame(codecContext, frame) == 0) {
+                while (avcodec_receive_packet(codecContext, pkt) == 0) {
+                    queuePacket(pkt);
+                    av_packet_unref(pkt);
+                }
+            }
+
+            return frameReleased(buffer);
+        }
+
+
+    private:
+        const VideoConfig &config;
+        const CameraSession &session;
+        FrameStats &frameStats;
+
+        AVFormatContext *formatContext = nullptr;
+        AVCodecContext *codecContext = nullptr;
+        AVStream *videoStream = nullptr;
+        // XRGB8888 input only, to the YUV420 of the software encoder
+        ColourConverter converter;
+        AVRational encoderTimeBase;
+        // Frames handed to the encoder and the sensor timestamp their pts count from
+        int64_t submittedFrames = 0;
+        int64_t firstTimestamp = -1;
+        int64_t lastPts = -1;
+        bool headerWritten = false;
+
+        // Output split over several files, used instead of formatContext's own file when segmented
+        SegmentedOutput segmentedOutput;
+        bool segmented = false;
+        unsigned int seenTriggers = 0;
+
+        // The V4L2 bitstream comes back through writeEncodedFrame()
+        bool hardware = false;
+        AVPacket *encodedPacket = nullptr;
+
+        /*
+         * Muxer stage: encoded packets wait in muxQueue for the muxer thread,
+         * which alone writes the output, their AVPackets are reused from
+         * freePackets once written.
+         */
+        static constexpr size_t kMuxQueue = 64;
+        std::thread muxerThread;
+        std::mutex muxMutex;
+        std::condition_variable muxReady;
+        std::condition_variable muxSpace;
+        std::deque<AVPacket *> muxQueue;
+        std::vector<AVPacket *> freePackets;
+        bool muxStopping = false;
+
+        // Format and stride of the frames coming from the camera
+        PixelFormat inputFormat;
+        int inputStride = 0;
+        // Encoder frames wrapping each camera buffer, YUV420/NV12 input only
+        std::unordered_map<const FrameBuffer *, AVFrame *> wrappedFrames;
+
+        /*
+         * Software encoder buffers, built in initFFmpeg() and reused for every frame.
+         * The conversion frames form a pool because the encoder may still reference
+         * the previous picture while the next one is converted.
+         */
+        AVPacket *encoderPacket = nullptr;
+        std::vector<AVFrame *> convertFrames;
+
+        /*
+         * Allocations made by the encode path after initFFmpeg(), the pools only grow
+         * during warm-up while the encoder settles on how many frames it holds.
+         */
+        int64_t warmupLength = 0;
+        uint64_t warmupAllocs = 0;
+        uint64_t steadyAllocs = 0;
+
+        int fps() const { return session.sensorMode().fps; }
+
+        void countAllocation() {
+            if (submittedFrames < warmupLength)
+                warmupAllocs++;
+            else
+                steadyAllocs++;
+        }
+
+        /*
+         * Describe a mapped YUV420 or NV12 buffer as an AVFrame without copying it.
+         * The planes are reference counted buffers that never free anything, so the
+         * encoder takes references to them instead of copying the picture.
+         */
+        AVFrame *wrapFrameBuffer(const std::vector<MappedBufferCache::Plane> &planes) {
+            int numPlanes = inputFormat == formats::NV12 ? 2 : 3;
+            int chromaStride = inputFormat == formats::NV12 ? inputStride : inputStride / 2;
+            size_t lumaSize = static_cast<size_t>(inputStride) * codecContext->height;
+            size_t chromaSize = static_cast<size_t>(chromaStride) * (codecContext->height / 2);
+
+            AVFrame *frame = av_frame_alloc();
+            if (!frame)
+                return nullptr;
+            frame->format = codecContext->pix_fmt;
+            frame->width = codecContext->width;
+            frame->height = codecContext->height;
+
+            for (int i = 0; i < numPlanes; i++) {
+                uint8_t *data;
+                size_t length;
+
+                // Some pipelines hand out the whole image as one plane
+                if (planes.size() == 1) {
+                    data = planes[0].data + (i == 0 ? 0 : lumaSize + (i - 1) * chromaSize);
+                    length = i == 0 ? lumaSize : chromaSize;
+                } else {
+                    data = planes[i].data;
+                    length = planes[i].length;
+                }
 
-    if (avcodec_send_frame(codecContext, yuvFrame) == 0) {
-        while (avcodec_receive_packet(codecContext, pkt) == 0) {
+                frame->buf[i] = av_buffer_create(data, length, releaseNothing, nullptr, AV_BUFFER_FLAG_READONLY);
+                if (!frame->buf[i]) {
+                    av_frame_free(&frame);
+                    return nullptr;
+                }
+                frame->data[i] = data;
+                frame->linesize[i] = i == 0 ? inputStride : chromaStride;
+            }
+
+            return frame;
+        }
+
+        /*
+         * Output file, shared by both encoder backends. The header is written once the
+         * stream parameters are known. A segmented output only keeps formatContext for
+         * the stream parameters, each segment has its own context.
+         */
+        void openOutput(const char *filename) {
+            if (avformat_alloc_output_context2(&formatContext, nullptr, config.outputFormat, filename) < 0)
+                throw std::runtime_error("Could not allocate format context");
+
+            videoStream = avformat_new_stream(formatContext, nullptr);
+            if (!videoStream)
+                throw std::runtime_error("Failed to create stream");
+
+            // Microseconds, the pts follow the sensor timestamps so dropped frames leave a hole
+            encoderTimeBase = {1, 1'000'000};
+            videoStream->time_base = encoderTimeBase;
+            videoStream->avg_frame_rate = {fps(), 1};
+            submittedFrames = 0;
+            firstTimestamp = -1;
+            lastPts = -1;
+
+            segmented = config.segmentSeconds > 0 || config.preRollSeconds > 0;
+            seenTriggers = triggerSignals;
+            if (segmented || (formatContext->oformat->flags & AVFMT_NOFILE))
+                return;
+            if (avio_open(&formatContext->pb, filename, AVIO_FLAG_WRITE) < 0)
+                throw std::runtime_error("Failed to open output file");
+        }
+
+        void writeHeader() {
+            if (segmented) {
+                SegmentedOutput::Options options;
+                options.fileName = config.outputFile;
+                options.format = config.outputFormat;
+                options.segmentSeconds = config.segmentSeconds;
+                options.maxBytes = config.maxDiskBytes;
+                options.preRollSeconds = config.preRollSeconds;
+                options.postRollSeconds = config.postRollSeconds;
+                segmentedOutput.start(options, videoStream->codecpar, encoderTimeBase, videoStream->avg_frame_rate);
+                headerWritten = true;
+                return;
+            }
+            if (avformat_write_header(formatContext, nullptr) < 0)
+                throw std::runtime_error("Failed to write header");
+            headerWritten = true;
+        }
+
+        void writePacket(AVPacket *pkt) {
+            if (segmented) {
+                unsigned int signals = triggerSignals;
+                if (signals != seenTriggers) {
+                    seenTriggers = signals;
+                    segmentedOutput.trigger();
+                }
+                segmentedOutput.write(pkt);
+                return;
+            }
             pkt->stream_index = videoStream->index;
-            av_packet_rescale_ts(pkt, codecContext->time_base, videoStream->time_base);
+            av_packet_rescale_ts(pkt, encoderTimeBase, videoStream->time_base);
             av_interleaved_write_frame(formatContext, pkt);
-            av_packet_unref(pkt);
         }
-    }
 
-    av_packet_free(&pkt);
+        void closeOutput() {
+            if (segmented)
+                segmentedOutput.close();
+            else if (headerWritten)
+                av_write_trailer(formatContext);
+            headerWritten = false;
+            avio_closep(&formatContext->pb);
+            avformat_free_context(formatContext);
+            formatContext = nullptr;
+        }
+
+        /* Keep the SPS and PPS units of an Annex B keyframe as the stream extradata */
+        static void copyParameterSets(const uint8_t *data, size_t size, AVCodecParameters *par) {
+            auto startCode = [&](size_t from) {
+                for (size_t i = from; i + 3 <= size; i++) {
+                    if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+                        return i;
+                }
+                return size;
+            };
+
+            std::vector<uint8_t> sets;
+            size_t start = startCode(0);
+            while (start < size) {
+                size_t nal = start + 3;
+                size_t end = startCode(nal);
+                // The leading zero of a four byte start code belongs to the next unit
+                size_t unitEnd = (end < size && end > nal && data[end - 1] == 0) ? end - 1 : end;
+
+                int type = nal < size ? data[nal] & 0x1f : 0;
+                if (type == 7 || type == 8) {
+                    const uint8_t prefix[] = { 0, 0, 0, 1 };
+                    sets.insert(sets.end(), prefix, prefix + sizeof(prefix));
+                    sets.insert(sets.end(), data + nal, data + unitEnd);
+                }
+                start = end;
+            }
+
+            par->extradata = static_cast<uint8_t *>(av_mallocz(sets.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+            memcpy(par->extradata, sets.data(), sets.size());
+            par->extradata_size = sets.size();
+        }
+
+        /* Called from the V4L2 encoder thread for every encoded frame */
+        void writeEncodedFrame(const uint8_t *data, size_t size, int64_t framePts, bool keyframe) {
+            encodedPacket->data = const_cast<uint8_t *>(data);
+            encodedPacket->size = size;
+            encodedPacket->pts = framePts;
+            encodedPacket->dts = framePts;
+            encodedPacket->flags = keyframe ? AV_PKT_FLAG_KEY : 0;
+            // Not reference counted, the queue takes its own copy before the buffer goes back
+            queuePacket(encodedPacket);
+        }
+
+        void startMuxer() {
+            muxStopping = false;
+            muxerThread = std::thread(&VideoEncoder::muxerLoop, this);
+        }
+
+        /* Write out every packet still queued, the output can then be closed */
+        void stopMuxer() {
+            if (!muxerThread.joinable())
+                return;
+            {
+                std::lock_guard<std::mutex> lock(muxMutex);
+                muxStopping = true;
+            }
+            muxReady.notify_one();
+            muxerThread.join();
+            for (AVPacket *&packet : freePackets)
+                av_packet_free(&packet);
+            freePackets.clear();
+        }
+
+        /*
+         * Hand an encoded packet to the muxer thread, waiting while the queue
+         * is full: a packet can't be dropped without breaking the stream, a
+         * disk that is behind holds up the encoder, then the encoder ring.
+         */
+        void queuePacket(const AVPacket *pkt) {
+            std::unique_lock<std::mutex> lock(muxMutex);
+            muxSpace.wait(lock, [this]() { return muxQueue.size() < kMuxQueue; });
+
+            AVPacket *packet;
+            if (!freePackets.empty()) {
+                packet = freePackets.back();
+                freePackets.pop_back();
+            } else {
+                if (!hardware)
+                    countAllocation();
+                packet = av_packet_alloc();
+                if (!packet)
+                    return;
+            }
+            if (av_packet_ref(packet, pkt) < 0) {
+                freePackets.push_back(packet);
+                return;
+            }
+            muxQueue.push_back(packet);
+            lock.unlock();
+            muxReady.notify_one();
+        }
+
+        void muxerLoop() {
+            StageThread stage("muxer");
+            while (true) {
+                AVPacket *packet;
+                {
+                    std::unique_lock<std::mutex> lock(muxMutex);
+                    muxReady.wait(lock, [this]() { return muxStopping || !muxQueue.empty(); });
+                    if (muxQueue.empty())
+                        return;
+                    packet = muxQueue.front();
+                    muxQueue.pop_front();
+                }
+                muxSpace.notify_one();
+
+                bool write = true;
+                if (!headerWritten) {
+                    // A hardware file can only start on a keyframe, which carries the parameter sets
+                    write = packet->flags & AV_PKT_FLAG_KEY;
+                    if (write) {
+                        copyParameterSets(packet->data, packet->size, videoStream->codecpar);
+                        writeHeader();
+                    }
+                }
+                if (write) {
+                    frameStats.written(packet->pts);
+                    writePacket(packet);
+                }
+
+                av_packet_unref(packet);
+                std::lock_guard<std::mutex> lock(muxMutex);
+                freePackets.push_back(packet);
+            }
+        }
+
+        AVFrame *allocConvertFrame() {
+            AVFrame *frame = av_frame_alloc();
+            if (!frame)
+                return nullptr;
+            frame->format = AV_PIX_FMT_YUV420P;
+            frame->width = codecContext->width;
+            frame->height = codecContext->height;
+            if (av_frame_get_buffer(frame, 32) < 0) {
+                av_frame_free(&frame);
+                return nullptr;
+            }
+            convertFrames.push_back(frame);
+            return frame;
+        }
+
+        /* A conversion frame the encoder holds no reference to, the pool grows if there is none */
+        AVFrame *freeConvertFrame() {
+            for (AVFrame *frame : convertFrames) {
+                if (av_frame_is_writable(frame))
+                    return frame;
+            }
+            countAllocation();
+            return allocConvertFrame();
+        }
+};
+
+
+static double cpuSeconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
+/* Outcome of one capture run, measured after the warm-up */
+struct RunResult {
+    int mode;
+    int nominalFps;
+    Size size;
+    std::string format;
+    unsigned int frames;
+    double seconds;
+    double fps;
+    uint64_t sensorDrops;
+    uint64_t ringDrops;
+    // Percent of one core over the measurement window
+    double cpuCompletion;
+    double cpuEncoder;
+    double cpuProcess;
+    // Sensor timestamp to packet write, milliseconds
+    double latencyP50;
+    double latencyP99;
+};
 
 class CameraTestApp {
     
     public:
-        CameraTestApp() {
-            cameraManager = std::make_unique<CameraManager>();
+        explicit CameraTestApp(const VideoConfig &videoConfig)
+            : config(videoConfig), session(videoConfig), encoder(config, session, frameStats) {
             stop = 1;
         };
 
@@ -190,141 +807,351 @@ class CameraTestApp {
             if(stop != 1)
                 return false;
 
-            int ret;
-            ret = cameraManager->start();
-            if(ret){
-                std::cerr << "Camera Manager could not be launched" << std::endl;
+            std::vector<StreamRole> roles = { StreamRole::VideoRecording };
+            if (!config.previewSize.isNull())
+                roles.push_back(StreamRole::Viewfinder);
+            if (!session.open(roles))
                 return false;
-            }
-
-            if(cameraManager->cameras().empty()){
-                std::cerr << "No Camera detected" << std::endl;
-                return false; 
-            }
-
-            for (auto const &camera : cameraManager->cameras()){
-                std::cout << camera->id() << std::endl;
-            }
-
-            camera = cameraManager->cameras()[0];
-            camera->acquire();
-            cameraConfig = camera->generateConfiguration( { StreamRole::VideoRecording } );
+            camera = session.camera();
+            cameraConfig = session.configuration();
 
             streamConfig = &(cameraConfig->at(0));
-            camera->requestCompleted.connect(this, &CameraTestApp::onRequestCompleted);
+            previewConfig = cameraConfig->size() > 1 ? &cameraConfig->at(1) : nullptr;
+            session.requestCompleted = [this](Request *request) { onRequestCompleted(request); };
             stop = 0;
 
             return setConfig();
         };
 
+        /* Buffers of the recording stream and of the preview one, if any */
         int allocateFrameBuffer(){
-            allocator = new FrameBufferAllocator(camera);
-            if(allocator->allocate(streamConfig->stream()) < 0) {
-                std::cerr << "Could not allocate buffer" << std::endl;
-                return -ENOMEM;
-            }
-            size_t allocated = allocator->buffers(streamConfig->stream()).size();
-            return 0;
+            return session.allocate();
         }
 
         void capureImage(){
             Stream * stream = streamConfig->stream();
-            const std::vector<std::unique_ptr<FrameBuffer>>& buffers = allocator->buffers(stream);
-            std::unique_ptr<libcamera::Request> request = camera->createRequest();
-            if(!request){
-                std::cerr << "Could not create request" << std::endl;
-                return;
-            }
-
-            if(exposure != -1 || analog_gain != -1){
-                request->controls().set(controls::AeEnable, false); 
-                if(exposure != -1){
-                    request->controls().set(controls::ExposureTime, exposure); 
+            const std::vector<std::unique_ptr<FrameBuffer>>& buffers = session.buffers(stream);
+
+            // One request per allocated buffer, all of them kept in flight
+            size_t depth = buffers.size();
+            if (config.queueDepth > 0 && static_cast<size_t>(config.queueDepth) < depth)
+                depth = config.queueDepth;
+
+            for (size_t i = 0; i < depth; i++) {
+                std::unique_ptr<libcamera::Request> request = camera->createRequest(i);
+                if(!request){
+                    std::cerr << "Could not create request" << std::endl;
+                    return;
                 }
-                if(analog_gain != -1) {
-                    request->controls().set(controls::AnalogueGain, analog_gain);
+                if(request->addBuffer(stream, buffers[i].get()) < 0){
+                    std::cerr << "Could not add buffer to request" << std::endl;
+                    return;
                 }
+                requests.push_back(std::move(request));
             }
 
-            request->addBuffer(stream, buffers[0].get());
-            
-            initFFmpeg("output.mp4");
-            camera->start();
-            
-            
+            // Controls only need to travel with the first request, the pipeline keeps them
+            Request *first = requests.front().get();
+            int64_t frameDuration = 1'000'000 / fps();
+            int64_t maxFrameDuration = std::max<int64_t>(frameDuration, config.exposure);
+            first->controls().set(controls::FrameDurationLimits,
+                                  Span<const int64_t, 2>({ frameDuration, maxFrameDuration }));
+            frameDurationLimits[0] = frameDuration;
+            frameDurationLimits[1] = maxFrameDuration;
+
+            session.setExposureControls(first->controls());
+
+            /*
+             * Leave at least one buffer with the camera while the encoder holds
+             * one and the ring the rest, otherwise the sensor starves instead of
+             * us dropping frames we can't keep up with.
+             */
+            size_t capacity = depth > 2 ? depth - 2 : 1;
+            if (config.ringSize > 0)
+                capacity = config.ringSize;
+            encodeQueue = std::make_unique<SpscRing<Request *>>(capacity);
+
+            if (config.encoderBackend == EncoderBackend::V4L2) {
+                encoder.v4l2Encoder.inputDone = [this](void *cookie) { queueAgain(static_cast<Request *>(cookie)); };
+                if (!encoder.initV4L2Encoder(config.outputFile, *streamConfig))
+                    std::cerr << "Falling back to software encoding" << std::endl;
+            }
+            if (!encoder.hardwareEncoder()) {
+                // x264 starts its threads when opened, they take the encoder stage's cpus from here
+                ScopedAffinity encoderCpus(ThreadRegistry::instance().policy("encoder"));
+                encoder.initFFmpeg(config.outputFile, *streamConfig, buffers, session.mappedBuffers());
+            }
+            if (config.metadataFile) {
+                MetadataFileHeader header = {};
+                header.width = streamConfig->size.width;
+                header.height = streamConfig->size.height;
+                header.fps = fps();
+                metadataLog.open(config.metadataFile, header);
+            }
+            frameStats.reset();
+            sensorFrames.start(fps());
+            stopping = false;
+            failed = false;
+            measuring = false;
+            cameraClockKnown = false;
+            encodedFrames = 0;
+            encoderThread = std::thread(&CameraTestApp::encoderLoop, this);
+            if (previewConfig)
+                startPreview();
+            startControls(depth);
 
+            camera->start();
+            for (std::unique_ptr<Request> &request : requests) {
+                if (previewConfig)
+                    attachPreview(request.get());
+                camera->queueRequest(request.get());
+            }
+            // After start(), a pipeline handler needing the node has it by then and keeps it
+            embeddedMatched = 0;
+            if (config.embeddedData)
+                startEmbeddedData();
+            if (cameraStarted)
+                cameraStarted();
+
+            // Frames of the warm-up are encoded but left out of every figure
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                runDone.wait_for(lock, std::chrono::seconds(config.warmupSeconds), [this]() { return failed.load(); });
+            }
+            clockid_t encoderClock;
+            pthread_getcpuclockid(encoderThread.native_handle(), &encoderClock);
+            uint64_t ringDropsBefore = encodeQueue->drops();
+            double encoderCpuBefore = cpuSeconds(encoderClock);
+            double processCpuBefore = cpuSeconds(CLOCK_PROCESS_CPUTIME_ID);
+            double cameraCpuBefore = cameraClockKnown ? cpuSeconds(cameraClock) : 0;
+            std::vector<ThreadSample> threadsBefore = ThreadRegistry::instance().sample();
+            measuring = true;
 
             auto startTime = std::chrono::steady_clock::now();
-            auto endTime = startTime + std::chrono::seconds(durationSeconds);
-            
-            while (std::chrono::steady_clock::now() < endTime) {
-                requestResult = false;
-                camera->queueRequest(request.get());
-                waitForRequest();
-                if (!requestResult) {
-                    std::cerr << "Request failed or cancelled\n";
-                    break;
+            auto endTime = startTime + std::chrono::seconds(config.durationSeconds);
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                auto nextReport = startTime + std::chrono::seconds(config.statsInterval);
+                while (config.statsInterval > 0 && nextReport < endTime) {
+                    if (runDone.wait_until(lock, nextReport, [this]() { return failed.load(); }))
+                        break;
+                    // The completion handler and the encoder take mtx, syslog mustn't hold them up
+                    lock.unlock();
+                    frameStats.log();
+                    lock.lock();
+                    nextReport += std::chrono::seconds(config.statsInterval);
                 }
-                captureAndEncode(request.get());
-                request->reuse(Request::ReuseBuffers);
+                runDone.wait_until(lock, endTime, [this]() { return failed.load(); });
             }
-            cleanupFFmpeg();
+            auto elapsed = std::chrono::steady_clock::now() - startTime;
+            measuring = false;
+            // Before stopping, the stage threads are gone after it
+            std::string threadReport = ThreadRegistry::instance().report(threadsBefore,
+                    std::chrono::duration<double>(elapsed).count());
+            double encoderCpu = cpuSeconds(encoderClock) - encoderCpuBefore;
+            double processCpu = cpuSeconds(CLOCK_PROCESS_CPUTIME_ID) - processCpuBefore;
+            double cameraCpu = cameraClockKnown ? cpuSeconds(cameraClock) - cameraCpuBefore : 0;
+            uint64_t ringDrops = encodeQueue->drops() - ringDropsBefore;
+
+            // Completions cancelled by stop() are neither encoded nor queued again
+            stopping = true;
+            controlChannel.stop();
             camera->stop();
+            { std::lock_guard<std::mutex> lock(mtx); }
+            cond_variable.notify_one();
+            encoderThread.join();
+            embeddedReader.close();
+            if (previewConfig)
+                stopPreview();
+            bool softwareEncoder = !encoder.hardwareEncoder();
+            encoder.cleanupFFmpeg();
+            bool metadataLogged = metadataLog.isOpen();
+            metadataLog.close();
+
+            double seconds = std::chrono::duration<double>(elapsed).count();
+            double achieved = seconds > 0 ? encodedFrames / seconds : 0;
+            const LatencyHistogram &latency = frameStats.endToEnd();
+            lastRun = {
+                .mode = config.mode,
+                .nominalFps = fps(),
+                .size = streamConfig->size,
+                .format = streamConfig->pixelFormat.toString(),
+                .frames = encodedFrames,
+                .seconds = seconds,
+                .fps = achieved,
+                .sensorDrops = sensorFrames.drops(),
+                .ringDrops = ringDrops,
+                .cpuCompletion = seconds > 0 ? 100.0 * cameraCpu / seconds : 0,
+                .cpuEncoder = seconds > 0 ? 100.0 * encoderCpu / seconds : 0,
+                .cpuProcess = seconds > 0 ? 100.0 * processCpu / seconds : 0,
+                .latencyP50 = latency.percentile(0.5) / 1e6,
+                .latencyP99 = latency.percentile(0.99) / 1e6,
+            };
+
+            // The benchmark table owns stdout, the reports of several cameras go one after the other
+            std::ostream &report = config.benchmarkOutput == BenchmarkOutput::None ? std::cout : std::cerr;
+            static std::mutex reportMutex;
+            std::lock_guard<std::mutex> reportLock(reportMutex);
+            if (!config.syncCameras.empty())
+                report << "Camera " << camera->id() << ":" << std::endl;
+            report << "Captured " << encodedFrames << " frames in " << std::fixed << std::setprecision(2)
+                      << seconds << " s with " << depth << " requests in flight: "
+                      << achieved << " fps (mode " << config.mode << " nominal " << fps()
+                      << " fps, " << 100.0 * achieved / fps() << "%)" << std::endl;
+            report << "Encoder ring: capacity " << encodeQueue->capacity()
+                      << ", average occupancy " << encodeQueue->averageOccupancy()
+                      << ", high watermark " << encodeQueue->highWatermark()
+                      << ", dropped " << ringDrops << " frames" << std::endl;
+            const LatencyHistogram &jitter = sensorFrames.timestampJitter();
+            report << "Sensor: " << sensorFrames.frames() << " frames received, " << sensorFrames.drops()
+                      << " dropped in " << sensorFrames.gaps() << " gaps (" << 100.0 * sensorFrames.dropRate()
+                      << "%), timestamp jitter against " << fps() << " fps: p50 "
+                      << jitter.percentile(0.5) / 1e6 << " ms, p99 " << jitter.percentile(0.99) / 1e6
+                      << " ms, max " << jitter.max() / 1e6 << " ms" << std::endl;
+            syslog(LOG_INFO, "sensor: %llu frames, %llu dropped in %llu gaps",
+                   static_cast<unsigned long long>(sensorFrames.frames()),
+                   static_cast<unsigned long long>(sensorFrames.drops()),
+                   static_cast<unsigned long long>(sensorFrames.gaps()));
+            if (previewConfig)
+                report << "Preview: " << previewFrames << " frames at " << previewConfig->size.toString()
+                       << ", " << previewSkipped << " skipped with no free buffer" << std::endl;
+            if (config.publishSocket)
+                report << "Publisher: " << publisher.framesSent() << " frames sent, " << publisher.framesSkipped()
+                       << " skipped for slow readers, " << publisher.readersDropped() << " readers dropped" << std::endl;
+            if (encoder.isSegmented())
+                report << "Segments: " << encoder.segments().segmentsWritten() << " written, "
+                       << encoder.segments().segmentsDeleted() << " deleted for the disk cap, "
+                       << encoder.segments().triggers() << " triggers" << std::endl;
+            if (metadataLogged)
+                report << "Metadata: " << metadataLog.recordsWritten() << " records written to " << config.metadataFile
+                       << ", " << metadataLog.recordsDropped() << " dropped" << std::endl;
+            if (config.embeddedData)
+                report << "Embedded data: " << embeddedReader.linesParsed() << " lines parsed, "
+                       << embeddedReader.linesFailed() << " not parsed, " << embeddedMatched
+                       << " matched to a frame" << std::endl;
+            if (config.controlStdin)
+                report << "Controls: " << controlUpdates << " updates applied, " << controlsConfirmed
+                       << " confirmed by the frame metadata" << std::endl;
+            report << "CPU: completion " << lastRun.cpuCompletion << "%, encoder " << lastRun.cpuEncoder
+                   << "%, process " << lastRun.cpuProcess << "%" << std::endl;
+            report << "Threads:" << std::endl << threadReport;
+            report << "Frame timings:" << std::endl << frameStats.summary();
+            frameStats.log();
+            if (softwareEncoder)
+                report << "Encoder allocations: " << encoder.warmupAllocations() << " in the first "
+                          << encoder.warmupFrames() << " frames, " << encoder.steadyAllocations() << " after" << std::endl;
+
+            encodeQueue.reset();
+            requests.clear();
         };
+
+        const RunResult &result() const { return lastRun; }
+        int nominalFps() const { return fps(); }
+
+        // Called once the camera streams, then for every frame measured, on the libcamera thread
+        std::function<void()> cameraStarted;
+        std::function<void(uint32_t sequence, uint64_t timestamp)> frameCompleted;
+
+        // Preview consumer, run on the preview thread, the shared memory sink when not set
+        std::function<void(const PreviewFrame &)> previewCallback;
         
         void stopCamera(){
             if(camera && stop == 0){
-                allocator->free(streamConfig->stream());
-                delete allocator;
-                camera->release();
-                camera.reset();
-                cameraManager->stop();
+                session.close();
+                camera = nullptr;
                 stop = 1;
             }
         };
 
     private:
-        std::shared_ptr<CameraManager> cameraManager;
-        std::shared_ptr<Camera> camera;
-        std::unique_ptr<CameraConfiguration> cameraConfig;
+        VideoConfig config;
+        CameraSession session;
+        // Stage timings of every frame, from the sensor timestamp to the packet write
+        FrameStats frameStats;
+        VideoEncoder encoder;
+        Camera * camera = nullptr;
+        CameraConfiguration * cameraConfig;
         StreamConfiguration * streamConfig;
-        FrameBufferAllocator * allocator;
-        SensorConfiguration sensorConfig;
+        StreamConfiguration * previewConfig = nullptr;
         
         int stop;
 
+        std::vector<std::unique_ptr<Request>> requests;
+        std::unique_ptr<SpscRing<Request *>> encodeQueue;
+        std::thread encoderThread;
+        std::vector<Request *> heldRequests;
+        std::atomic<bool> stopping;
+        std::atomic<bool> failed;
+        unsigned int encodedFrames;
+        FrameDropTracker sensorFrames;
+        std::atomic<bool> measuring;
+        // CPU clock of the libcamera thread running the completion handler
+        clockid_t cameraClock;
+        std::atomic<bool> cameraClockKnown;
+        RunResult lastRun = {};
+
+        /*
+         * Preview buffers travel with a request only while one is free and
+         * the preview rate allows it, completed ones go to the preview thread
+         * through previewQueue and come back to freePreviewBuffers.
+         */
+        std::vector<FrameBuffer *> freePreviewBuffers;
+        std::mutex previewMutex;
+        std::chrono::steady_clock::time_point nextPreview;
+        struct PreviewItem {
+            FrameBuffer *buffer;
+            int32_t exposure;
+            float gain;
+        };
+        std::unique_ptr<SpscRing<PreviewItem>> previewQueue;
+        std::thread previewThread;
+        std::condition_variable previewReady;
+        ShmPreviewSink previewSink;
+        MetadataLog metadataLog;
+        EmbeddedDataReader embeddedReader;
+        uint64_t embeddedMatched = 0;
+        FramePublisher publisher;
+        bool publishing = false;
+        uint64_t previewFrames;
+        uint64_t previewSkipped;
+
+        /*
+         * Control updates wait in pendingControls for the next request going
+         * back to the camera, carriedControls remembers which request took
+         * them (by request cookie) and settling is the latest one while the
+         * frame metadata hasn't caught up with it yet.
+         */
+        ControlChannel controlChannel;
+        std::mutex controlMutex;
+        ControlUpdate pendingControls;
+        std::atomic<bool> controlsPending{false};
+        std::vector<ControlUpdate> carriedControls;
+        int64_t frameDurationLimits[2];
+        ControlUpdate settling;
+        uint32_t settlingFrame = 0;
+        unsigned int controlUpdates = 0;
+        unsigned int controlsConfirmed = 0;
+        static constexpr uint32_t kSettleFrames = 30;
+
         std::mutex mtx;
         std::condition_variable cond_variable;
-        bool requestResult;
+        std::condition_variable runDone;
+
+        int fps() const { return session.sensorMode().fps; }
 
+        /* Orientation and sensor mode are the session's, the streams are ours */
         bool setConfig(){
-            
-            if (hflip)
-                cameraConfig->orientation = cameraConfig->orientation * libcamera::Transform::HFlip;
-            if(vflip)
-                cameraConfig->orientation = cameraConfig->orientation * libcamera::Transform::VFlip;
-            
-            
-            sensorConfig.analogCrop = Rectangle(modes[mode].cropLeft, modes[mode].cropTop, modes[mode].cropWidth, modes[mode].cropHeight);
-            sensorConfig.bitDepth = modes[mode].bitDepth;
-            sensorConfig.binning.binX = modes[mode].binning;
-            sensorConfig.binning.binY = modes[mode].binning;
-            sensorConfig.skipping.xOddInc = 1;
-            sensorConfig.skipping.xEvenInc = 1;
-            sensorConfig.skipping.yOddInc = 1;
-            sensorConfig.skipping.yEvenInc = 1;
-            sensorConfig.outputSize = Size(modes[mode].width, modes[mode].height);
-
-            if(!sensorConfig.isValid()){
-                std::cerr << "Sensor configuration not available" << std::endl;
-                return false;
+            streamConfig->size.width = config.width;
+            streamConfig->size.height = config.height;
+            streamConfig->pixelFormat = config.pixelFormat;
+            if (config.queueDepth > 0)
+                streamConfig->bufferCount = config.queueDepth;
+
+            if (previewConfig) {
+                previewConfig->size = config.previewSize;
+                previewConfig->pixelFormat = config.previewFormat;
+                previewConfig->bufferCount = kPreviewBuffers;
             }
-        
-            cameraConfig->sensorConfig = std::optional<SensorConfiguration>(sensorConfig);
-
-            streamConfig->size.width = width;
-            streamConfig->size.height = height;
-            streamConfig->pixelFormat = formats::XRGB8888;
 
             CameraConfiguration::Status res = cameraConfig->validate();
             if (res == CameraConfiguration::Invalid){
@@ -332,48 +1159,458 @@ class CameraTestApp {
                 return false;
             }
 
-            camera->configure(cameraConfig.get());
+            // The encoder can only take the YUV formats as they are, anything else goes through XRGB
+            if (streamConfig->pixelFormat != config.pixelFormat && streamConfig->pixelFormat != formats::XRGB8888) {
+                std::cerr << config.pixelFormat.toString() << " not available, falling back to XRGB8888" << std::endl;
+                streamConfig->pixelFormat = formats::XRGB8888;
+                if (cameraConfig->validate() == CameraConfiguration::Invalid) {
+                    std::cerr << "Configuration is not valid" << std::endl;
+                    return false;
+                }
+            }
+
+            if (previewConfig)
+                std::cout << "Preview stream " << previewConfig->toString() << std::endl;
+
+            return session.configure();
+        }
+
+        void queueAgain(Request *request) {
+            if (stopping)
+                return;
+            if (previewConfig) {
+                // The preview buffer, if it had one, went to the preview thread on completion
+                FrameBuffer *buffer = request->buffers().at(streamConfig->stream());
+                request->reuse();
+                request->addBuffer(streamConfig->stream(), buffer);
+                attachPreview(request);
+            } else {
+                request->reuse(Request::ReuseBuffers);
+            }
+            if (controlsPending)
+                applyControls(request);
+            camera->queueRequest(request);
+        }
+
+        void startControls(size_t depth) {
+            carriedControls.assign(depth, ControlUpdate());
+            pendingControls = ControlUpdate();
+            controlsPending = false;
+            settling = ControlUpdate();
+            controlUpdates = 0;
+            controlsConfirmed = 0;
+            if (!config.controlStdin)
+                return;
+
+            controlChannel.update = [this](const ControlUpdate &update) {
+                std::lock_guard<std::mutex> lock(controlMutex);
+                pendingControls.merge(update);
+                controlsPending = true;
+            };
+            controlChannel.start(STDIN_FILENO);
+        }
+
+        /* Hand the pending control update to a request about to be queued */
+        void applyControls(Request *request) {
+            ControlUpdate update;
+            {
+                std::lock_guard<std::mutex> lock(controlMutex);
+                update = pendingControls;
+                pendingControls = ControlUpdate();
+                controlsPending = false;
+
+                // Keep the frame long enough for the exposure, as for the initial controls
+                if (update.minFrameDuration) {
+                    frameDurationLimits[0] = update.minFrameDuration;
+                    frameDurationLimits[1] = update.maxFrameDuration;
+                } else if (update.exposure > frameDurationLimits[1]) {
+                    update.minFrameDuration = frameDurationLimits[0];
+                    update.maxFrameDuration = frameDurationLimits[1] = update.exposure;
+                }
+            }
+            if (update.empty())
+                return;
+
+            ControlList &controls = request->controls();
+            if (update.autoExposure)
+                controls.set(controls::AeEnable, true);
+            if (update.exposure >= 0 || update.gain >= 0)
+                controls.set(controls::AeEnable, false);
+            if (update.exposure >= 0)
+                controls.set(controls::ExposureTime, update.exposure);
+            if (update.gain >= 0)
+                controls.set(controls::AnalogueGain, update.gain);
+            if (update.minFrameDuration)
+                controls.set(controls::FrameDurationLimits,
+                             Span<const int64_t, 2>({ update.minFrameDuration, update.maxFrameDuration }));
+
+            // Only the completion handler reads it back, once the request is done
+            carriedControls[request->cookie()] = update;
+        }
+
+        /*
+         * Log which frame carried a control update and from which frame on the
+         * metadata shows it, the sensor applies exposure and gain a few frames
+         * late. Completion handler only.
+         */
+        void trackControls(Request *request) {
+            uint32_t sequence = request->buffers().at(streamConfig->stream())->metadata().sequence;
+            ControlUpdate &carried = carriedControls[request->cookie()];
+            if (carried.id) {
+                if (settling.id)
+                    logControls("superseded before the metadata showed them, at frame", settling, sequence);
+                settling = carried;
+                settlingFrame = sequence;
+                carried = ControlUpdate();
+                controlUpdates++;
+                logControls("queued with frame", settling, sequence);
+            }
+            if (!settling.id)
+                return;
+
+            if (controlsReached(request->metadata(), settling)) {
+                controlsConfirmed++;
+                logControls("in effect from frame", settling, sequence);
+                settling = ControlUpdate();
+            } else if (sequence - settlingFrame > kSettleFrames) {
+                logControls("not reflected by the metadata by frame", settling, sequence);
+                settling = ControlUpdate();
+            }
+        }
+
+        static bool controlsReached(const ControlList &metadata, const ControlUpdate &update) {
+            // The sensor only has whole lines of exposure and steps of gain
+            auto near = [](double value, double target) { return std::abs(value - target) <= 0.02 * target + 1; };
+
+            if (update.exposure >= 0) {
+                std::optional<int32_t> exposureTime = metadata.get(controls::ExposureTime);
+                if (!exposureTime || !near(*exposureTime, update.exposure))
+                    return false;
+            }
+            if (update.gain >= 0) {
+                std::optional<float> gain = metadata.get(controls::AnalogueGain);
+                if (!gain || std::abs(*gain - update.gain) > 0.02 * update.gain)
+                    return false;
+            }
+            if (update.minFrameDuration) {
+                std::optional<int64_t> frameDuration = metadata.get(controls::FrameDuration);
+                if (!frameDuration || *frameDuration < 0.98 * update.minFrameDuration ||
+                    *frameDuration > 1.02 * update.maxFrameDuration)
+                    return false;
+            }
             return true;
         }
 
-        void waitForRequest() {
-            std::unique_lock<std::mutex> lock(mtx);
-            cond_variable.wait(lock, [this]() { return requestResult; });
+        /* One line per step of an update, event says what happened by the frame of sequence */
+        static void logControls(const char *event, const ControlUpdate &update, uint32_t sequence) {
+            char line[256];
+            snprintf(line, sizeof(line), "controls %u:%s %s %u", update.id, update.toString().c_str(), event, sequence);
+            std::cerr << line << std::endl;
+            syslog(LOG_INFO, "%s", line);
+        }
+
+        /* Make the request fill a preview buffer too when one is due, the same sensor frame feeds both */
+        void attachPreview(Request *request) {
+            std::lock_guard<std::mutex> lock(previewMutex);
+            auto now = std::chrono::steady_clock::now();
+            if (now < nextPreview)
+                return;
+            if (freePreviewBuffers.empty()) {
+                previewSkipped++;
+                return;
+            }
+
+            if (request->addBuffer(previewConfig->stream(), freePreviewBuffers.back()) < 0)
+                return;
+            freePreviewBuffers.pop_back();
+            nextPreview += std::chrono::microseconds(1'000'000 / config.previewFps);
+            if (nextPreview < now)
+                nextPreview = now;
+        }
+
+        void releasePreview(FrameBuffer *buffer) {
+            std::lock_guard<std::mutex> lock(previewMutex);
+            freePreviewBuffers.push_back(buffer);
+        }
+
+        void startPreview() {
+            freePreviewBuffers.clear();
+            for (const std::unique_ptr<FrameBuffer> &buffer : session.buffers(previewConfig->stream()))
+                freePreviewBuffers.push_back(buffer.get());
+            nextPreview = std::chrono::steady_clock::now();
+            previewFrames = 0;
+            previewSkipped = 0;
+            previewQueue = std::make_unique<SpscRing<PreviewItem>>(freePreviewBuffers.size());
+
+            if (!previewCallback && previewSink.open(config.previewShm, previewConfig->frameSize) == 0)
+                previewCallback = [this](const PreviewFrame &frame) { previewSink.write(frame); };
+            if (config.publishSocket)
+                startPublisher();
+            previewThread = std::thread(&CameraTestApp::previewLoop, this);
+        }
+
+        void stopPreview() {
+            { std::lock_guard<std::mutex> lock(mtx); }
+            previewReady.notify_one();
+            previewThread.join();
+            // Buffers readers still hold come back through releasePreview()
+            if (publishing)
+                publisher.close();
+            publishing = false;
+            previewSink.close();
+            previewQueue.reset();
+        }
+
+        /* Readers of the publisher socket get the preview dmabufs, a buffer is known by its index */
+        void startPublisher() {
+            const std::vector<std::unique_ptr<FrameBuffer>> &buffers = session.buffers(previewConfig->stream());
+            std::vector<int> dmabufs;
+            for (size_t i = 0; i < buffers.size(); i++) {
+                buffers[i]->setCookie(i);
+                dmabufs.push_back(buffers[i]->planes()[0].fd.get());
+            }
+
+            publisher.released = [this](unsigned int index) {
+                releasePreview(session.buffers(previewConfig->stream())[index].get());
+            };
+            FramePublisher::Format format = {
+                .width = previewConfig->size.width,
+                .height = previewConfig->size.height,
+                .stride = previewConfig->stride,
+                .fourcc = previewConfig->pixelFormat.fourcc(),
+                .frameSize = previewConfig->frameSize,
+            };
+            publishing = publisher.open(config.publishSocket, format, dmabufs) == 0;
+        }
+
+        void previewLoop() {
+            StageThread stage("preview");
+            PreviewItem item;
+
+            while (true) {
+                if (!previewQueue->pop(item)) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (stopping && previewQueue->empty())
+                        break;
+                    previewReady.wait(lock, [this]() { return stopping || !previewQueue->empty(); });
+                    continue;
+                }
+
+                FrameBuffer *buffer = item.buffer;
+                const std::vector<MappedBufferCache::Plane> &planes = session.mappedBuffers().find(buffer);
+                if (previewCallback && !planes.empty()) {
+                    const FrameMetadata &metadata = buffer->metadata();
+                    PreviewFrame frame = {
+                        .data = planes[0].data,
+                        .size = previewConfig->frameSize,
+                        .width = previewConfig->size.width,
+                        .height = previewConfig->size.height,
+                        .stride = previewConfig->stride,
+                        .fourcc = previewConfig->pixelFormat.fourcc(),
+                        .sequence = metadata.sequence,
+                        .timestamp = metadata.timestamp,
+                    };
+                    previewCallback(frame);
+                }
+                previewFrames++;
+
+                // A buffer some reader took comes back once the last of them acks it
+                if (!publishing || !publishFrame(item))
+                    releasePreview(buffer);
+            }
+        }
+
+        bool publishFrame(const PreviewItem &item) {
+            const FrameMetadata &metadata = item.buffer->metadata();
+            PublishedFrame frame = {
+                .buffer = static_cast<uint32_t>(item.buffer->cookie()),
+                .sequence = metadata.sequence,
+                .timestamp = metadata.timestamp,
+                .exposure = item.exposure,
+                .gain = item.gain,
+                .width = previewConfig->size.width,
+                .height = previewConfig->size.height,
+                .stride = previewConfig->stride,
+                .fourcc = previewConfig->pixelFormat.fourcc(),
+                .offset = item.buffer->planes()[0].offset,
+                .size = static_cast<uint32_t>(previewConfig->frameSize),
+            };
+            return publisher.publish(frame);
         }
 
         void onRequestCompleted(Request * request){
-            if(request->status() == Request::RequestCancelled){
-                requestResult = false; 
-            } else {
-                requestResult = true;
+            if (stopping)
+                return;
+
+            if (request->status() == Request::RequestCancelled) {
+                std::cerr << "Request failed or cancelled\n";
+                failed = true;
+                { std::lock_guard<std::mutex> lock(mtx); }
+                runDone.notify_one();
+                return;
+            }
+
+            if (previewConfig) {
+                FrameBuffer *preview = request->findBuffer(previewConfig->stream());
+                if (preview) {
+                    const ControlList &metadata = request->metadata();
+                    PreviewItem item = {
+                        .buffer = preview,
+                        .exposure = metadata.get(controls::ExposureTime).value_or(-1),
+                        .gain = metadata.get(controls::AnalogueGain).value_or(0.0f),
+                    };
+                    if (preview->metadata().status != FrameMetadata::FrameSuccess || !previewQueue->push(item)) {
+                        releasePreview(preview);
+                    } else {
+                        { std::lock_guard<std::mutex> lock(mtx); }
+                        previewReady.notify_one();
+                    }
+                }
+            }
+
+            trackControls(request);
+
+            if (!cameraClockKnown) {
+                pthread_getcpuclockid(pthread_self(), &cameraClock);
+                cameraClockKnown = true;
+                // The libcamera thread is the pipeline handler's, it stays registered as long as it runs
+                ThreadRegistry::instance().add("completion");
             }
+
+            if (measuring) {
+                const FrameMetadata &metadata = request->buffers().at(streamConfig->stream())->metadata();
+                sensorFrames.frame(metadata.sequence, metadata.timestamp);
+                frameStats.begin(metadata.sequence, metadata.timestamp);
+                frameStats.stamp(metadata.sequence, FrameStats::Completed);
+                if (frameCompleted && metadata.status == FrameMetadata::FrameSuccess)
+                    frameCompleted(metadata.sequence, metadata.timestamp);
+            }
+
+            // Ring full: the encoder is behind, give the buffer straight back to the sensor
+            if (!encodeQueue->push(request)) {
+                queueAgain(request);
+                return;
+            }
+
+            // Taking the lock orders this wake-up against the encoder going to sleep
+            { std::lock_guard<std::mutex> lock(mtx); }
             cond_variable.notify_one();
         }
-        
+
+        void encoderLoop() {
+            StageThread stage("encoder");
+            Request *request;
+
+            while (true) {
+                if (!encodeQueue->pop(request)) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    if (stopping && encodeQueue->empty())
+                        break;
+                    cond_variable.wait(lock, [this]() { return stopping || !encodeQueue->empty(); });
+                    continue;
+                }
+
+                captureAndEncode(request);
+                if (measuring)
+                    encodedFrames++;
+
+                // Buffers the software encoder was still referencing go back as soon as it lets go
+                for (auto it = heldRequests.begin(); it != heldRequests.end();) {
+                    if (encoder.frameReleased((*it)->buffers().at(streamConfig->stream()))) {
+                        queueAgain(*it);
+                        it = heldRequests.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            heldRequests.clear();
+        }
+
+        void logMetadata(Request *request, int64_t pts) {
+            const ControlList &metadata = request->metadata();
+            const FrameMetadata &frame = request->buffers().at(streamConfig->stream())->metadata();
+            MetadataRecord record = {};
+            record.pts = pts;
+            record.timestamp = frame.timestamp;
+            record.sequence = frame.sequence;
+            record.exposure = metadata.get(controls::ExposureTime).value_or(-1);
+            record.analogueGain = metadata.get(controls::AnalogueGain).value_or(0.0f);
+            record.digitalGain = metadata.get(controls::DigitalGain).value_or(0.0f);
+            record.colourTemperature = metadata.get(controls::ColourTemperature).value_or(0);
+            record.lux = metadata.get(controls::Lux).value_or(0.0f);
+            record.frameDuration = metadata.get(controls::FrameDuration).value_or(0);
+            std::optional<Span<const float, 2>> gains = metadata.get(controls::ColourGains);
+            if (gains) {
+                record.colourGains[0] = (*gains)[0];
+                record.colourGains[1] = (*gains)[1];
+            }
+            EmbeddedData embedded;
+            if (config.embeddedData && embeddedReader.find(frame.timestamp, embedded)) {
+                record.embedded = 1;
+                record.sensorFrameCount = embedded.frameCount;
+                record.sensorExposure = embedded.exposure();
+                record.sensorGain = embedded.analogueGain();
+                record.sensorFrameLength = embedded.frameLines();
+                record.sensorTemperature = embedded.temperature;
+                embeddedMatched++;
+            }
+            metadataLog.log(record);
+        }
+
+        void startEmbeddedData() {
+            std::string node = config.embeddedNode ? config.embeddedNode : EmbeddedDataReader::findNode();
+            if (node.empty()) {
+                std::cerr << "No embedded data node found" << std::endl;
+                return;
+            }
+            if (embeddedReader.open(node, session.sensorMode().bitDepth) < 0)
+                std::cerr << "Embedded data not available, the metadata has the exposure and gain "
+                          << "reported by the pipeline" << std::endl;
+        }
+
+        /* Encode the frame of a request and decide when the request can go back to the camera */
         void captureAndEncode(Request *request) {
             Stream *stream = streamConfig->stream();
             const FrameBuffer *buffer = request->buffers().at(stream);
 
             if (buffer->metadata().status != FrameMetadata::FrameSuccess) {
                 std::cerr << "Frame capture failed\n";
+                queueAgain(request);
                 return;
             }
 
-            const FrameBuffer::Plane &plane = buffer->planes()[0];
-            void *memory = mmap(nullptr, plane.length, PROT_READ, MAP_SHARED, plane.fd.get(), 0);
-            if (memory == MAP_FAILED) {
-                perror("mmap failed");
+            int64_t pts = encoder.framePts(buffer);
+            if (metadataLog.isOpen())
+                logMetadata(request, pts);
+
+            // The hardware encoder reads the dmabuf itself and hands the request back once done
+            if (encoder.hardwareEncoder()) {
+                if (encoder.submitHardware(buffer, streamConfig->frameSize, pts, request) < 0) {
+                    std::cerr << "Hardware encoder busy, dropping frame\n";
+                    queueAgain(request);
+                }
+                return;
+            }
+
+            const std::vector<MappedBufferCache::Plane> &planes = session.mappedBuffers().find(buffer);
+            if (planes.empty()) {
+                std::cerr << "Buffer is not mapped\n";
+                queueAgain(request);
                 return;
             }
+            frameStats.stamp(buffer->metadata().sequence, FrameStats::Mapped);
 
-            encodeFrame(reinterpret_cast<uint8_t *>(memory));
-            munmap(memory, plane.length);
+            if (encoder.encodeFrame(buffer, planes, pts))
+                queueAgain(request);
+            else
+                heldRequests.push_back(request);
         }
 
 };
 
-int imageProcessing() {
-    CameraTestApp cam;
+int imageProcessing(const VideoConfig &config) {
+    CameraTestApp cam(config);
     
     if(!cam.startCamera())
         return EXIT_FAILURE;
@@ -387,6 +1624,302 @@ int imageProcessing() {
     return 0;
 }
 
+/* output.mp4 of camera 1 is output_cam1.mp4 */
+static std::string cameraFileName(const char *fileName, size_t index) {
+    std::string name = fileName;
+    size_t dot = name.rfind('.');
+    if (dot == std::string::npos || name.find('/', dot) != std::string::npos)
+        dot = name.size();
+    return name.substr(0, dot) + "_cam" + std::to_string(index) + name.substr(dot);
+}
+
+/*
+ * Record several cameras at once, a session and its threads each, and pair
+ * their frames by sensor timestamp. With the hardware trigger the first
+ * camera drives XVS and the others are its sinks: they are started first,
+ * so they wait for the source's first XVS pulse and every camera begins on
+ * the same frame.
+ */
+int multiCapture(const VideoConfig &multiConfig) {
+    size_t count = multiConfig.syncCameras.size();
+    std::vector<std::string> outputFiles;
+    std::vector<std::string> metadataFiles;
+    for (size_t i = 0; i < count; i++) {
+        outputFiles.push_back(cameraFileName(multiConfig.outputFile, i));
+        if (multiConfig.metadataFile)
+            metadataFiles.push_back(cameraFileName(multiConfig.metadataFile, i));
+    }
+
+    std::vector<std::unique_ptr<CameraTestApp>> cams;
+    for (size_t i = 0; i < count; i++) {
+        VideoConfig config = multiConfig;
+        config.cameraId = multiConfig.syncCameras[i];
+        config.outputFile = outputFiles[i].c_str();
+        if (multiConfig.metadataFile)
+            config.metadataFile = metadataFiles[i].c_str();
+        if (multiConfig.hardwareTrigger)
+            config.triggerMode = i == 0 ? 1 : 2;
+        cams.push_back(std::make_unique<CameraTestApp>(config));
+        if (!cams.back()->startCamera() || cams.back()->allocateFrameBuffer() != 0)
+            return EXIT_FAILURE;
+    }
+
+    // Frames of one pair are at most half a frame apart, further and they belong to the neighbours
+    FramePairer pairer;
+    if (pairer.open(multiConfig.pairFile, count, 500'000'000 / cams[0]->nominalFps()) < 0)
+        return EXIT_FAILURE;
+
+    std::mutex startMutex;
+    std::condition_variable startCond;
+    size_t started = 0;
+    for (size_t i = 0; i < count; i++) {
+        cams[i]->frameCompleted = [&pairer, i](uint32_t sequence, uint64_t timestamp) {
+            pairer.add(i, sequence, timestamp);
+        };
+        cams[i]->cameraStarted = [&]() {
+            { std::lock_guard<std::mutex> lock(startMutex); started++; }
+            startCond.notify_all();
+        };
+    }
+
+    // The sinks first, then the source once they all wait for its pulses
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; i++)
+        threads.emplace_back([&cams, i]() { cams[i]->capureImage(); });
+    {
+        std::unique_lock<std::mutex> lock(startMutex);
+        if (!startCond.wait_for(lock, std::chrono::seconds(5), [&]() { return started == count - 1; }))
+            std::cerr << "Not every sink started, starting the source anyway" << std::endl;
+    }
+    threads.emplace_back([&cams]() { cams[0]->capureImage(); });
+    for (std::thread &thread : threads)
+        thread.join();
+
+    for (std::unique_ptr<CameraTestApp> &cam : cams)
+        cam->stopCamera();
+    pairer.close();
+
+    std::cout << "Camera pairs (" << (multiConfig.hardwareTrigger ? "XVS trigger" : "free running")
+              << "): " << pairer.summary() << std::endl;
+    syslog(LOG_INFO, "Camera pairs: %s", pairer.summary().c_str());
+    return pairer.pairs() ? 0 : EXIT_FAILURE;
+}
+
+static bool parsePixelFormat(const char *name, PixelFormat &format) {
+    if (strcmp(name, "yuv420") == 0)
+        format = formats::YUV420;
+    else if (strcmp(name, "nv12") == 0)
+        format = formats::NV12;
+    else if (strcmp(name, "xrgb8888") == 0)
+        format = formats::XRGB8888;
+    else
+        return false;
+    return true;
+}
+
+static void printBenchmark(BenchmarkOutput benchmarkOutput, const std::vector<RunResult> &results) {
+    std::cout << std::fixed << std::setprecision(2);
+
+    if (benchmarkOutput == BenchmarkOutput::CSV) {
+        std::cout << "mode,width,height,format,frames,seconds,fps,nominal_fps,sensor_drops,ring_drops,"
+                  << "cpu_completion,cpu_encoder,cpu_process,latency_p50_ms,latency_p99_ms" << std::endl;
+        for (const RunResult &r : results) {
+            std::cout << r.mode << "," << r.size.width << "," << r.size.height << "," << r.format << ","
+                      << r.frames << "," << r.seconds << "," << r.fps << "," << r.nominalFps << ","
+                      << r.sensorDrops << "," << r.ringDrops << "," << r.cpuCompletion << ","
+                      << r.cpuEncoder << "," << r.cpuProcess << "," << r.latencyP50 << ","
+                      << r.latencyP99 << std::endl;
+        }
+        return;
+    }
+
+    std::cout << "[" << std::endl;
+    for (size_t i = 0; i < results.size(); i++) {
+        const RunResult &r = results[i];
+        std::cout << "  {\"mode\": " << r.mode << ", \"width\": " << r.size.width
+                  << ", \"height\": " << r.size.height << ", \"format\": \"" << r.format
+                  << "\", \"frames\": " << r.frames << ", \"seconds\": " << r.seconds
+                  << ", \"fps\": " << r.fps << ", \"nominal_fps\": " << r.nominalFps
+                  << ", \"sensor_drops\": " << r.sensorDrops << ", \"ring_drops\": " << r.ringDrops
+                  << ", \"cpu_completion\": " << r.cpuCompletion << ", \"cpu_encoder\": " << r.cpuEncoder
+                  << ", \"cpu_process\": " << r.cpuProcess << ", \"latency_p50_ms\": " << r.latencyP50
+                  << ", \"latency_p99_ms\": " << r.latencyP99 << "}"
+                  << (i + 1 < results.size() ? "," : "") << std::endl;
+    }
+    std::cout << "]" << std::endl;
+}
+
+/* Every mode with every size and format, one fresh camera session each */
+int runBenchmark(const VideoConfig &benchmarkConfig) {
+    std::vector<RunResult> results;
+
+    // The modes of the camera, found once and kept for the sessions of the runs
+    size_t modeCount = 0;
+    {
+        VideoConfig probe = benchmarkConfig;
+        probe.mode = 0;
+        CameraSession session(probe);
+        if (!session.open({ StreamRole::Raw }))
+            return EXIT_FAILURE;
+        modeCount = session.sensorModes().size();
+    }
+
+    for (size_t m = 0; m < modeCount; m++) {
+        for (const Size &size : benchmarkConfig.benchmarkSizes) {
+            for (const PixelFormat &format : benchmarkConfig.benchmarkFormats) {
+                VideoConfig config = benchmarkConfig;
+                config.mode = m;
+                config.width = size.width;
+                config.height = size.height;
+                config.pixelFormat = format;
+                std::cerr << "Benchmark: mode " << config.mode << ", " << config.width << "x" << config.height
+                          << ", " << format.toString() << std::endl;
+
+                CameraTestApp cam(config);
+                if (!cam.startCamera() || cam.allocateFrameBuffer() != 0) {
+                    std::cerr << "Skipping, the camera could not be configured" << std::endl;
+                    continue;
+                }
+                cam.capureImage();
+                results.push_back(cam.result());
+                cam.stopCamera();
+            }
+        }
+    }
+
+    printBenchmark(benchmarkConfig.benchmarkOutput, results);
+    return results.empty() ? EXIT_FAILURE : 0;
+}
+
+/* Milliseconds per frame of a conversion, over at least ten frames and half a second */
+static double convertMilliseconds(const std::function<void()> &convert) {
+    // Once untimed, for the caches and the helper threads to wake up
+    convert();
+    int frames = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> elapsed{0};
+    while (frames < 10 || elapsed < std::chrono::milliseconds(500)) {
+        convert();
+        frames++;
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return elapsed.count() / frames;
+}
+
+/* Largest difference between two frames of the same size and layout, every plane */
+static int maxDifference(const AVFrame *a, const AVFrame *b, bool nv12) {
+    int difference = 0;
+    for (int plane = 0; plane < (nv12 ? 2 : 3); plane++) {
+        int rows = plane ? (a->height + 1) / 2 : a->height;
+        int bytes = plane == 0 || nv12 ? a->width : (a->width + 1) / 2;
+        for (int row = 0; row < rows; row++) {
+            const uint8_t *pa = a->data[plane] + static_cast<ptrdiff_t>(row) * a->linesize[plane];
+            const uint8_t *pb = b->data[plane] + static_cast<ptrdiff_t>(row) * b->linesize[plane];
+            for (int i = 0; i < bytes; i++)
+                difference = std::max(difference, std::abs(pa[i] - pb[i]));
+        }
+    }
+    return difference;
+}
+
+/*
+ * The XRGB8888 conversion of the encoder against swscale, at the size of
+ * every sensor mode: swscale as the encoder used it (bilinear), then the
+ * band converter on the encoder thread alone and with its helpers, to
+ * YUV420 and to NV12. The difference is the largest one to swscale's
+ * picture in any plane, from filtering the chroma differently.
+ */
+int runConvertBenchmark(const VideoConfig &benchmarkConfig) {
+    std::vector<Size> sizes;
+    {
+        VideoConfig probe = benchmarkConfig;
+        probe.mode = 0;
+        CameraSession session(probe);
+        if (session.open({ StreamRole::Raw })) {
+            for (const SensorMode &mode : session.sensorModes()) {
+                Size size(mode.width, mode.height);
+                if (std::find(sizes.begin(), sizes.end(), size) == sizes.end())
+                    sizes.push_back(size);
+            }
+        }
+    }
+    if (sizes.empty()) {
+        std::cerr << "No sensor modes, converting the --benchmark-sizes instead" << std::endl;
+        sizes = benchmarkConfig.benchmarkSizes;
+    }
+
+    unsigned int threads = convertThreads(benchmarkConfig);
+    ColourConverter single;
+    ColourConverter banded;
+    single.start(1);
+    banded.start(threads);
+
+    std::cout << "XRGB8888 conversion, " << colourConvertKernel() << " kernel, ms per frame" << std::endl
+              << std::left << std::setw(12) << "size" << std::setw(8) << "format" << std::right
+              << std::setw(10) << "swscale" << std::setw(10) << "1 thread" << std::setw(8) << threads
+              << " threads" << std::setw(10) << "speedup" << std::setw(12) << "difference" << std::endl
+              << std::fixed << std::setprecision(2);
+
+    int ret = 0;
+    std::mt19937 random(477);
+    for (const Size &size : sizes) {
+        int width = size.width;
+        int height = size.height;
+        // Noise, so the figures don't come from a picture that compresses in the caches
+        int stride = width * 4;
+        std::vector<uint8_t> xrgb(static_cast<size_t>(stride) * height);
+        for (uint8_t &byte : xrgb)
+            byte = random();
+        const uint8_t *src[1] = { xrgb.data() };
+        int srcStride[1] = { stride };
+
+        for (bool nv12 : { false, true }) {
+            AVPixelFormat format = nv12 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_YUV420P;
+            AVFrame *reference = av_frame_alloc();
+            AVFrame *frame = av_frame_alloc();
+            SwsContext *sws = sws_getContext(width, height, AV_PIX_FMT_RGB32, width, height, format,
+                                             SWS_BILINEAR, nullptr, nullptr, nullptr);
+            for (AVFrame *f : { reference, frame }) {
+                if (!f)
+                    continue;
+                f->format = format;
+                f->width = width;
+                f->height = height;
+            }
+            if (!reference || !frame || !sws || av_frame_get_buffer(reference, 32) < 0 ||
+                av_frame_get_buffer(frame, 32) < 0) {
+                std::cerr << "Failed to set up the " << size.toString() << " conversion" << std::endl;
+                ret = EXIT_FAILURE;
+            } else {
+                double swscale = convertMilliseconds([&]() {
+                    sws_scale(sws, src, srcStride, 0, height, reference->data, reference->linesize);
+                });
+                double one = convertMilliseconds([&]() {
+                    single.convert(xrgb.data(), stride, width, height, frame->data, frame->linesize, nv12);
+                });
+                double all = convertMilliseconds([&]() {
+                    banded.convert(xrgb.data(), stride, width, height, frame->data, frame->linesize, nv12);
+                });
+
+                std::cout << std::left << std::setw(12) << size.toString() << std::setw(8)
+                          << (nv12 ? "nv12" : "yuv420") << std::right << std::setw(10) << swscale
+                          << std::setw(10) << one << std::setw(16) << all << std::setw(9)
+                          << swscale / all << "x" << std::setw(12) << maxDifference(reference, frame, nv12)
+                          << std::endl;
+            }
+            sws_freeContext(sws);
+            av_frame_free(&frame);
+            av_frame_free(&reference);
+        }
+    }
+    return ret;
+}
+
+/* SIGUSR1 writes out the pre-roll and keeps recording for the post-roll */
+static void onTrigger(int) {
+    triggerSignals++;
+}
+
 int main(int argc, char * argv[]){
 
     for (int i = 1; i < argc; ++i) {
@@ -398,80 +1931,570 @@ int main(int argc, char * argv[]){
                         << "\t-H Horizontal flip" << std::endl
                         << "\t-e exposure time"<< std::endl
                         << "\t-a analogue gain"<< std::endl
-                        << "\t-m functioning mode"<< std::endl
-                        << "\t-s seconds" << std::endl;
+                        << "\t-m sensor mode, an index of the --list-modes list (default: 0)"<< std::endl
+                        << "\t--list-modes list the sensor modes of the camera and exit" << std::endl
+                        << "\t-C camera, libcamera id or index (default: the first one)" << std::endl
+                        << "\t--cameras comma separated ids or indices recorded together, into output_cam0.mp4..." << std::endl
+                        << "\t--trigger hw (default): the first camera drives XVS and the others follow it, off: free running" << std::endl
+                        << "\t--pairs file of the --cameras frames paired by sensor timestamp (default: none)" << std::endl
+                        << "\t-s seconds" << std::endl
+                        << "\t--warmup seconds captured before measuring (default: 0, 2 with --benchmark)" << std::endl
+                        << "\t-o output file (default: output.mp4)" << std::endl
+                        << "\t--segment seconds of each output file, split on keyframes: output_00001.mp4... (default: one file)" << std::endl
+                        << "\t--max-disk MB kept of segments, the live one included, the oldest are deleted (default: no limit)" << std::endl
+                        << "\t--pre-roll seconds kept in memory, only written from SIGUSR1 on (default: always recording)" << std::endl
+                        << "\t--post-roll seconds recorded after the last SIGUSR1 (default: the pre-roll)" << std::endl
+                        << "\t--metadata file of per-frame exposure, gain, colour temperature and timestamps (default: none)" << std::endl
+                        << "\t--embedded[=node] add the sensor's embedded data to --metadata: frame count, applied exposure" << std::endl
+                        << "\t           and gain (default node: unicam-embedded, free unless the pipeline reads it itself)" << std::endl
+                        << "\t--benchmark[=csv|json] run every mode with each benchmark size and format, report on stdout" << std::endl
+                        << "\t--benchmark-sizes comma separated WxH list (default: 1332x990,2028x1080,2028x1520)" << std::endl
+                        << "\t--benchmark-formats comma separated pixel formats (default: yuv420,nv12,xrgb8888)" << std::endl
+                        << "\t--preview WxH add a Viewfinder stream of that size (default: none)" << std::endl
+                        << "\t--preview-fps preview frame rate (default: 5)" << std::endl
+                        << "\t--preview-format preview pixel format (default: yuv420)" << std::endl
+                        << "\t--preview-shm shared memory holding the latest preview frame (default: /imx477-preview)" << std::endl
+                        << "\t--publish Unix socket lending the preview buffers to other processes (default: none)" << std::endl
+                        << "\t--controls read control commands from stdin while recording: exposure <us>, gain <g>," << std::endl
+                        << "\t           fps <n>, frame-duration <min> [<max>] or auto, several may share a line" << std::endl
+                        << "\t--stats-interval seconds between frame timing reports to syslog (default: end of run only)" << std::endl
+                        << "\t-q requests kept in flight (default: every allocated buffer)" << std::endl
+                        << "\t-r encoder ring size (default: requests in flight - 2)" << std::endl
+                        << "\t-f pixel format: yuv420 (default), nv12 or xrgb8888" << std::endl
+                        << "\t--encoder backend: sw (default) or v4l2m2m" << std::endl
+                        << "\t--encoder-device V4L2 mem2mem encoder node (default: /dev/video11)" << std::endl
+                        << "\t--bitrate bits per second (default: 400000)" << std::endl
+                        << "\t--gop, --keyint frames between keyframes (default: encoder default)" << std::endl
+                        << "\t--rate-control abr (default), cbr or crf (sw only)" << std::endl
+                        << "\t--crf quality for --rate-control crf, 0-51 (default: 23)" << std::endl
+                        << "\t--preset x264 preset (default: ultrafast)" << std::endl
+                        << "\t--tune x264 tuning, none to disable (default: zerolatency)" << std::endl
+                        << "\t--threads encoder threads, 0 for automatic (default: 0)" << std::endl
+                        << "\t--thread-type slice (default) or frame" << std::endl
+                        << "\t--convert-threads threads converting xrgb8888 for the encoder, in bands (default: one per core, up to 4)" << std::endl
+                        << "\t--convert-benchmark time the xrgb8888 conversion against swscale at each mode's size and exit" << std::endl
+                        << "\t--pin stage=cpus[:priority] run a stage's threads on those cpus, SCHED_FIFO at priority," << std::endl
+                        << "\t      repeatable: --pin encoder=2-3 --pin completion=1:50. Stages: completion, encoder," << std::endl
+                        << "\t      muxer, convert, preview, v4l2-encoder and other for every thread left (default: not pinned)" << std::endl;
             // Add other options here
             return 0;
         }
     }
 
-    height = 1024; 
-    width = 1024;
-    hflip = 0;
-    vflip = 0;
-
-    mode = 0;
-    exposure = -1;
-    analog_gain = -1;
-
+    VideoConfig config;
+    config.height = 1024; 
+    config.width = 1024;
+    config.hflip = 0;
+    config.vflip = 0;
+
+    config.mode = 0;
+    config.exposure = -1;
+    config.analogueGain = -1;
+    config.queueDepth = 0;
+    config.ringSize = 0;
+    config.pixelFormat = formats::YUV420;
+    config.encoderBackend = EncoderBackend::Software;
+    config.encoderDevice = "/dev/video11";
+    config.bitrate = 400'000;
+    config.gopSize = 0;
+    config.statsInterval = 0;
+    config.warmupSeconds = -1;
+    config.outputFile = "output.mp4";
+    config.outputFormat = nullptr;
+    config.metadataFile = nullptr;
+    config.segmentSeconds = 0;
+    config.maxDiskBytes = 0;
+    config.preRollSeconds = 0;
+    config.postRollSeconds = 0;
+    config.benchmarkOutput = BenchmarkOutput::None;
+    config.previewSize = Size();
+    config.previewFormat = formats::YUV420;
+    config.previewFps = 5;
+    config.previewShm = "/imx477-preview";
+    config.publishSocket = nullptr;
+    config.controlStdin = false;
+    config.embeddedData = false;
+    config.embeddedNode = nullptr;
+    config.hardwareTrigger = true;
+    config.pairFile = nullptr;
+    config.durationSeconds = 0;
+    config.benchmarkSizes = { Size(1332, 990), Size(2028, 1080), Size(2028, 1520) };
+    config.benchmarkFormats = { formats::YUV420, formats::NV12, formats::XRGB8888 };
+    config.rateControl = RateControl::ABR;
+    config.crf = 23;
+    config.preset = "ultrafast";
+    // No lookahead or B frames, the encoder gives each buffer back before the next one
+    config.tune = "zerolatency";
+    config.encoderThreads = 0;
+    config.threadType = FF_THREAD_SLICE;
+    config.convertThreads = 0;
+
+    enum {
+        OPT_ENCODER = 256,
+        OPT_ENCODER_DEVICE,
+        OPT_BITRATE,
+        OPT_GOP,
+        OPT_RATE_CONTROL,
+        OPT_CRF,
+        OPT_PRESET,
+        OPT_TUNE,
+        OPT_THREADS,
+        OPT_THREAD_TYPE,
+        OPT_STATS_INTERVAL,
+        OPT_METADATA,
+        OPT_SEGMENT,
+        OPT_MAX_DISK,
+        OPT_PRE_ROLL,
+        OPT_POST_ROLL,
+        OPT_WARMUP,
+        OPT_BENCHMARK,
+        OPT_BENCHMARK_SIZES,
+        OPT_BENCHMARK_FORMATS,
+        OPT_PREVIEW,
+        OPT_PREVIEW_FPS,
+        OPT_PREVIEW_FORMAT,
+        OPT_PREVIEW_SHM,
+        OPT_PUBLISH,
+        OPT_CONTROLS,
+        OPT_LIST_MODES,
+        OPT_EMBEDDED,
+        OPT_CAMERAS,
+        OPT_TRIGGER,
+        OPT_PAIRS,
+        OPT_PIN,
+        OPT_CONVERT_THREADS,
+        OPT_CONVERT_BENCHMARK,
+    };
+    static const struct option longOptions[] = {
+        { "encoder", required_argument, nullptr, OPT_ENCODER },
+        { "encoder-device", required_argument, nullptr, OPT_ENCODER_DEVICE },
+        { "bitrate", required_argument, nullptr, OPT_BITRATE },
+        { "gop", required_argument, nullptr, OPT_GOP },
+        { "keyint", required_argument, nullptr, OPT_GOP },
+        { "rate-control", required_argument, nullptr, OPT_RATE_CONTROL },
+        { "crf", required_argument, nullptr, OPT_CRF },
+        { "preset", required_argument, nullptr, OPT_PRESET },
+        { "tune", required_argument, nullptr, OPT_TUNE },
+        { "threads", required_argument, nullptr, OPT_THREADS },
+        { "thread-type", required_argument, nullptr, OPT_THREAD_TYPE },
+        { "stats-interval", required_argument, nullptr, OPT_STATS_INTERVAL },
+        { "metadata", required_argument, nullptr, OPT_METADATA },
+        { "segment", required_argument, nullptr, OPT_SEGMENT },
+        { "max-disk", required_argument, nullptr, OPT_MAX_DISK },
+        { "pre-roll", required_argument, nullptr, OPT_PRE_ROLL },
+        { "post-roll", required_argument, nullptr, OPT_POST_ROLL },
+        { "warmup", required_argument, nullptr, OPT_WARMUP },
+        { "benchmark", optional_argument, nullptr, OPT_BENCHMARK },
+        { "benchmark-sizes", required_argument, nullptr, OPT_BENCHMARK_SIZES },
+        { "benchmark-formats", required_argument, nullptr, OPT_BENCHMARK_FORMATS },
+        { "preview", required_argument, nullptr, OPT_PREVIEW },
+        { "preview-fps", required_argument, nullptr, OPT_PREVIEW_FPS },
+        { "preview-format", required_argument, nullptr, OPT_PREVIEW_FORMAT },
+        { "preview-shm", required_argument, nullptr, OPT_PREVIEW_SHM },
+        { "publish", required_argument, nullptr, OPT_PUBLISH },
+        { "controls", no_argument, nullptr, OPT_CONTROLS },
+        { "list-modes", no_argument, nullptr, OPT_LIST_MODES },
+        { "embedded", optional_argument, nullptr, OPT_EMBEDDED },
+        { "cameras", required_argument, nullptr, OPT_CAMERAS },
+        { "trigger", required_argument, nullptr, OPT_TRIGGER },
+        { "pairs", required_argument, nullptr, OPT_PAIRS },
+        { "pin", required_argument, nullptr, OPT_PIN },
+        { "convert-threads", required_argument, nullptr, OPT_CONVERT_THREADS },
+        { "convert-benchmark", no_argument, nullptr, OPT_CONVERT_BENCHMARK },
+        { nullptr, 0, nullptr, 0 },
+    };
+
+    bool listModes = false;
+    bool convertBenchmark = false;
     int opt;
     optind = 1;
     double exp_mult;
-    while((opt = getopt(argc,argv, "h:w:VHi:j:e:m:a:s:")) != -1){
+    while((opt = getopt_long(argc,argv, "h:w:VHi:j:e:m:a:s:q:r:f:o:C:", longOptions, nullptr)) != -1){
         switch(opt){
             case 'h':
-                height = atoi(optarg);
-                if (height <= 0) {
+                config.height = atoi(optarg);
+                if (config.height <= 0) {
                     std::cerr << "Height not valid, must be positive integer greather than 0" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
             case 'w':
-                width = atoi(optarg);
-                if (width <= 0) {
+                config.width = atoi(optarg);
+                if (config.width <= 0) {
                     std::cerr << "Width not valid, must be positive integer greather than 0" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
             case 'V':
-                vflip = 1;
+                config.vflip = 1;
                 break;
             case 'H':
-                hflip = 1;
+                config.hflip = 1;
                 break;
             case 'e':
                 exp_mult = atof(optarg);
-                exposure = exp_mult * 10000;
-                if(exposure < 0) {
+                config.exposure = exp_mult * 10000;
+                if(config.exposure < 0) {
                     std::cerr << "Exposure is not valid, must be positive integer" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
             case 'm':
-                mode = atoi(optarg);
-                if(mode < 0 || mode >= 4) {
-                    std::cerr << "There is only four modes (0-3) available" << std::endl;
+                config.mode = atoi(optarg);
+                if(config.mode < 0) {
+                    std::cerr << "Mode not valid, must be positive integer or 0, see --list-modes" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
             case 'a':
-                analog_gain = atof(optarg);
-                if(analog_gain < 0) {
+                config.analogueGain = atof(optarg);
+                if(config.analogueGain < 0) {
                     std::cerr << "Analog Gain is not valid, must be positive integer" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
             case 's':
-                durationSeconds = atoi(optarg);
-                if (durationSeconds <= 0) {
+                config.durationSeconds = atoi(optarg);
+                if (config.durationSeconds <= 0) {
                     std::cerr << "durationSeconds not valid, must be positive integer greather than 0" << std::endl;
                     return EXIT_FAILURE;
                 }
                 break;
+            case 'q':
+                config.queueDepth = atoi(optarg);
+                if (config.queueDepth <= 0) {
+                    std::cerr << "Queue depth not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                config.ringSize = atoi(optarg);
+                if (config.ringSize <= 0) {
+                    std::cerr << "Ring size not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'f':
+                if (!parsePixelFormat(optarg, config.pixelFormat)) {
+                    std::cerr << "Pixel format not valid, must be yuv420, nv12 or xrgb8888" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'o':
+                config.outputFile = optarg;
+                break;
+            case 'C':
+                config.cameraId = optarg;
+                break;
+            case OPT_ENCODER:
+                if (strcmp(optarg, "sw") == 0) {
+                    config.encoderBackend = EncoderBackend::Software;
+                } else if (strcmp(optarg, "v4l2m2m") == 0) {
+                    config.encoderBackend = EncoderBackend::V4L2;
+                } else {
+                    std::cerr << "Encoder not valid, must be sw or v4l2m2m" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_ENCODER_DEVICE:
+                config.encoderDevice = optarg;
+                break;
+            case OPT_BITRATE:
+                config.bitrate = atoi(optarg);
+                if (config.bitrate <= 0) {
+                    std::cerr << "Bitrate not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_GOP:
+                config.gopSize = atoi(optarg);
+                if (config.gopSize <= 0) {
+                    std::cerr << "GOP not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_RATE_CONTROL:
+                if (strcmp(optarg, "abr") == 0) {
+                    config.rateControl = RateControl::ABR;
+                } else if (strcmp(optarg, "cbr") == 0) {
+                    config.rateControl = RateControl::CBR;
+                } else if (strcmp(optarg, "crf") == 0) {
+                    config.rateControl = RateControl::CRF;
+                } else {
+                    std::cerr << "Rate control not valid, must be abr, cbr or crf" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_CRF:
+                config.crf = atoi(optarg);
+                if (config.crf < 0 || config.crf > 51) {
+                    std::cerr << "CRF not valid, must be between 0 and 51" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_PRESET:
+                config.preset = optarg;
+                break;
+            case OPT_TUNE:
+                config.tune = strcmp(optarg, "none") == 0 ? nullptr : optarg;
+                break;
+            case OPT_THREADS:
+                config.encoderThreads = atoi(optarg);
+                if (config.encoderThreads < 0) {
+                    std::cerr << "Threads not valid, must be positive integer or 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_THREAD_TYPE:
+                if (strcmp(optarg, "slice") == 0) {
+                    config.threadType = FF_THREAD_SLICE;
+                } else if (strcmp(optarg, "frame") == 0) {
+                    config.threadType = FF_THREAD_FRAME;
+                } else {
+                    std::cerr << "Thread type not valid, must be slice or frame" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_STATS_INTERVAL:
+                config.statsInterval = atoi(optarg);
+                if (config.statsInterval <= 0) {
+                    std::cerr << "Stats interval not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_METADATA:
+                config.metadataFile = optarg;
+                break;
+            case OPT_SEGMENT:
+                config.segmentSeconds = atoi(optarg);
+                if (config.segmentSeconds <= 0) {
+                    std::cerr << "Segment length not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_MAX_DISK: {
+                int megabytes = atoi(optarg);
+                if (megabytes <= 0) {
+                    std::cerr << "Disk cap not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                config.maxDiskBytes = static_cast<uint64_t>(megabytes) << 20;
+                break;
+            }
+            case OPT_PRE_ROLL:
+                config.preRollSeconds = atoi(optarg);
+                if (config.preRollSeconds <= 0) {
+                    std::cerr << "Pre-roll not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_POST_ROLL:
+                config.postRollSeconds = atoi(optarg);
+                if (config.postRollSeconds <= 0) {
+                    std::cerr << "Post-roll not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_WARMUP:
+                config.warmupSeconds = atoi(optarg);
+                if (config.warmupSeconds < 0) {
+                    std::cerr << "Warm-up not valid, must be positive integer or 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_BENCHMARK:
+                if (!optarg || strcmp(optarg, "csv") == 0) {
+                    config.benchmarkOutput = BenchmarkOutput::CSV;
+                } else if (strcmp(optarg, "json") == 0) {
+                    config.benchmarkOutput = BenchmarkOutput::JSON;
+                } else {
+                    std::cerr << "Benchmark output not valid, must be csv or json" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_BENCHMARK_SIZES: {
+                config.benchmarkSizes.clear();
+                std::stringstream list(optarg);
+                std::string item;
+                while (std::getline(list, item, ',')) {
+                    unsigned int w, h;
+                    if (sscanf(item.c_str(), "%ux%u", &w, &h) != 2 || !w || !h) {
+                        std::cerr << "Benchmark size " << item << " not valid, must be WIDTHxHEIGHT" << std::endl;
+                        return EXIT_FAILURE;
+                    }
+                    config.benchmarkSizes.push_back(Size(w, h));
+                }
+                break;
+            }
+            case OPT_BENCHMARK_FORMATS: {
+                config.benchmarkFormats.clear();
+                std::stringstream list(optarg);
+                std::string item;
+                while (std::getline(list, item, ',')) {
+                    PixelFormat format;
+                    if (!parsePixelFormat(item.c_str(), format)) {
+                        std::cerr << "Benchmark format " << item << " not valid, must be yuv420, nv12 or xrgb8888" << std::endl;
+                        return EXIT_FAILURE;
+                    }
+                    config.benchmarkFormats.push_back(format);
+                }
+                break;
+            }
+            case OPT_PREVIEW: {
+                unsigned int w, h;
+                if (sscanf(optarg, "%ux%u", &w, &h) != 2 || !w || !h) {
+                    std::cerr << "Preview size not valid, must be WIDTHxHEIGHT" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                config.previewSize = Size(w, h);
+                break;
+            }
+            case OPT_PREVIEW_FPS:
+                config.previewFps = atoi(optarg);
+                if (config.previewFps <= 0) {
+                    std::cerr << "Preview fps not valid, must be positive integer greather than 0" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_PREVIEW_FORMAT:
+                if (!parsePixelFormat(optarg, config.previewFormat)) {
+                    std::cerr << "Preview format not valid, must be yuv420, nv12 or xrgb8888" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_PREVIEW_SHM:
+                config.previewShm = optarg;
+                break;
+            case OPT_PUBLISH:
+                config.publishSocket = optarg;
+                break;
+            case OPT_CONTROLS:
+                config.controlStdin = true;
+                break;
+            case OPT_LIST_MODES:
+                listModes = true;
+                break;
+            case OPT_EMBEDDED:
+                config.embeddedData = true;
+                config.embeddedNode = optarg;
+                break;
+            case OPT_CAMERAS: {
+                std::stringstream list(optarg);
+                std::string id;
+                config.syncCameras.clear();
+                while (std::getline(list, id, ','))
+                    config.syncCameras.push_back(id);
+                if (config.syncCameras.size() < 2 || config.syncCameras.size() > FramePairer::kMaxCameras) {
+                    std::cerr << "Cameras not valid, must be 2 to " << FramePairer::kMaxCameras << " ids or indices" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            }
+            case OPT_TRIGGER:
+                if (strcmp(optarg, "hw") == 0)
+                    config.hardwareTrigger = true;
+                else if (strcmp(optarg, "off") == 0)
+                    config.hardwareTrigger = false;
+                else {
+                    std::cerr << "Trigger not valid, must be hw or off" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_PAIRS:
+                config.pairFile = optarg;
+                break;
+            case OPT_PIN: {
+                const char *equals = strchr(optarg, '=');
+                ThreadPolicy policy;
+                if (!equals || equals == optarg || !parseThreadPolicy(equals + 1, policy)) {
+                    std::cerr << "Pin not valid, must be stage=cpus[:priority]" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                config.threadPolicies[std::string(optarg, equals - optarg)] = policy;
+                break;
+            }
+            case OPT_CONVERT_THREADS:
+                config.convertThreads = atoi(optarg);
+                if (config.convertThreads <= 0) {
+                    std::cerr << "Convert threads not valid, must be positive integer" << std::endl;
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_CONVERT_BENCHMARK:
+                convertBenchmark = true;
+                break;
         }
     }
 
+    if (listModes)
+        return CameraSession::listModes(config, std::cout) ? 0 : EXIT_FAILURE;
+
+    if (config.maxDiskBytes && !config.segmentSeconds && !config.preRollSeconds) {
+        std::cerr << "A disk cap needs segments, set --segment or --pre-roll" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (config.preRollSeconds > 0) {
+        if (!config.postRollSeconds)
+            config.postRollSeconds = config.preRollSeconds;
+        struct sigaction action = {};
+        action.sa_handler = onTrigger;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &action, nullptr);
+    }
+
+    if (config.encoderBackend == EncoderBackend::V4L2 && config.rateControl == RateControl::CRF) {
+        std::cerr << "The V4L2 encoder has no constant quality mode, --rate-control must be abr or cbr" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (config.embeddedData && !config.metadataFile) {
+        std::cerr << "The embedded data goes to the metadata file, --metadata must be set" << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    int ret = imageProcessing();
+    if (!config.syncCameras.empty() && (!config.previewSize.isNull() || config.controlStdin ||
+                                         config.benchmarkOutput != BenchmarkOutput::None)) {
+        std::cerr << "--cameras can't be combined with --preview, --controls or --benchmark" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (config.pairFile && config.syncCameras.empty()) {
+        std::cerr << "Pairs need several cameras, --cameras must be set" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (config.publishSocket && config.previewSize.isNull()) {
+        std::cerr << "Publishing lends the preview buffers, --preview must be set" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    if (config.benchmarkOutput != BenchmarkOutput::None) {
+        // Encode everything but keep nothing, the muxer cost stays in the figures
+        config.outputFormat = "null";
+        config.outputFile = "benchmark";
+        if (config.durationSeconds <= 0)
+            config.durationSeconds = 5;
+        if (config.warmupSeconds < 0)
+            config.warmupSeconds = 2;
+    }
+    if (config.warmupSeconds < 0)
+        config.warmupSeconds = 0;
+
+    // Before any thread starts, each one applies its stage's policy as it registers
+    for (const auto &[stage, policy] : config.threadPolicies)
+        ThreadRegistry::instance().setPolicy(stage, policy);
+
+    if (convertBenchmark)
+        return runConvertBenchmark(config);
+
+    openlog("imx477-client", LOG_PID | LOG_CONS, LOG_USER);
+    int ret;
+    if (config.benchmarkOutput != BenchmarkOutput::None)
+        ret = runBenchmark(config);
+    else if (!config.syncCameras.empty())
+        ret = multiCapture(config);
+    else
+        ret = imageProcessing(config);
+    closelog();
     return ret;
 }
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "thread_util.h"
+
+/*
+ * XRGB8888 to YUV420 (three planes) or NV12 (luma, then interleaved Cb/Cr),
+ * the conversion of the encoder when the camera only gives RGB.
+ *
+ * XRGB8888 is stored B, G, R, X. The matrix is BT.601 limited range, the one
+ * swscale picks for this pair by default, in 8 bit fixed point:
+ *
+ *   Y  = ((  66 R + 129 G +  25 B + 128) >> 8) + 16
+ *   Cb = (( -38 R -  74 G + 112 B + 128) >> 8) + 128
+ *   Cr = (( 112 R -  94 G -  18 B + 128) >> 8) + 128
+ *
+ * Chroma comes from the rounded average of each 2x2 block. An odd last
+ * column or row counts twice.
+ *
+ * The scalar version is the reference, and the NEON one must give the same
+ * result bit for bit. Each NEON step takes 16 pixels of two rows and leaves
+ * the tail of the row to the scalar code.
+ */
+
+inline uint8_t xrgbLuma(int r, int g, int b) {
+    return ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+}
+
+inline uint8_t xrgbCb(int r, int g, int b) {
+    return ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+}
+
+inline uint8_t xrgbCr(int r, int g, int b) {
+    return ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+}
+
+/*
+ * Two rows from pixel begin (even) to width. Chroma sample i goes to
+ * u[i * uvStep] and v[i * uvStep]. For NV12 uvStep is 2 and v is u + 1.
+ */
+inline void convertXrgbPairScalar(const uint8_t *row0, const uint8_t *row1, uint8_t *y0, uint8_t *y1,
+                                  uint8_t *u, uint8_t *v, int uvStep, int begin, int width) {
+    for (int x = begin; x < width; x += 2) {
+        int next = std::min(x + 1, width - 1);
+        const uint8_t *p[4] = { row0 + x * 4, row0 + next * 4, row1 + x * 4, row1 + next * 4 };
+
+        y0[x] = xrgbLuma(p[0][2], p[0][1], p[0][0]);
+        y1[x] = xrgbLuma(p[2][2], p[2][1], p[2][0]);
+        if (next != x) {
+            y0[next] = xrgbLuma(p[1][2], p[1][1], p[1][0]);
+            y1[next] = xrgbLuma(p[3][2], p[3][1], p[3][0]);
+        }
+
+        int b = (p[0][0] + p[1][0] + p[2][0] + p[3][0] + 2) >> 2;
+        int g = (p[0][1] + p[1][1] + p[2][1] + p[3][1] + 2) >> 2;
+        int r = (p[0][2] + p[1][2] + p[2][2] + p[3][2] + 2) >> 2;
+        u[x / 2 * uvStep] = xrgbCb(r, g, b);
+        v[x / 2 * uvStep] = xrgbCr(r, g, b);
+    }
+}
+
+#if defined(__ARM_NEON)
+inline uint8x8_t xrgbLuma8(uint8x8_t r, uint8x8_t g, uint8x8_t b) {
+    // At most 220 * 255 + 128, the sum fits 16 bits unsigned
+    uint16x8_t sum = vmull_u8(r, vdup_n_u8(66));
+    sum = vmlal_u8(sum, g, vdup_n_u8(129));
+    sum = vmlal_u8(sum, b, vdup_n_u8(25));
+    return vadd_u8(vrshrn_n_u16(sum, 8), vdup_n_u8(16));
+}
+
+inline uint8x16_t xrgbLuma16(const uint8x16x4_t &p) {
+    return vcombine_u8(xrgbLuma8(vget_low_u8(p.val[2]), vget_low_u8(p.val[1]), vget_low_u8(p.val[0])),
+                       xrgbLuma8(vget_high_u8(p.val[2]), vget_high_u8(p.val[1]), vget_high_u8(p.val[0])));
+}
+
+/* Rounded average of the 2x2 blocks of one channel of both rows, 0-255 in 16 bit lanes */
+inline int16x8_t xrgbAverage(uint8x16_t row0, uint8x16_t row1) {
+    return vreinterpretq_s16_u16(vrshrq_n_u16(vaddq_u16(vpaddlq_u8(row0), vpaddlq_u8(row1)), 2));
+}
+
+/* a R + b G + c B, at most 112 * 255 either way so it fits 16 bits signed */
+inline uint8x8_t xrgbChroma8(int16x8_t r, int16x8_t g, int16x8_t b, int16_t cr, int16_t cg, int16_t cb) {
+    int16x8_t sum = vmulq_n_s16(r, cr);
+    sum = vmlaq_n_s16(sum, g, cg);
+    sum = vmlaq_n_s16(sum, b, cb);
+    return vqmovun_s16(vaddq_s16(vrshrq_n_s16(sum, 8), vdupq_n_s16(128)));
+}
+#endif
+
+inline void convertXrgbPair(const uint8_t *row0, const uint8_t *row1, uint8_t *y0, uint8_t *y1,
+                            uint8_t *u, uint8_t *v, int uvStep, int width) {
+    int x = 0;
+
+#if defined(__ARM_NEON)
+    // vld4 splits 16 pixels into their B, G, R and X bytes
+    for (; x + 16 <= width; x += 16) {
+        uint8x16x4_t p0 = vld4q_u8(row0 + x * 4);
+        uint8x16x4_t p1 = vld4q_u8(row1 + x * 4);
+        vst1q_u8(y0 + x, xrgbLuma16(p0));
+        vst1q_u8(y1 + x, xrgbLuma16(p1));
+
+        int16x8_t b = xrgbAverage(p0.val[0], p1.val[0]);
+        int16x8_t g = xrgbAverage(p0.val[1], p1.val[1]);
+        int16x8_t r = xrgbAverage(p0.val[2], p1.val[2]);
+        uint8x8_t cb = xrgbChroma8(r, g, b, -38, -74, 112);
+        uint8x8_t cr = xrgbChroma8(r, g, b, 112, -94, -18);
+        if (uvStep == 2) {
+            uint8x8x2_t cbcr = { { cb, cr } };
+            vst2_u8(u + x, cbcr);
+        } else {
+            vst1_u8(u + x / 2, cb);
+            vst1_u8(v + x / 2, cr);
+        }
+    }
+#endif
+
+    convertXrgbPairScalar(row0, row1, y0, y1, u, v, uvStep, x, width);
+}
+
+/*
+ * Rows first to last of the picture, first even. The planes are given as
+ * in AVFrame: data[0] luma, then data[1] Cb/Cr for NV12, or data[1] Cb and
+ * data[2] Cr.
+ */
+inline void convertXrgbRows(const uint8_t *src, int srcStride, int width, int height, int first, int last,
+                            uint8_t *const dst[], const int dstStride[], bool nv12) {
+    for (int row = first; row < last; row += 2) {
+        int below = std::min(row + 1, height - 1);
+        uint8_t *y0 = dst[0] + static_cast<ptrdiff_t>(row) * dstStride[0];
+        uint8_t *y1 = dst[0] + static_cast<ptrdiff_t>(below) * dstStride[0];
+        uint8_t *u = dst[1] + static_cast<ptrdiff_t>(row / 2) * dstStride[1];
+        uint8_t *v = nv12 ? u + 1 : dst[2] + static_cast<ptrdiff_t>(row / 2) * dstStride[2];
+        convertXrgbPair(src + static_cast<ptrdiff_t>(row) * srcStride, src + static_cast<ptrdiff_t>(below) * srcStride,
+                        y0, y1, u, v, nv12 ? 2 : 1, width);
+    }
+}
+
+/*
+ * Converts whole pictures by splitting them into horizontal bands, each
+ * with an even number of rows. The calling thread converts the first band.
+ * Its helper threads convert the rest, and convert() returns when every
+ * band is written. The helpers are stage threads of "convert", so --pin
+ * places them like the rest of the pipeline.
+ *
+ * convert() may only be called from one thread at a time. The bands write
+ * disjoint rows of the destination, so no other locking is needed.
+ */
+class ColourConverter {
+    public:
+        ~ColourConverter() {
+            stop();
+        }
+
+        /* threads in all, the caller included, 1 converts on the calling thread alone */
+        void start(unsigned int threads) {
+            stop();
+            stopping = false;
+            bands = std::max(threads, 1u);
+            for (unsigned int i = 1; i < bands; i++)
+                helpers.emplace_back(&ColourConverter::helperLoop, this, i);
+        }
+
+        void stop() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            wake.notify_all();
+            for (std::thread &helper : helpers)
+                helper.join();
+            helpers.clear();
+            bands = 1;
+            // Helpers of a later start() begin from generation 0, they must not see an old job as new
+            generation = 0;
+            pending = 0;
+        }
+
+        unsigned int threads() const { return bands; }
+
+        void convert(const uint8_t *src, int srcStride, int width, int height,
+                     uint8_t *const dst[], const int dstStride[], bool nv12) {
+            job = { src, srcStride, width, height, { dst[0], dst[1], nv12 ? nullptr : dst[2] },
+                    { dstStride[0], dstStride[1], nv12 ? 0 : dstStride[2] }, nv12 };
+            if (bands > 1) {
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    pending = bands - 1;
+                    generation++;
+                }
+                wake.notify_all();
+            }
+
+            convertBand(0);
+
+            if (bands > 1) {
+                std::unique_lock<std::mutex> lock(mtx);
+                done.wait(lock, [this]() { return pending == 0; });
+            }
+        }
+
+    private:
+        struct Job {
+            const uint8_t *src;
+            int srcStride;
+            int width;
+            int height;
+            uint8_t *dst[3];
+            int dstStride[3];
+            bool nv12;
+        };
+
+        std::vector<std::thread> helpers;
+        unsigned int bands = 1;
+        std::mutex mtx;
+        std::condition_variable wake;
+        std::condition_variable done;
+        uint64_t generation = 0;
+        unsigned int pending = 0;
+        bool stopping = false;
+        // Written by convert() before the generation moves on, read by the helpers after
+        Job job;
+
+        void convertBand(unsigned int band) {
+            // Pairs of rows shared out as evenly as they go
+            int pairs = (job.height + 1) / 2;
+            int first = 2 * static_cast<int>(static_cast<int64_t>(pairs) * band / bands);
+            int last = std::min(2 * static_cast<int>(static_cast<int64_t>(pairs) * (band + 1) / bands), job.height);
+            convertXrgbRows(job.src, job.srcStride, job.width, job.height, first, last,
+                            job.dst, job.dstStride, job.nv12);
+        }
+
+        void helperLoop(unsigned int band) {
+            StageThread stage("convert");
+            uint64_t seen = 0;
+            while (true) {
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    wake.wait(lock, [this, seen]() { return stopping || generation != seen; });
+                    if (stopping)
+                        return;
+                    seen = generation;
+                }
+
+                convertBand(band);
+
+                bool last;
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    last = --pending == 0;
+                }
+                if (last)
+                    done.notify_one();
+            }
+        }
+};
+
+/* The kernel convertXrgbPair() was built with, for the reports */
+inline const char *colourConvertKernel() {
+#if defined(__ARM_NEON)
+    return "NEON";
+#else
+    return "scalar";
+#endif
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "thread_util.h"
+
+/*
+ * Camera controls to change on a running capture. Fields left at their
+ * defaults keep the current value. An update is applied as a whole, on the
+ * one request it travels with.
+ */
+struct ControlUpdate {
+    unsigned int id = 0;
+    int32_t exposure = -1;          // us
+    float gain = -1;
+    int64_t minFrameDuration = 0;   // us
+    int64_t maxFrameDuration = 0;
+    bool autoExposure = false;
+
+    bool empty() const {
+        return exposure < 0 && gain < 0 && !minFrameDuration && !autoExposure;
+    }
+
+    /* Fold a later update in, its fields win */
+    void merge(const ControlUpdate &later) {
+        id = later.id;
+        if (later.autoExposure) {
+            autoExposure = true;
+            exposure = -1;
+            gain = -1;
+        }
+        if (later.exposure >= 0) {
+            exposure = later.exposure;
+            autoExposure = false;
+        }
+        if (later.gain >= 0) {
+            gain = later.gain;
+            autoExposure = false;
+        }
+        if (later.minFrameDuration) {
+            minFrameDuration = later.minFrameDuration;
+            maxFrameDuration = later.maxFrameDuration;
+        }
+    }
+
+    std::string toString() const {
+        std::ostringstream out;
+        if (autoExposure)
+            out << " auto";
+        if (exposure >= 0)
+            out << " exposure " << exposure << " us";
+        if (gain >= 0)
+            out << " gain " << gain;
+        if (minFrameDuration)
+            out << " frame duration " << minFrameDuration << "-" << maxFrameDuration << " us";
+        return out.str();
+    }
+};
+
+/*
+ * Reads control commands, one update per line, off a file descriptor (stdin)
+ * on its own thread:
+ *
+ *   exposure <us>                 fixed exposure, AE off
+ *   gain <analogue gain>          fixed gain, AE off
+ *   fps <n>                       frame duration limits of n fps
+ *   frame-duration <min> [<max>]  frame duration limits, us
+ *   auto                          back to AE
+ *
+ * Several of them may share a line ("exposure 8000 gain 2.5") and then take
+ * effect on the same frame.
+ */
+class ControlChannel {
+    public:
+        // Called on the channel thread for every valid line
+        std::function<void(const ControlUpdate &update)> update;
+
+        ~ControlChannel() {
+            stop();
+        }
+
+        void start(int fd) {
+            input = fd;
+            abort = false;
+            thread = std::thread(&ControlChannel::readLoop, this);
+        }
+
+        void stop() {
+            if (!thread.joinable())
+                return;
+            abort = true;
+            thread.join();
+        }
+
+        /* Parse one command line, false with a message on anything not understood */
+        static bool parse(const std::string &line, ControlUpdate &result) {
+            std::istringstream words(line);
+            std::string command;
+            while (words >> command) {
+                if (command == "auto") {
+                    result.autoExposure = true;
+                } else if (command == "exposure") {
+                    if (!(words >> result.exposure) || result.exposure <= 0)
+                        return invalid("Exposure not valid, must be positive integer greather than 0");
+                } else if (command == "gain") {
+                    if (!(words >> result.gain) || result.gain < 1)
+                        return invalid("Gain not valid, must be a number not below 1");
+                } else if (command == "fps") {
+                    int fps;
+                    if (!(words >> fps) || fps <= 0)
+                        return invalid("Fps not valid, must be positive integer greather than 0");
+                    result.minFrameDuration = result.maxFrameDuration = 1'000'000 / fps;
+                } else if (command == "frame-duration") {
+                    if (!(words >> result.minFrameDuration) || result.minFrameDuration <= 0)
+                        return invalid("Frame duration not valid, must be positive integer greather than 0");
+                    result.maxFrameDuration = result.minFrameDuration;
+
+                    std::string max;
+                    std::streampos position = words.tellg();
+                    if (words >> max) {
+                        char *end;
+                        long long value = strtoll(max.c_str(), &end, 10);
+                        if (*end) {
+                            // Not a number, the next command
+                            words.clear();
+                            words.seekg(position);
+                        } else if (value < result.minFrameDuration) {
+                            return invalid("Maximum frame duration must not be below the minimum");
+                        } else {
+                            result.maxFrameDuration = value;
+                        }
+                    }
+                } else {
+                    return invalid("Unknown control command " + command);
+                }
+            }
+            return !result.empty();
+        }
+
+    private:
+        int input = -1;
+        std::thread thread;
+        std::atomic<bool> abort{false};
+        unsigned int lastId = 0;
+
+        static bool invalid(const std::string &message) {
+            std::cerr << message << std::endl;
+            return false;
+        }
+
+        void readLoop() {
+            StageThread stage("controls");
+            std::string pending;
+            char chunk[256];
+
+            while (!abort) {
+                // A timeout rather than a blocking read so stop() never waits on input
+                pollfd p = { input, POLLIN, 0 };
+                int ret = poll(&p, 1, 200);
+                if (ret < 0 && errno != EINTR)
+                    return;
+                if (ret <= 0)
+                    continue;
+
+                ssize_t size = read(input, chunk, sizeof(chunk));
+                if (size <= 0)
+                    return;
+                pending.append(chunk, size);
+
+                size_t end;
+                while ((end = pending.find('\n')) != std::string::npos) {
+                    std::string line = pending.substr(0, end);
+                    pending.erase(0, end + 1);
+
+                    ControlUpdate result;
+                    if (!parse(line, result))
+                        continue;
+                    result.id = ++lastId;
+                    if (update)
+                        update(result);
+                }
+            }
+        }
+};
@@ -0,0 +1,398 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "thread_util.h"
+
+/* Registers of one frame's embedded data line, the values the sensor applied to it */
+struct EmbeddedData {
+    uint32_t frameCount;        // 0x0005, wraps at 256
+    uint32_t exposureLines;     // 0x0202
+    uint32_t gainCode;          // 0x0204
+    uint32_t frameLength;       // 0x0340, lines
+    uint32_t lineLength;        // 0x0342, pixel clocks
+    int32_t temperature;        // 0x013a, degrees C
+    // 0x3100, long exposures count exposure and frame length in units of 2^shift lines.
+    // 0 when the line doesn't carry the register, the values are then taken as unshifted
+    uint32_t exposureShift;
+
+    int32_t exposure() const {
+        uint64_t lines = static_cast<uint64_t>(exposureLines) << exposureShift;
+        return static_cast<int32_t>(lines * lineLength * 1'000'000 / kPixelRate);
+    }
+
+    uint32_t frameLines() const { return frameLength << exposureShift; }
+
+    float analogueGain() const { return 1024.0f / (1024 - gainCode); }
+
+    // IMX477_PIXEL_RATE of the driver, the same in every mode
+    static constexpr uint64_t kPixelRate = 840'000'000;
+};
+
+/*
+ * Parser of the SMIA embedded data line of the IMX477: a line start byte,
+ * then tag and value pairs with the register address set by the 0xaa and
+ * 0xa5 tags and auto-incremented by each value, packed like the pixels, so
+ * every 5th byte in RAW10 and every 3rd byte in RAW12 is a 0x55 filler.
+ *
+ * The layout is the same for every frame of a mode, only the values change:
+ * the first line is walked tag by tag to find the byte of each register, the
+ * following ones are read straight from those offsets. A line of another
+ * length, or a tag that isn't where it used to be, after a mode change,
+ * walks the line again.
+ */
+class EmbeddedDataParser {
+    public:
+        void setBitDepth(int bits) {
+            bitsPerPixel = bits;
+            valid = false;
+        }
+
+        bool parse(const uint8_t *line, size_t size, EmbeddedData &data) {
+            if (!valid || !matches(line, size)) {
+                valid = findRegisters(line, size);
+                layoutSize = size;
+            }
+            if (!valid)
+                return false;
+
+            auto value = [&](size_t index) -> uint32_t { return line[offsets[index].value]; };
+            data.frameCount = value(kFrameCount);
+            data.temperature = static_cast<int8_t>(value(kTemperature));
+            data.exposureLines = value(kExposureHi) << 8 | value(kExposureLo);
+            data.gainCode = (value(kGainHi) << 8 | value(kGainLo)) & 0x3ff;
+            data.frameLength = value(kFrameLengthHi) << 8 | value(kFrameLengthLo);
+            data.lineLength = value(kLineLengthHi) << 8 | value(kLineLengthLo);
+            data.exposureShift = present[kExposureShift] ? value(kExposureShift) & 0x7 : 0;
+            return data.lineLength != 0;
+        }
+
+    private:
+        static constexpr uint8_t kLineStart = 0x0a;
+        static constexpr uint8_t kLineEnd = 0x07;
+        static constexpr uint8_t kRegHi = 0xaa;
+        static constexpr uint8_t kRegLo = 0xa5;
+        static constexpr uint8_t kRegValue = 0x5a;
+        static constexpr uint8_t kRegSkip = 0x55;
+
+        enum { kFrameCount, kTemperature, kExposureHi, kExposureLo, kGainHi, kGainLo,
+               kFrameLengthHi, kFrameLengthLo, kLineLengthHi, kLineLengthLo, kExposureShift, kNumRegisters };
+        static constexpr uint16_t kRegisters[kNumRegisters] = {
+            0x0005, 0x013a, 0x0202, 0x0203, 0x0204, 0x0205, 0x0340, 0x0341, 0x0342, 0x0343, 0x3100,
+        };
+        // Every register but the long exposure shift, which not every line carries
+        static constexpr unsigned int kRequired = kNumRegisters - 1;
+
+        struct Offset {
+            size_t tag;
+            size_t value;
+        };
+
+        int bitsPerPixel = 12;
+        bool valid = false;
+        Offset offsets[kNumRegisters];
+        bool present[kNumRegisters] = {};
+        // Of the line the offsets were found on, a line of another length has another layout
+        size_t layoutSize = 0;
+
+        bool matches(const uint8_t *line, size_t size) const {
+            if (!size || size != layoutSize || line[0] != kLineStart)
+                return false;
+            for (unsigned int i = 0; i < kNumRegisters; i++) {
+                if (present[i] && (offsets[i].value >= size || line[offsets[i].tag] != kRegValue))
+                    return false;
+            }
+            return true;
+        }
+
+        /* Whether the byte at offset of the line is one of the packing fillers */
+        bool filler(size_t offset) const {
+            if (bitsPerPixel == 10)
+                return (offset + 1) % 5 == 0;
+            if (bitsPerPixel == 12)
+                return (offset + 1) % 3 == 0;
+            return false;
+        }
+
+        bool findRegisters(const uint8_t *line, size_t size) {
+            if (!size || line[0] != kLineStart)
+                return false;
+
+            unsigned int found = 0;
+            std::fill(present, present + kNumRegisters, false);
+            // The walk ends at the line end or the first byte that isn't a tag, complete if
+            // every required register turned up by then
+            auto complete = [this]() { return std::all_of(present, present + kRequired, [](bool p) { return p; }); };
+            uint16_t reg = 0;
+            size_t offset = 1;
+            while (true) {
+                size_t tagOffset = offset++;
+                while (offset < size && filler(offset)) {
+                    if (line[offset++] != kRegSkip)
+                        return false;
+                }
+                if (offset >= size)
+                    return complete();
+                uint8_t tag = line[tagOffset];
+                uint8_t byte = line[offset++];
+
+                if (tag == kRegHi) {
+                    reg = (reg & 0x00ff) | byte << 8;
+                } else if (tag == kRegLo) {
+                    reg = (reg & 0xff00) | byte;
+                } else if (tag == kRegSkip) {
+                    reg++;
+                } else if (tag == kRegValue) {
+                    for (unsigned int i = 0; i < kNumRegisters; i++) {
+                        if (kRegisters[i] == reg && !present[i]) {
+                            present[i] = true;
+                            offsets[i] = { tagOffset, offset - 1 };
+                            if (++found == kNumRegisters)
+                                return true;
+                        }
+                    }
+                    reg++;
+                } else {
+                    // The line end, or anything else
+                    return complete();
+                }
+
+                while (offset < size && filler(offset)) {
+                    if (line[offset++] != kRegSkip)
+                        return false;
+                }
+                if (offset >= size)
+                    return complete();
+            }
+        }
+};
+
+/*
+ * Captures the embedded data stream of the sensor's metadata pad from the
+ * receiver's node (unicam-embedded on the Raspberry Pi) and keeps the parsed
+ * lines of the last frames, for the frame of the same sensor timestamp to
+ * pick up.
+ *
+ * Only one user can stream the node. A libcamera pipeline handler that reads
+ * the embedded data itself, as the Raspberry Pi one does for its IPA, already
+ * owns it once the camera is started and open() fails with -EBUSY: the frame
+ * metadata then carries the exposure and gain the IPA parsed from the same
+ * lines, without the frame count.
+ */
+class EmbeddedDataReader {
+    public:
+        ~EmbeddedDataReader() {
+            close();
+        }
+
+        /* The node of the first receiver exposing an embedded data stream, empty if none */
+        static std::string findNode() {
+            std::string node;
+            glob_t paths;
+            if (glob("/sys/class/video4linux/video*/name", 0, nullptr, &paths) != 0)
+                return node;
+            for (size_t i = 0; i < paths.gl_pathc && node.empty(); i++) {
+                FILE *file = fopen(paths.gl_pathv[i], "r");
+                if (!file)
+                    continue;
+                char name[64] = {};
+                if (fgets(name, sizeof(name), file) && !strncmp(name, "unicam-embedded", 15)) {
+                    std::string path = paths.gl_pathv[i];
+                    size_t start = strlen("/sys/class/video4linux/");
+                    node = "/dev/" + path.substr(start, path.find('/', start) - start);
+                }
+                fclose(file);
+            }
+            globfree(&paths);
+            return node;
+        }
+
+        int open(const std::string &device, int bitsPerPixel) {
+            fd = ::open(device.c_str(), O_RDWR | O_NONBLOCK);
+            if (fd < 0) {
+                int ret = -errno;
+                std::cerr << "Failed to open " << device << ": " << strerror(-ret) << std::endl;
+                return ret;
+            }
+            parser.setBitDepth(bitsPerPixel);
+
+            v4l2_format fmt = {};
+            fmt.type = V4L2_BUF_TYPE_META_CAPTURE;
+            if (xioctl(VIDIOC_G_FMT, &fmt) < 0)
+                return fail("Failed to get the embedded data format");
+
+            v4l2_requestbuffers reqbufs = {};
+            reqbufs.count = kBuffers;
+            reqbufs.type = V4L2_BUF_TYPE_META_CAPTURE;
+            reqbufs.memory = V4L2_MEMORY_MMAP;
+            if (xioctl(VIDIOC_REQBUFS, &reqbufs) < 0)
+                return fail(errno == EBUSY ? "Embedded data node in use, by the pipeline handler"
+                                           : "Failed to request embedded data buffers");
+
+            for (unsigned int i = 0; i < reqbufs.count; i++) {
+                v4l2_buffer buf = {};
+                buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+                buf.memory = V4L2_MEMORY_MMAP;
+                buf.index = i;
+                if (xioctl(VIDIOC_QUERYBUF, &buf) < 0)
+                    return fail("Failed to query embedded data buffer");
+
+                void *address = mmap(nullptr, buf.length, PROT_READ, MAP_SHARED, fd, buf.m.offset);
+                if (address == MAP_FAILED)
+                    return fail("Failed to mmap embedded data buffer");
+                lines.push_back({ static_cast<const uint8_t *>(address), buf.length });
+
+                if (xioctl(VIDIOC_QBUF, &buf) < 0)
+                    return fail("Failed to queue embedded data buffer");
+            }
+
+            v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+            if (xioctl(VIDIOC_STREAMON, &type) < 0)
+                return fail("Failed to start the embedded data stream");
+
+            abort = false;
+            parsed = 0;
+            failed = 0;
+            pollThread = std::thread(&EmbeddedDataReader::pollLoop, this);
+            return 0;
+        }
+
+        bool isOpen() const { return fd >= 0; }
+
+        /* The line of the frame with this sensor timestamp (ns), if it was captured */
+        bool find(uint64_t timestamp, EmbeddedData &data) {
+            std::lock_guard<std::mutex> lock(mtx);
+            for (const Entry &entry : history) {
+                uint64_t distance = entry.timestamp > timestamp ? entry.timestamp - timestamp : timestamp - entry.timestamp;
+                if (entry.timestamp && distance < kMatchWindow) {
+                    data = entry.data;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void close() {
+            if (fd < 0)
+                return;
+            if (pollThread.joinable()) {
+                abort = true;
+                pollThread.join();
+            }
+
+            v4l2_buf_type type = V4L2_BUF_TYPE_META_CAPTURE;
+            xioctl(VIDIOC_STREAMOFF, &type);
+            for (const Line &line : lines)
+                munmap(const_cast<uint8_t *>(line.data), line.length);
+            lines.clear();
+            v4l2_requestbuffers reqbufs = {};
+            reqbufs.type = V4L2_BUF_TYPE_META_CAPTURE;
+            reqbufs.memory = V4L2_MEMORY_MMAP;
+            xioctl(VIDIOC_REQBUFS, &reqbufs);
+
+            ::close(fd);
+            fd = -1;
+            std::lock_guard<std::mutex> lock(mtx);
+            for (Entry &entry : history)
+                entry = {};
+        }
+
+        uint64_t linesParsed() const { return parsed; }
+        uint64_t linesFailed() const { return failed; }
+
+    private:
+        static constexpr unsigned int kBuffers = 4;
+        // Lines kept for the encoder thread, which trails the camera by the ring
+        static constexpr size_t kHistory = 16;
+        // The receiver stamps both buffers of a frame at its start, well inside a line time
+        static constexpr uint64_t kMatchWindow = 100'000;
+
+        struct Line {
+            const uint8_t *data;
+            size_t length;
+        };
+
+        struct Entry {
+            uint64_t timestamp;
+            EmbeddedData data;
+        };
+
+        int fd = -1;
+        std::vector<Line> lines;
+        EmbeddedDataParser parser;
+        std::thread pollThread;
+        std::atomic<bool> abort;
+        std::mutex mtx;
+        Entry history[kHistory] = {};
+        size_t next = 0;
+        std::atomic<uint64_t> parsed{0};
+        std::atomic<uint64_t> failed{0};
+
+        int xioctl(unsigned long request, void *arg) {
+            int ret;
+            do {
+                ret = ioctl(fd, request, arg);
+            } while (ret == -1 && errno == EINTR);
+            return ret;
+        }
+
+        int fail(const char *message) {
+            int ret = -errno;
+            std::cerr << message << ": " << strerror(errno) << std::endl;
+            close();
+            return ret;
+        }
+
+        void pollLoop() {
+            StageThread stage("embedded");
+            while (!abort) {
+                pollfd p = { fd, POLLIN, 0 };
+                int ret = poll(&p, 1, 200);
+                if (ret < 0 && errno != EINTR) {
+                    std::cerr << "Embedded data poll failed: " << strerror(errno) << std::endl;
+                    break;
+                }
+                if (ret <= 0)
+                    continue;
+
+                while (true) {
+                    v4l2_buffer buf = {};
+                    buf.type = V4L2_BUF_TYPE_META_CAPTURE;
+                    buf.memory = V4L2_MEMORY_MMAP;
+                    if (xioctl(VIDIOC_DQBUF, &buf) < 0)
+                        break;
+
+                    EmbeddedData data;
+                    bool ok = !(buf.flags & V4L2_BUF_FLAG_ERROR) &&
+                              parser.parse(lines[buf.index].data, buf.bytesused, data);
+                    if (ok) {
+                        uint64_t timestamp = buf.timestamp.tv_sec * 1'000'000'000ULL + buf.timestamp.tv_usec * 1000ULL;
+                        std::lock_guard<std::mutex> lock(mtx);
+                        history[next] = { timestamp, data };
+                        next = (next + 1) % kHistory;
+                        parsed++;
+                    } else {
+                        failed++;
+                    }
+                    xioctl(VIDIOC_QBUF, &buf);
+                }
+            }
+        }
+};
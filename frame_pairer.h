@@ -0,0 +1,198 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+
+#include "frame_queue.h"
+#include "frame_stats.h"
+#include "thread_util.h"
+
+/*
+ * Pairs the frames of several cameras by sensor timestamp.
+ *
+ * Each camera's frames come in order, a pair is made as soon as every camera
+ * has one within the window of the others. A frame that can't be part of a
+ * pair any more, because a later frame of another camera is already past the
+ * window, is dropped as unpaired. The skew of a pair is between its earliest
+ * and latest frame.
+ *
+ * add() may be called from the completion handler of every camera, pairing
+ * is serialized on a lock and only pushes the pair to a ring, a background
+ * thread writes them out as text a few times a second.
+ */
+class FramePairer {
+    public:
+        static constexpr size_t kMaxCameras = 4;
+
+        ~FramePairer() {
+            close();
+        }
+
+        /* Pairs of count cameras, written to fileName unless null */
+        int open(const char *fileName, size_t count, int64_t windowNs) {
+            cameras = std::min(count, kMaxCameras);
+            window = windowNs;
+            pending.assign(cameras, {});
+            unpairedFrames.assign(cameras, 0);
+            pairCount = 0;
+            skewHistogram.reset();
+
+            if (!fileName)
+                return 0;
+            file = fopen(fileName, "w");
+            if (!file) {
+                int ret = -errno;
+                std::cerr << "Failed to open pair file " << fileName << ": " << strerror(-ret) << std::endl;
+                return ret;
+            }
+            fprintf(file, "pair,skew_us");
+            for (size_t i = 0; i < cameras; i++)
+                fprintf(file, ",sequence%zu,timestamp%zu", i, i);
+            fprintf(file, "\n");
+
+            ring = std::make_unique<SpscRing<Pair>>(kPairs);
+            stopping = false;
+            writer = std::thread(&FramePairer::writeLoop, this);
+            return 0;
+        }
+
+        void add(size_t camera, uint32_t sequence, uint64_t timestamp) {
+            if (camera >= cameras)
+                return;
+            std::lock_guard<std::mutex> lock(mtx);
+            std::deque<Frame> &frames = pending[camera];
+            frames.push_back({ sequence, timestamp });
+            // A camera whose partners stopped delivering doesn't pile up
+            if (frames.size() > kPending) {
+                frames.pop_front();
+                unpairedFrames[camera]++;
+            }
+
+            while (std::all_of(pending.begin(), pending.end(), [](const std::deque<Frame> &f) { return !f.empty(); })) {
+                size_t earliest = 0;
+                uint64_t first = pending[0].front().timestamp;
+                uint64_t last = first;
+                for (size_t i = 1; i < cameras; i++) {
+                    uint64_t t = pending[i].front().timestamp;
+                    if (t < first) {
+                        first = t;
+                        earliest = i;
+                    }
+                    last = std::max(last, t);
+                }
+
+                if (last - first > static_cast<uint64_t>(window)) {
+                    pending[earliest].pop_front();
+                    unpairedFrames[earliest]++;
+                    continue;
+                }
+
+                Pair pair = { pairCount++, last - first, {} };
+                for (size_t i = 0; i < cameras; i++) {
+                    pair.frames[i] = pending[i].front();
+                    pending[i].pop_front();
+                }
+                skewHistogram.record(pair.skew);
+                if (ring)
+                    ring->push(pair);
+            }
+        }
+
+        /* Write what is left in the ring and close the file */
+        void close() {
+            if (!file)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(writerMutex);
+                stopping = true;
+            }
+            wake.notify_one();
+            writer.join();
+            fclose(file);
+            file = nullptr;
+        }
+
+        uint64_t pairs() const { return pairCount; }
+        uint64_t unpaired(size_t camera) const { return camera < cameras ? unpairedFrames[camera] : 0; }
+        const LatencyHistogram &skew() const { return skewHistogram; }
+
+        std::string summary() const {
+            std::ostringstream out;
+            out << pairCount << " pairs, skew p50 " << skewHistogram.percentile(0.5) / 1e3 << " us, p99 "
+                << skewHistogram.percentile(0.99) / 1e3 << " us, max " << skewHistogram.max() / 1e3 << " us, unpaired";
+            for (size_t i = 0; i < cameras; i++)
+                out << (i ? ", " : " ") << "camera " << i << " " << unpairedFrames[i];
+            if (ring && ring->drops())
+                out << ", " << ring->drops() << " pairs not written";
+            return out.str();
+        }
+
+    private:
+        // Frames waiting for their partners, a little more than a camera can fall behind
+        static constexpr size_t kPending = 8;
+        static constexpr size_t kPairs = 1024;
+
+        struct Frame {
+            uint32_t sequence;
+            uint64_t timestamp;
+        };
+
+        struct Pair {
+            uint64_t index;
+            uint64_t skew;
+            Frame frames[kMaxCameras];
+        };
+
+        size_t cameras = 0;
+        int64_t window = 0;
+        std::mutex mtx;
+        std::vector<std::deque<Frame>> pending;
+        std::vector<uint64_t> unpairedFrames;
+        uint64_t pairCount = 0;
+        LatencyHistogram skewHistogram;
+
+        FILE *file = nullptr;
+        std::unique_ptr<SpscRing<Pair>> ring;
+        std::thread writer;
+        std::mutex writerMutex;
+        std::condition_variable wake;
+        bool stopping = false;
+
+        void writeLoop() {
+            StageThread stage("pairs");
+            while (true) {
+                bool last;
+                {
+                    std::unique_lock<std::mutex> lock(writerMutex);
+                    wake.wait_for(lock, std::chrono::milliseconds(200), [this]() { return stopping; });
+                    last = stopping;
+                }
+
+                Pair pair;
+                while (ring->pop(pair)) {
+                    fprintf(file, "%llu,%.3f", static_cast<unsigned long long>(pair.index), pair.skew / 1e3);
+                    for (size_t i = 0; i < cameras; i++)
+                        fprintf(file, ",%u,%llu", pair.frames[i].sequence,
+                                static_cast<unsigned long long>(pair.frames[i].timestamp));
+                    fprintf(file, "\n");
+                }
+                fflush(file);
+
+                if (last && ring->empty())
+                    return;
+            }
+        }
+};
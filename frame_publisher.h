@@ -0,0 +1,371 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "thread_util.h"
+
+/*
+ * Messages of the frame publisher socket, a SOCK_SEQPACKET Unix socket so
+ * every message arrives whole. All fields are host endian, readers run on
+ * the same machine.
+ *
+ *   publisher -> reader  PublisherHello once on connect, carrying one dmabuf
+ *                        fd per buffer (SCM_RIGHTS), fd i is buffer i.
+ *   publisher -> reader  PublishedFrame for every frame sent, the pixels are
+ *                        in buffer PublishedFrame::buffer at offset.
+ *   reader -> publisher  FrameAck once done reading a frame, until then the
+ *                        buffer stays out of the camera's hands.
+ */
+struct PublisherHello {
+    char magic[8];          // "IMX477FP"
+    uint32_t version;       // 1
+    uint32_t buffers;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t fourcc;
+    uint32_t frameSize;
+};
+
+struct PublishedFrame {
+    uint32_t buffer;
+    uint32_t sequence;
+    uint64_t timestamp;     // Sensor timestamp, ns
+    int32_t exposure;       // us, -1 when the pipeline didn't report it
+    float gain;             // Analogue gain, 0 when not reported
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t fourcc;
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct FrameAck {
+    uint32_t buffer;
+    uint32_t sequence;
+};
+
+/*
+ * Lends camera buffers to other processes without copying them.
+ *
+ * Readers attach to a Unix socket, get the dmabufs once and then a small
+ * message per frame. A buffer handed out is referenced until every reader
+ * it went to acks it, or is dropped, and only then released goes back to the
+ * owner. Publishing never waits on a reader: one with kMaxOutstanding frames
+ * unacked, or a full socket, simply misses frames, and one sitting on a
+ * frame longer than holdTimeout is disconnected so its buffers come back.
+ */
+class FramePublisher {
+    public:
+        struct Format {
+            unsigned int width;
+            unsigned int height;
+            unsigned int stride;
+            uint32_t fourcc;
+            size_t frameSize;
+        };
+
+        // Called once a buffer publish() returned true for is no longer read by anyone
+        std::function<void(unsigned int buffer)> released;
+
+        std::chrono::milliseconds holdTimeout{1000};
+
+        ~FramePublisher() {
+            close();
+        }
+
+        int open(const std::string &socketPath, const Format &fmt, const std::vector<int> &dmabufs) {
+            if (dmabufs.size() > kMaxBuffers) {
+                std::cerr << "Too many buffers to publish, at most " << kMaxBuffers << std::endl;
+                return -EINVAL;
+            }
+
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            if (socketPath.size() >= sizeof(addr.sun_path)) {
+                std::cerr << "Publisher socket path too long: " << socketPath << std::endl;
+                return -ENAMETOOLONG;
+            }
+            memcpy(addr.sun_path, socketPath.c_str(), socketPath.size());
+
+            listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listenFd < 0)
+                return fail("Failed to create publisher socket");
+            // A stale socket of an earlier run would make bind() fail
+            unlink(socketPath.c_str());
+            if (bind(listenFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0)
+                return fail("Failed to bind publisher socket");
+            if (listen(listenFd, 4) < 0)
+                return fail("Failed to listen on publisher socket");
+
+            path = socketPath;
+            format = fmt;
+            fds = dmabufs;
+            references.assign(fds.size(), 0);
+            sent = 0;
+            skipped = 0;
+            dropped = 0;
+            abort = false;
+            pollThread = std::thread(&FramePublisher::pollLoop, this);
+            return 0;
+        }
+
+        /*
+         * Offer a frame to every reader. Returns true when at least one took
+         * it, the buffer must then stay untouched until released reports it.
+         */
+        bool publish(const PublishedFrame &frame) {
+            std::vector<unsigned int> freed;
+            bool held;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                auto now = std::chrono::steady_clock::now();
+                for (std::unique_ptr<Reader> &reader : readers) {
+                    if (reader->dead)
+                        continue;
+                    if (reader->outstanding.size() >= kMaxOutstanding) {
+                        skipped++;
+                        continue;
+                    }
+
+                    ssize_t ret = send(reader->fd, &frame, sizeof(frame), MSG_DONTWAIT | MSG_NOSIGNAL);
+                    if (ret == static_cast<ssize_t>(sizeof(frame))) {
+                        reader->outstanding.push_back({ frame.buffer, frame.sequence, now });
+                        references[frame.buffer]++;
+                        sent++;
+                    } else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                        skipped++;
+                    } else {
+                        drop(*reader, freed);
+                    }
+                }
+                held = references[frame.buffer] > 0;
+            }
+            notifyReleased(freed);
+            return held;
+        }
+
+        /* Disconnect every reader and hand their buffers back */
+        void close() {
+            if (listenFd < 0)
+                return;
+
+            abort = true;
+            pollThread.join();
+
+            std::vector<unsigned int> freed;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                for (std::unique_ptr<Reader> &reader : readers) {
+                    drop(*reader, freed);
+                    ::close(reader->fd);
+                }
+                readers.clear();
+            }
+            notifyReleased(freed);
+
+            ::close(listenFd);
+            listenFd = -1;
+            unlink(path.c_str());
+        }
+
+        /* Counters, safe to read from any thread */
+        uint64_t framesSent() const { return sent; }
+        uint64_t framesSkipped() const { return skipped; }
+        uint64_t readersDropped() const { return dropped; }
+
+    private:
+        static constexpr size_t kMaxBuffers = 16;
+        static constexpr size_t kMaxOutstanding = 2;
+
+        struct Outstanding {
+            unsigned int buffer;
+            uint32_t sequence;
+            std::chrono::steady_clock::time_point since;
+        };
+
+        struct Reader {
+            int fd;
+            bool dead = false;
+            std::vector<Outstanding> outstanding;
+        };
+
+        std::string path;
+        int listenFd = -1;
+        Format format = {};
+        std::vector<int> fds;
+
+        std::mutex mtx;
+        std::vector<std::unique_ptr<Reader>> readers;
+        std::vector<unsigned int> references;
+        std::thread pollThread;
+        std::atomic<bool> abort{false};
+
+        std::atomic<uint64_t> sent{0};
+        std::atomic<uint64_t> skipped{0};
+        std::atomic<uint64_t> dropped{0};
+
+        int fail(const char *message) {
+            int ret = -errno;
+            std::cerr << message << ": " << strerror(errno) << std::endl;
+            if (listenFd >= 0)
+                ::close(listenFd);
+            listenFd = -1;
+            return ret;
+        }
+
+        /* Forget a reader's frames, the fd is closed later by the poll thread. Called with mtx held */
+        void drop(Reader &reader, std::vector<unsigned int> &freed) {
+            if (reader.dead)
+                return;
+            reader.dead = true;
+            dropped++;
+            for (const Outstanding &frame : reader.outstanding)
+                unreference(frame.buffer, freed);
+            reader.outstanding.clear();
+        }
+
+        void unreference(unsigned int buffer, std::vector<unsigned int> &freed) {
+            if (--references[buffer] == 0)
+                freed.push_back(buffer);
+        }
+
+        void notifyReleased(const std::vector<unsigned int> &freed) {
+            if (!released)
+                return;
+            for (unsigned int buffer : freed)
+                released(buffer);
+        }
+
+        void accept() {
+            int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+                return;
+
+            PublisherHello hello = {};
+            memcpy(hello.magic, "IMX477FP", sizeof(hello.magic));
+            hello.version = 1;
+            hello.buffers = fds.size();
+            hello.width = format.width;
+            hello.height = format.height;
+            hello.stride = format.stride;
+            hello.fourcc = format.fourcc;
+            hello.frameSize = format.frameSize;
+
+            iovec iov = { &hello, sizeof(hello) };
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * kMaxBuffers)] = {};
+            msghdr msg = {};
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+            memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+            if (sendmsg(fd, &msg, MSG_NOSIGNAL) != static_cast<ssize_t>(sizeof(hello))) {
+                std::cerr << "Failed to send buffers to a reader: " << strerror(errno) << std::endl;
+                ::close(fd);
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mtx);
+            readers.push_back(std::make_unique<Reader>());
+            readers.back()->fd = fd;
+        }
+
+        /* Acks waiting on a reader's socket, false once the reader is gone */
+        bool readAcks(Reader &reader, std::vector<unsigned int> &freed) {
+            while (true) {
+                FrameAck ack;
+                ssize_t ret = recv(reader.fd, &ack, sizeof(ack), MSG_DONTWAIT);
+                if (ret < 0)
+                    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+                if (ret != static_cast<ssize_t>(sizeof(ack)))
+                    return false;
+
+                for (auto it = reader.outstanding.begin(); it != reader.outstanding.end(); ++it) {
+                    if (it->buffer == ack.buffer && it->sequence == ack.sequence) {
+                        reader.outstanding.erase(it);
+                        unreference(ack.buffer, freed);
+                        break;
+                    }
+                }
+            }
+        }
+
+        void pollLoop() {
+            StageThread stage("publisher");
+            std::vector<pollfd> polled;
+
+            while (!abort) {
+                polled.assign(1, { listenFd, POLLIN, 0 });
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    // Dropped readers are only closed here, never while their fd is being polled
+                    for (auto it = readers.begin(); it != readers.end();) {
+                        if ((*it)->dead) {
+                            ::close((*it)->fd);
+                            it = readers.erase(it);
+                        } else {
+                            polled.push_back({ (*it)->fd, POLLIN, 0 });
+                            ++it;
+                        }
+                    }
+                }
+
+                int ret = poll(polled.data(), polled.size(), 100);
+                if (ret < 0 && errno != EINTR) {
+                    std::cerr << "Publisher poll failed: " << strerror(errno) << std::endl;
+                    break;
+                }
+
+                if (ret > 0 && (polled[0].revents & POLLIN))
+                    accept();
+
+                std::vector<unsigned int> freed;
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    auto now = std::chrono::steady_clock::now();
+                    for (std::unique_ptr<Reader> &reader : readers) {
+                        if (reader->dead)
+                            continue;
+
+                        bool ok = true;
+                        for (size_t i = 1; i < polled.size(); i++) {
+                            if (polled[i].fd == reader->fd && polled[i].revents)
+                                ok = !(polled[i].revents & (POLLERR | POLLNVAL)) && readAcks(*reader, freed);
+                        }
+
+                        // A reader holding on to a frame starves the buffer pool, let it go
+                        if (ok && !reader->outstanding.empty() &&
+                            now - reader->outstanding.front().since > holdTimeout) {
+                            std::cerr << "Dropping a frame reader that stopped acking" << std::endl;
+                            ok = false;
+                        }
+                        if (!ok)
+                            drop(*reader, freed);
+                    }
+                }
+                notifyReleased(freed);
+            }
+        }
+};
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Bounded single-producer/single-consumer ring.
+ *
+ * push() must only be called from one thread and pop() from another one.
+ * Neither of them blocks nor allocates, a full ring makes push() fail and the
+ * item is accounted as dropped so the producer can hand it back somewhere else.
+ */
+template<typename T>
+class SpscRing {
+    public:
+        explicit SpscRing(size_t capacity)
+            : slots(capacity + 1), head(0), tail(0),
+              pushed(0), dropped(0), occupancySum(0), maxOccupancy(0) {}
+
+        bool push(const T &item) {
+            size_t t = tail.load(std::memory_order_relaxed);
+            size_t next = advance(t);
+            size_t h = head.load(std::memory_order_acquire);
+            if (next == h) {
+                dropped.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+
+            slots[t] = item;
+            tail.store(next, std::memory_order_release);
+
+            // Occupancy seen by the producer right after this push
+            size_t used = (next + slots.size() - h) % slots.size();
+            pushed.fetch_add(1, std::memory_order_relaxed);
+            occupancySum.fetch_add(used, std::memory_order_relaxed);
+            if (used > maxOccupancy.load(std::memory_order_relaxed))
+                maxOccupancy.store(used, std::memory_order_relaxed);
+            return true;
+        }
+
+        bool pop(T &item) {
+            size_t h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire))
+                return false;
+
+            item = slots[h];
+            head.store(advance(h), std::memory_order_release);
+            return true;
+        }
+
+        bool empty() const {
+            return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+        }
+
+        size_t size() const {
+            size_t h = head.load(std::memory_order_acquire);
+            size_t t = tail.load(std::memory_order_acquire);
+            return (t + slots.size() - h) % slots.size();
+        }
+
+        size_t capacity() const { return slots.size() - 1; }
+
+        /* Counters, safe to read from any thread */
+        uint64_t pushes() const { return pushed.load(std::memory_order_relaxed); }
+        uint64_t drops() const { return dropped.load(std::memory_order_relaxed); }
+        size_t highWatermark() const { return maxOccupancy.load(std::memory_order_relaxed); }
+        double averageOccupancy() const {
+            uint64_t n = pushes();
+            return n ? static_cast<double>(occupancySum.load(std::memory_order_relaxed)) / n : 0.0;
+        }
+
+    private:
+        std::vector<T> slots;
+
+        // Keep the indices written by each side on their own cache line
+        alignas(64) std::atomic<size_t> head;
+        alignas(64) std::atomic<size_t> tail;
+
+        alignas(64) std::atomic<uint64_t> pushed;
+        std::atomic<uint64_t> dropped;
+        std::atomic<uint64_t> occupancySum;
+        std::atomic<size_t> maxOccupancy;
+
+        size_t advance(size_t index) const { return (index + 1) % slots.size(); }
+};
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <syslog.h>
+#include <time.h>
+
+/*
+ * Lock-free latency histogram.
+ *
+ * Values are nanoseconds, bucketed log-linearly with eight buckets per power
+ * of two, so percentiles are accurate to about 12%. record() is a handful of
+ * relaxed atomic operations and can be called from any thread.
+ */
+class LatencyHistogram {
+    public:
+        void record(uint64_t value) {
+            buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+            samples.fetch_add(1, std::memory_order_relaxed);
+            uint64_t current = maximum.load(std::memory_order_relaxed);
+            while (value > current && !maximum.compare_exchange_weak(current, value, std::memory_order_relaxed))
+                ;
+        }
+
+        uint64_t count() const { return samples.load(std::memory_order_relaxed); }
+        uint64_t max() const { return maximum.load(std::memory_order_relaxed); }
+
+        /* Upper bound of the bucket holding the given fraction (0-1) of the samples */
+        uint64_t percentile(double fraction) const {
+            uint64_t n = count();
+            if (!n)
+                return 0;
+            uint64_t rank = static_cast<uint64_t>(fraction * (n - 1)) + 1;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kBuckets; i++) {
+                seen += buckets[i].load(std::memory_order_relaxed);
+                if (seen >= rank)
+                    return std::min(upperBound(i), max());
+            }
+            return max();
+        }
+
+        /* Not atomic as a whole, only meant for use between runs */
+        void reset() {
+            for (std::atomic<uint64_t> &bucket : buckets)
+                bucket.store(0, std::memory_order_relaxed);
+            samples.store(0, std::memory_order_relaxed);
+            maximum.store(0, std::memory_order_relaxed);
+        }
+
+    private:
+        static constexpr int kSubBits = 3;
+        static constexpr size_t kBuckets = (64 - kSubBits + 1) << kSubBits;
+
+        static size_t bucketOf(uint64_t value) {
+            if (value < (1u << kSubBits))
+                return value;
+            int msb = 63 - __builtin_clzll(value);
+            int shift = msb - kSubBits;
+            return ((shift + 1) << kSubBits) + ((value >> shift) & ((1u << kSubBits) - 1));
+        }
+
+        static uint64_t upperBound(size_t bucket) {
+            if (bucket < (1u << kSubBits))
+                return bucket;
+            int shift = (bucket >> kSubBits) - 1;
+            uint64_t low = ((1ull << kSubBits) + (bucket & ((1u << kSubBits) - 1))) << shift;
+            return low + (1ull << shift) - 1;
+        }
+
+        std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+        std::atomic<uint64_t> samples{0};
+        std::atomic<uint64_t> maximum{0};
+};
+
+/*
+ * Per-frame timeline of the capture pipeline.
+ *
+ * A frame starts at its sensor timestamp and every later stamp records the
+ * time since the previous one in the histogram of that stage, stages a frame
+ * skips (no conversion for YUV input, no mapping for the hardware encoder)
+ * simply fold into the next one. Frames are keyed by their sequence number up
+ * to the encoder, and by their pts from then on since that's all the encoder
+ * hands back. Pts values aren't dense, they are looked up among the most
+ * recently submitted frames. Frames that were never begun, such as those of
+ * a warm-up, are left out of every stage. Timestamps are CLOCK_MONOTONIC,
+ * the clock of the V4L2 buffers.
+ */
+class FrameStats {
+    public:
+        enum Stage {
+            Sensor,
+            Completed,
+            Mapped,
+            Converted,
+            Submitted,
+            Written,
+            NumStages,
+        };
+
+        static int64_t now() {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+        }
+
+        void begin(uint64_t sequence, int64_t sensorTimestamp) {
+            Timeline &timeline = captured[sequence % kSlots];
+            timeline.sequence.store(sequence, std::memory_order_relaxed);
+            timeline.start.store(sensorTimestamp, std::memory_order_relaxed);
+            timeline.last.store(sensorTimestamp, std::memory_order_relaxed);
+
+            int64_t previous = lastSensor.exchange(sensorTimestamp, std::memory_order_relaxed);
+            if (previous && sensorTimestamp > previous)
+                frameInterval.record(sensorTimestamp - previous);
+        }
+
+        /* Frames that weren't begun, those of the warm-up, stay out of every stage */
+        void stamp(uint64_t sequence, Stage stage) {
+            Timeline &timeline = captured[sequence % kSlots];
+            if (begun(timeline, sequence))
+                advance(timeline, stage, now());
+        }
+
+        /* The frame went to the encoder, from now on it's known by its pts */
+        void submitted(uint64_t sequence, int64_t pts) {
+            Timeline &from = captured[sequence % kSlots];
+            if (!begun(from, sequence))
+                return;
+            size_t slot = nextEncoding.fetch_add(1, std::memory_order_relaxed) % kSlots;
+            Timeline &to = encoding[slot];
+            advance(from, Submitted, now());
+            to.start.store(from.start.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            to.last.store(from.last.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            encodingPts[slot].store(pts, std::memory_order_release);
+        }
+
+        void written(int64_t pts) {
+            // Packets come out in submission order or close to it, search from the newest frame back
+            size_t newest = nextEncoding.load(std::memory_order_relaxed);
+            for (size_t i = 1; i <= kSearch && i <= newest; i++) {
+                size_t slot = (newest - i) % kSlots;
+                if (encodingPts[slot].load(std::memory_order_acquire) == pts) {
+                    advance(encoding[slot], Written, now());
+                    return;
+                }
+            }
+        }
+
+        /* Not safe against concurrent stamps, call it while the pipeline is idle */
+        void reset() {
+            for (LatencyHistogram &histogram : stages)
+                histogram.reset();
+            total.reset();
+            frameInterval.reset();
+            lastSensor.store(0, std::memory_order_relaxed);
+
+            // Frames that were never begun must not pick up a stale timeline
+            for (size_t i = 0; i < kSlots; i++) {
+                clear(captured[i]);
+                clear(encoding[i]);
+                encodingPts[i].store(-1, std::memory_order_relaxed);
+            }
+            nextEncoding.store(0, std::memory_order_relaxed);
+        }
+
+        const LatencyHistogram &endToEnd() const { return total; }
+
+        std::string summary() const {
+            static const char *const names[NumStages] = {
+                "sensor", "completed", "mapped", "converted", "submitted", "written",
+            };
+
+            std::ostringstream out;
+            out.setf(std::ios::fixed);
+            out.precision(2);
+            for (int stage = Completed; stage < NumStages; stage++) {
+                if (stages[stage].count())
+                    line(out, names[stage], stages[stage]);
+            }
+            if (total.count())
+                line(out, "sensor to written", total);
+            if (frameInterval.count()) {
+                line(out, "frame interval", frameInterval);
+                out << "throughput " << 1e9 / frameInterval.percentile(0.5) << " fps (median interval)\n";
+            }
+            return out.str();
+        }
+
+        /* One syslog line per stage, cheap enough to call every few seconds */
+        void log() const {
+            std::string text = summary();
+            std::istringstream lines(text);
+            std::string entry;
+            while (std::getline(lines, entry))
+                syslog(LOG_INFO, "frame stats: %s", entry.c_str());
+        }
+
+    private:
+        static constexpr size_t kSlots = 256;
+        static constexpr size_t kSearch = 64;
+
+        struct Timeline {
+            std::atomic<uint64_t> sequence{0};
+            std::atomic<int64_t> start{0};
+            std::atomic<int64_t> last{0};
+        };
+
+        /* Whether the slot holds the timeline of this frame, not of none or of one kSlots before */
+        static bool begun(const Timeline &timeline, uint64_t sequence) {
+            return timeline.start.load(std::memory_order_relaxed) &&
+                   timeline.sequence.load(std::memory_order_relaxed) == sequence;
+        }
+
+        static void clear(Timeline &timeline) {
+            timeline.start.store(0, std::memory_order_relaxed);
+            timeline.last.store(0, std::memory_order_relaxed);
+        }
+
+        void advance(Timeline &timeline, Stage stage, int64_t time) {
+            int64_t last = timeline.last.exchange(time, std::memory_order_relaxed);
+            if (last && time >= last)
+                stages[stage].record(time - last);
+            if (stage == Written) {
+                int64_t start = timeline.start.load(std::memory_order_relaxed);
+                if (start && time >= start)
+                    total.record(time - start);
+            }
+        }
+
+        static void line(std::ostringstream &out, const char *name, const LatencyHistogram &histogram) {
+            out << name << ": p50 " << histogram.percentile(0.5) / 1e6
+                << " ms, p99 " << histogram.percentile(0.99) / 1e6
+                << " ms, max " << histogram.max() / 1e6
+                << " ms (" << histogram.count() << " frames)\n";
+        }
+
+        std::array<Timeline, kSlots> captured;
+        std::array<Timeline, kSlots> encoding;
+        std::array<std::atomic<int64_t>, kSlots> encodingPts{};
+        std::atomic<size_t> nextEncoding{0};
+        std::array<LatencyHistogram, NumStages> stages;
+        LatencyHistogram total;
+        LatencyHistogram frameInterval;
+        std::atomic<int64_t> lastSensor{0};
+};
+
+/*
+ * Frames the sensor produced but never reached us, from the gaps in the
+ * FrameMetadata::sequence numbers, and how regularly the others arrived
+ * compared to the configured frame rate. Fed from the request completion
+ * handler only, the counters may be read from any thread.
+ */
+class FrameDropTracker {
+    public:
+        void start(int fps) {
+            nominalInterval = 1'000'000'000 / fps;
+            lastSequence = 0;
+            lastTimestamp = 0;
+            received.store(0, std::memory_order_relaxed);
+            dropped.store(0, std::memory_order_relaxed);
+            gapCount.store(0, std::memory_order_relaxed);
+            jitter.reset();
+        }
+
+        void frame(uint32_t sequence, int64_t timestamp) {
+            if (received.fetch_add(1, std::memory_order_relaxed)) {
+                // Unsigned difference, the sequence number may wrap
+                uint32_t step = sequence - lastSequence;
+                if (step > 1) {
+                    dropped.fetch_add(step - 1, std::memory_order_relaxed);
+                    gapCount.fetch_add(1, std::memory_order_relaxed);
+                }
+
+                // Deviation from where the frame should have landed, dropped frames included
+                int64_t expected = nominalInterval * (step ? step : 1);
+                int64_t deviation = timestamp - lastTimestamp - expected;
+                jitter.record(deviation < 0 ? -deviation : deviation);
+            }
+            lastSequence = sequence;
+            lastTimestamp = timestamp;
+        }
+
+        uint64_t frames() const { return received.load(std::memory_order_relaxed); }
+        uint64_t drops() const { return dropped.load(std::memory_order_relaxed); }
+        uint64_t gaps() const { return gapCount.load(std::memory_order_relaxed); }
+        double dropRate() const {
+            uint64_t total = frames() + drops();
+            return total ? static_cast<double>(drops()) / total : 0.0;
+        }
+        const LatencyHistogram &timestampJitter() const { return jitter; }
+
+    private:
+        int64_t nominalInterval = 0;
+        uint32_t lastSequence = 0;
+        int64_t lastTimestamp = 0;
+        std::atomic<uint64_t> received{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> gapCount{0};
+        LatencyHistogram jitter;
+};
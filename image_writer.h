@@ -0,0 +1,281 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "bayer_unpack.h"
+#include "frame_stats.h"
+
+/*
+ * Header of the raw Bayer files, followed by height rows of rowBytes bytes,
+ * all fields little endian. packed is 1 for CSI-2 packed rows exactly as the
+ * sensor sent them, 0 for one uint16_t per pixel.
+ */
+struct RawFileHeader {
+    char magic[8];          // "IMX477RW"
+    uint32_t version;       // 1
+    uint32_t width;
+    uint32_t height;
+    uint32_t bitDepth;      // 10 or 12
+    uint32_t packed;
+    uint32_t rowBytes;
+    char bayerOrder[4];     // "RGGB", "GRBG", "GBRG" or "BGGR"
+    uint32_t sequence;
+    uint32_t reserved;      // 0, puts timestamp at offset 48
+    uint64_t timestamp;     // Sensor timestamp, ns
+};
+
+static_assert(sizeof(RawFileHeader) == 56, "raw file headers must keep their on-disk size");
+
+/*
+ * Compresses and saves pictures on a pool of worker threads, off the capture
+ * loop.
+ *
+ * Pictures live in a fixed pool of images: acquire() hands out a free one
+ * (blocking while all of them are queued or being written), the caller fills
+ * it and gives it away with submit(). Once written the image goes back to the
+ * pool, its pixel buffer is kept so the steady state allocates nothing.
+ *
+ * An image may also point at memory it doesn't own, a mapped camera buffer,
+ * which must then stay untouched until the written callback reports it done.
+ */
+class ImageWriter {
+    public:
+        enum class Format { PNG, JPEG, Raw };
+
+        struct Options {
+            Format format = Format::PNG;
+            // zlib level, 1 is several times faster than the OpenCV default of 3
+            int pngLevel = 1;
+            int jpegQuality = 90;
+            unsigned int threads = 2;
+            unsigned int images = 4;
+        };
+
+        /* XRGB8888 picture, or Bayer data when bitDepth is set, rows stride bytes apart */
+        struct Image {
+            // Picture to write, either pixels.data() or external memory
+            const uint8_t *data = nullptr;
+            std::vector<uint8_t> pixels;
+            int width = 0;
+            int height = 0;
+            size_t stride = 0;
+            std::string fileName;
+            // Caller's tags, handed back to the written callback
+            unsigned int sequence = 0;
+            void *cookie = nullptr;
+
+            // CSI-2 packed Bayer rows, always written as a RawFileHeader file
+            unsigned int bitDepth = 0;
+            std::string bayerOrder;
+            bool unpack = false;
+            uint64_t timestamp = 0;
+        };
+
+        // Called on a worker thread once an image is on disk, or failed to get there
+        std::function<void(const Image &image, bool ok)> written;
+
+        explicit ImageWriter(const Options &opts)
+            : options(opts), stopping(false), imagesWritten(0), imagesFailed(0) {
+            for (unsigned int i = 0; i < options.images; i++) {
+                pool.push_back(std::make_unique<Image>());
+                freeImages.push_back(pool.back().get());
+            }
+            for (unsigned int i = 0; i < options.threads; i++)
+                workers.emplace_back(&ImageWriter::workerLoop, this);
+        }
+
+        ~ImageWriter() {
+            flush();
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            pendingChanged.notify_all();
+            for (std::thread &worker : workers)
+                worker.join();
+        }
+
+        static const char *extension(Format format) {
+            switch (format) {
+                case Format::JPEG:
+                    return ".jpg";
+                case Format::Raw:
+                    return ".raw";
+                default:
+                    return ".png";
+            }
+        }
+
+        Image *acquire() {
+            std::unique_lock<std::mutex> lock(mtx);
+            freeChanged.wait(lock, [this]() { return !freeImages.empty(); });
+            Image *image = freeImages.back();
+            freeImages.pop_back();
+            return image;
+        }
+
+        void submit(Image *image) {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                pending.push_back(image);
+            }
+            pendingChanged.notify_one();
+        }
+
+        /* Wait until every submitted image has been written */
+        void flush() {
+            std::unique_lock<std::mutex> lock(mtx);
+            freeChanged.wait(lock, [this]() { return freeImages.size() == pool.size(); });
+        }
+
+        uint64_t writtenCount() const { return imagesWritten; }
+        uint64_t failedCount() const { return imagesFailed; }
+        /* Time spent compressing and writing each image */
+        const LatencyHistogram &writeTime() const { return writeTimes; }
+
+    private:
+        Options options;
+        std::vector<std::unique_ptr<Image>> pool;
+        std::vector<Image *> freeImages;
+        std::deque<Image *> pending;
+        std::vector<std::thread> workers;
+        bool stopping;
+
+        std::mutex mtx;
+        std::condition_variable pendingChanged;
+        std::condition_variable freeChanged;
+
+        std::atomic<uint64_t> imagesWritten;
+        std::atomic<uint64_t> imagesFailed;
+        LatencyHistogram writeTimes;
+
+        void workerLoop() {
+            while (true) {
+                Image *image;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    pendingChanged.wait(lock, [this]() { return stopping || !pending.empty(); });
+                    if (pending.empty())
+                        return;
+                    image = pending.front();
+                    pending.pop_front();
+                }
+
+                int64_t start = FrameStats::now();
+                bool ok = write(*image);
+                writeTimes.record(FrameStats::now() - start);
+                (ok ? imagesWritten : imagesFailed)++;
+                if (written)
+                    written(*image, ok);
+
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    freeImages.push_back(image);
+                }
+                freeChanged.notify_all();
+            }
+        }
+
+        bool write(const Image &image) {
+            if (image.bitDepth)
+                return writeBayer(image);
+            if (options.format == Format::Raw)
+                return writeRaw(image);
+
+            std::vector<int> params;
+            if (options.format == Format::JPEG)
+                params = { cv::IMWRITE_JPEG_QUALITY, options.jpegQuality };
+            else
+                params = { cv::IMWRITE_PNG_COMPRESSION, options.pngLevel };
+
+            try {
+                cv::Mat img(image.height, image.width, CV_8UC4,
+                            const_cast<uint8_t *>(image.data), image.stride);
+                if (!cv::imwrite(image.fileName, img, params)) {
+                    std::cerr << "Failed to write image file " << image.fileName << std::endl;
+                    return false;
+                }
+            } catch (const cv::Exception &e) {
+                std::cerr << "OpenCV exception: " << e.what() << std::endl;
+                return false;
+            }
+            return true;
+        }
+
+        /* The XRGB8888 pixels as they are, rows packed */
+        static bool writeRaw(const Image &image) {
+            FILE *file = fopen(image.fileName.c_str(), "wb");
+            if (!file) {
+                std::cerr << "Failed to open " << image.fileName << std::endl;
+                return false;
+            }
+
+            size_t rowSize = static_cast<size_t>(image.width) * 4;
+            bool ok = true;
+            for (int y = 0; y < image.height && ok; y++)
+                ok = fwrite(image.data + y * image.stride, 1, rowSize, file) == rowSize;
+            if (fclose(file) != 0)
+                ok = false;
+            if (!ok)
+                std::cerr << "Failed to write " << image.fileName << std::endl;
+            return ok;
+        }
+
+        static bool writeBayer(const Image &image) {
+            size_t packedBytes = static_cast<size_t>(image.width) * image.bitDepth / 8;
+
+            RawFileHeader header = {};
+            memcpy(header.magic, "IMX477RW", sizeof(header.magic));
+            header.version = 1;
+            header.width = image.width;
+            header.height = image.height;
+            header.bitDepth = image.bitDepth;
+            header.packed = !image.unpack;
+            header.rowBytes = image.unpack ? image.width * sizeof(uint16_t) : packedBytes;
+            memcpy(header.bayerOrder, image.bayerOrder.c_str(), std::min<size_t>(image.bayerOrder.size(), 4));
+            header.sequence = image.sequence;
+            header.timestamp = image.timestamp;
+
+            FILE *file = fopen(image.fileName.c_str(), "wb");
+            if (!file) {
+                std::cerr << "Failed to open " << image.fileName << std::endl;
+                return false;
+            }
+
+            // One row of each writer thread, sized on first use
+            thread_local std::vector<uint16_t> unpacked;
+            if (image.unpack)
+                unpacked.resize(image.width);
+
+            bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+            for (int y = 0; y < image.height && ok; y++) {
+                const uint8_t *row = image.data + y * image.stride;
+                if (image.unpack) {
+                    unpackRaw(image.bitDepth, row, unpacked.data(), image.width);
+                    ok = fwrite(unpacked.data(), sizeof(uint16_t), image.width, file) == static_cast<size_t>(image.width);
+                } else {
+                    ok = fwrite(row, 1, packedBytes, file) == packedBytes;
+                }
+            }
+            if (fclose(file) != 0)
+                ok = false;
+            if (!ok)
+                std::cerr << "Failed to write " << image.fileName << std::endl;
+            return ok;
+        }
+};
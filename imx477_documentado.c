@@ -10,11 +10,14 @@
 #include <linux/clk.h> // Biblioteca para el acceso y control del Common Clock Framework.
 #include <linux/delay.h> // Biblioteca para el uso de funciones de espera y retardos.
 #include <linux/gpio/consumer.h> // Biblioteca para la gestión de la entrada/salida general-purpose (GPIO).
+#include <linux/bitmap.h> // Biblioteca para el manejo de mapas de bits.
 #include <linux/i2c.h> // Biblioteca para la interfaz y el uso del bus I2C para la comunicación serial.
+#include <linux/ktime.h> // Biblioteca para la medida de tiempos con el reloj monotónico del kernel.
 #include <linux/module.h> // Biblioteca para la creación y gestión de módulos del kernel (código cargable para extender funcionalidad).
 #include <linux/of_device.h> // Biblioteca para manejar descriptores de dispositivos basados en Device Tree.
 #include <linux/pm_runtime.h> // Biblioteca para la gestión de energía en dispositivos de entrada/salida (I/O).
 #include <linux/regulator/consumer.h> // Biblioteca para el manejo de reguladores de energía en SoCs.
+#include <linux/vmalloc.h> // Biblioteca para reservar memoria virtualmente contigua.
 
 // V4L2 : API para la captura de video para Linux
 #include <media/v4l2-ctrls.h> // Biblioteca para el manejo de controles V4L2.
@@ -38,6 +41,25 @@ MODULE_PARM_DESC(trigger_mode, "Set vsync trigger mode: 1=source, 2=sink"); // E
 // 1 = source: La sincronización vertical (vsync) es generada por la cámara.
 // 2 = sink: La sincronización vertical (vsync) es generada por el software.
 
+static int burst_write = 1; // Agrupación de las tablas de registros en escrituras en ráfaga.
+module_param(burst_write, int, 0644); // Define el parámetro del módulo y establece sus permisos.
+MODULE_PARM_DESC(burst_write, "Write register tables as I2C auto-increment bursts"); // Establece la descripción
+// 0 = un mensaje I2C de 3 bytes por registro, como referencia para medir el arranque.
+
+static int reg_cache = 1; // Omisión de las escrituras que no cambian el valor del registro.
+module_param(reg_cache, int, 0644); // Define el parámetro del módulo y establece sus permisos.
+MODULE_PARM_DESC(reg_cache, "Skip register writes matching the driver's shadow copy"); // Establece la descripción
+
+static int group_hold = 1; // Aplicación de exposición, ganancia y VBLANK en el mismo frame.
+module_param(group_hold, int, 0644); // Define el parámetro del módulo y establece sus permisos.
+MODULE_PARM_DESC(group_hold, "Apply exposure, gain and frame length changes under grouped parameter hold"); // Establece la descripción
+
+static int standby_delay_ms; // Tiempo que el sensor sigue alimentado en standby tras parar el streaming.
+module_param(standby_delay_ms, int, 0444); // Define el parámetro del módulo y establece sus permisos.
+MODULE_PARM_DESC(standby_delay_ms, "Keep the sensor powered in standby this long after streaming stops, -1 forever"); // Establece la descripción
+// 0 = se apaga en cuanto se para el streaming. Se aplica al probar el dispositivo, después
+// se cambia en /sys/bus/i2c/devices/<dispositivo>/power/autosuspend_delay_ms.
+
 /* Tamaños de los registros en bytes */
 #define IMX477_REG_VALUE_08BIT   1 // Longitud en bytes de un registro de 8 bits
 #define IMX477_REG_VALUE_16BIT   2 // Longitud en bytes de un registro de 16 bits
@@ -52,6 +74,9 @@ MODULE_PARM_DESC(trigger_mode, "Set vsync trigger mode: 1=source, 2=sink"); // E
 #define IMX477_MODE_STANDBY      0x00    // Modo Standby
 #define IMX477_MODE_STREAMING    0x01    // Modo Streaming
 
+/* Retención de parámetros agrupados: lo escrito mientras está activa se aplica junto en el siguiente frame */
+#define IMX477_REG_GROUP_HOLD    0x0104
+
 #define IMX477_REG_ORIENTATION   0x0101  // Dirección del registro que guarda la orientación del sensor
 
 #define IMX477_XCLK_FREQ         24000000  // Frecuencia del reloj externo al sensor (24 MHz)
@@ -143,6 +168,16 @@ enum pad_types {
 #define IMX477_PIXEL_ARRAY_WIDTH    4056U   // Anchura del array de píxeles
 #define IMX477_PIXEL_ARRAY_HEIGHT   3040U   // Altura del array de píxeles
 
+/* Escrituras en ráfaga de las tablas de registros */
+#define IMX477_BURST_LEN            64U     // Bytes de datos como máximo en un mensaje (auto-incremento)
+#define IMX477_BURST_MSGS           8U      // Mensajes enviados en una única llamada a i2c_transfer()
+
+/* Registros de un grupo escrito bajo retención de parámetros */
+#define IMX477_GROUP_MAX            6U
+
+/* Copia de los registros del sensor */
+#define IMX477_REG_SPACE            0x10000U // Direcciones de 16 bits
+
 /* Estructura de un Registro con su valor y dirección */
 struct imx477_reg { 
     u16 address;    // Dirección del registro
@@ -812,135 +847,216 @@ static const struct imx477_reg mode_2028x1080_regs[] = {
 	{0x3f57, 0x6c},
 };
 
-/* 4x4 binned. 120fps : Lista de Registros en modo 120 fps con unión de pixeles de 4x4p */
-static const struct imx477_reg mode_1332x990_regs[] = {
-	{0x420b, 0x01},
-	{0x990c, 0x00},
-	{0x990d, 0x08},
-	{0x9956, 0x8c},
-	{0x9957, 0x64},
-	{0x9958, 0x50},
-	{0x9a48, 0x06},
-	{0x9a49, 0x06},
-	{0x9a4a, 0x06},
-	{0x9a4b, 0x06},
-	{0x9a4c, 0x06},
-	{0x9a4d, 0x06},
-	{0x0112, 0x0a},
-	{0x0113, 0x0a},
-	{0x0114, 0x01},
-	{0x0342, 0x1a},
-	{0x0343, 0x08},
-	{0x0340, 0x04},
-	{0x0341, 0x1a},
-	{0x0344, 0x00},
-	{0x0345, 0x00},
-	{0x0346, 0x02},
-	{0x0347, 0x10},
-	{0x0348, 0x0f},
-	{0x0349, 0xd7},
-	{0x034a, 0x09},
-	{0x034b, 0xcf},
-	{0x00e3, 0x00},
-	{0x00e4, 0x00},
-	{0x00fc, 0x0a},
-	{0x00fd, 0x0a},
-	{0x00fe, 0x0a},
-	{0x00ff, 0x0a},
-	{0xe013, 0x00},
-	{0x0220, 0x00},
-	{0x0221, 0x11},
-	{0x0381, 0x01},
-	{0x0383, 0x01},
-	{0x0385, 0x01},
-	{0x0387, 0x01},
-	{0x0900, 0x01},
-	{0x0901, 0x22},
-	{0x0902, 0x02},
-	{0x3140, 0x02},
-	{0x3c00, 0x00},
-	{0x3c01, 0x01},
-	{0x3c02, 0x9c},
-	{0x3f0d, 0x00},
-	{0x5748, 0x00},
-	{0x5749, 0x00},
-	{0x574a, 0x00},
-	{0x574b, 0xa4},
-	{0x7b75, 0x0e},
-	{0x7b76, 0x09},
-	{0x7b77, 0x08},
-	{0x7b78, 0x06},
-	{0x7b79, 0x34},
-	{0x7b53, 0x00},
-	{0x9369, 0x73},
-	{0x936b, 0x64},
-	{0x936d, 0x5f},
-	{0x9304, 0x03},
-	{0x9305, 0x80},
-	{0x9e9a, 0x2f},
-	{0x9e9b, 0x2f},
-	{0x9e9c, 0x2f},
-	{0x9e9d, 0x00},
-	{0x9e9e, 0x00},
-	{0x9e9f, 0x00},
-	{0xa2a9, 0x27},
-	{0xa2b7, 0x03},
-	{0x0401, 0x00},
-	{0x0404, 0x00},
-	{0x0405, 0x10},
-	{0x0408, 0x01},
-	{0x0409, 0x5c},
-	{0x040a, 0x00},
-	{0x040b, 0x00},
-	{0x040c, 0x05},
-	{0x040d, 0x34},
-	{0x040e, 0x03},
-	{0x040f, 0xde},
-	{0x034c, 0x05},
-	{0x034d, 0x34},
-	{0x034e, 0x03},
-	{0x034f, 0xde},
-	{0x0301, 0x05},
-	{0x0303, 0x02},
-	{0x0305, 0x02},
-	{0x0306, 0x00},
-	{0x0307, 0xaf},
-	{0x0309, 0x0a},
-	{0x030b, 0x02},
-	{0x030d, 0x02},
-	{0x030e, 0x00},
-	{0x030f, 0x96},
-	{0x0310, 0x01},
-	{0x0820, 0x07},
-	{0x0821, 0x08},
-	{0x0822, 0x00},
-	{0x0823, 0x00},
-	{0x080a, 0x00},
-	{0x080b, 0x7f},
-	{0x080c, 0x00},
-	{0x080d, 0x4f},
-	{0x080e, 0x00},
-	{0x080f, 0x77},
-	{0x0810, 0x00},
-	{0x0811, 0x5f},
-	{0x0812, 0x00},
-	{0x0813, 0x57},
-	{0x0814, 0x00},
-	{0x0815, 0x4f},
-	{0x0816, 0x01},
-	{0x0817, 0x27},
-	{0x0818, 0x00},
-	{0x0819, 0x3f},
-	{0xe04c, 0x00},
-	{0xe04d, 0x5f},
-	{0xe04e, 0x00},
-	{0xe04f, 0x1f},
-	{0x3e20, 0x01},
-	{0x3e37, 0x00},
-	{0x3f50, 0x00},
-	{0x3f56, 0x00},
-	{0x3f57, 0xbf},
-};
+/*
+ * Modos de 10 bits con binning 2x2, generados a partir de su descripción
+ * en lugar de copiar una tabla por modo.
+ *
+ * Todos leen el ancho completo del array con binning 2x2 (2028 columnas) y
+ * recortan después en digital, como el modo 1332x990 original de Sony del
+ * que sale la tabla. Un modo se describe con:
+ *   _w, _h     tamaño de salida
+ *   _x, _y     esquina del campo de visión en el array activo, en píxeles
+ *              sin binning (el recorte cubre 2 * _w x 2 * _h)
+ *   _line      longitud de línea en píxeles
+ *   _fps       frames por segundo máximos, dan la longitud de frame inicial
+ * El recorte analógico vertical se redondea a 16 filas y el horizontal es
+ * el digital, en píxeles ya agrupados. El resto de registros son los del
+ * modo de Sony, independientes del recorte.
+ */
+#define IMX477_HI(v)	(((v) >> 8) & 0xff) // Byte alto de un registro de 16 bits
+#define IMX477_LO(v)	((v) & 0xff)        // Byte bajo de un registro de 16 bits
+
+/* Longitud de frame de _fps frames por segundo */
+#define IMX477_BIN2_FRAME_LENGTH(_line, _fps)	(IMX477_PIXEL_RATE / ((_line) * (_fps)))
+/* Última fila del recorte analógico */
+#define IMX477_BIN2_Y_END(_y, _h)	((_y) + (((2 * (_h)) + 15) & ~15) - 1)
+/* 0x3f56 sigue a la longitud de línea, 1/35 redondeado hacia arriba en todos los modos de Sony */
+#define IMX477_BIN2_3F56(_line)		(((_line) + 34) / 35)
+
+#define __IMX477_BIN2_10BIT_REGS(_w, _h, _x, _y, _line, _fps) { \
+	{0x420b, 0x01}, \
+	{0x990c, 0x00}, \
+	{0x990d, 0x08}, \
+	{0x9956, 0x8c}, \
+	{0x9957, 0x64}, \
+	{0x9958, 0x50}, \
+	{0x9a48, 0x06}, \
+	{0x9a49, 0x06}, \
+	{0x9a4a, 0x06}, \
+	{0x9a4b, 0x06}, \
+	{0x9a4c, 0x06}, \
+	{0x9a4d, 0x06}, \
+	{0x0112, 0x0a}, \
+	{0x0113, 0x0a}, \
+	{0x0114, 0x01}, \
+	{0x0342, IMX477_HI(_line)}, \
+	{0x0343, IMX477_LO(_line)}, \
+	{0x0340, IMX477_HI(IMX477_BIN2_FRAME_LENGTH(_line, _fps))}, \
+	{0x0341, IMX477_LO(IMX477_BIN2_FRAME_LENGTH(_line, _fps))}, \
+	{0x0344, 0x00}, \
+	{0x0345, 0x00}, \
+	{0x0346, IMX477_HI(_y)}, \
+	{0x0347, IMX477_LO(_y)}, \
+	{0x0348, 0x0f}, \
+	{0x0349, 0xd7}, \
+	{0x034a, IMX477_HI(IMX477_BIN2_Y_END(_y, _h))}, \
+	{0x034b, IMX477_LO(IMX477_BIN2_Y_END(_y, _h))}, \
+	{0x00e3, 0x00}, \
+	{0x00e4, 0x00}, \
+	{0x00fc, 0x0a}, \
+	{0x00fd, 0x0a}, \
+	{0x00fe, 0x0a}, \
+	{0x00ff, 0x0a}, \
+	{0xe013, 0x00}, \
+	{0x0220, 0x00}, \
+	{0x0221, 0x11}, \
+	{0x0381, 0x01}, \
+	{0x0383, 0x01}, \
+	{0x0385, 0x01}, \
+	{0x0387, 0x01}, \
+	{0x0900, 0x01}, \
+	{0x0901, 0x22}, \
+	{0x0902, 0x02}, \
+	{0x3140, 0x02}, \
+	{0x3c00, 0x00}, \
+	{0x3c01, 0x01}, \
+	{0x3c02, 0x9c}, \
+	{0x3f0d, 0x00}, \
+	{0x5748, 0x00}, \
+	{0x5749, 0x00}, \
+	{0x574a, 0x00}, \
+	{0x574b, 0xa4}, \
+	{0x7b75, 0x0e}, \
+	{0x7b76, 0x09}, \
+	{0x7b77, 0x08}, \
+	{0x7b78, 0x06}, \
+	{0x7b79, 0x34}, \
+	{0x7b53, 0x00}, \
+	{0x9369, 0x73}, \
+	{0x936b, 0x64}, \
+	{0x936d, 0x5f}, \
+	{0x9304, 0x03}, \
+	{0x9305, 0x80}, \
+	{0x9e9a, 0x2f}, \
+	{0x9e9b, 0x2f}, \
+	{0x9e9c, 0x2f}, \
+	{0x9e9d, 0x00}, \
+	{0x9e9e, 0x00}, \
+	{0x9e9f, 0x00}, \
+	{0xa2a9, 0x27}, \
+	{0xa2b7, 0x03}, \
+	{0x0401, 0x00}, \
+	{0x0404, 0x00}, \
+	{0x0405, 0x10}, \
+	{0x0408, IMX477_HI((_x) / 2)}, \
+	{0x0409, IMX477_LO((_x) / 2)}, \
+	{0x040a, 0x00}, \
+	{0x040b, 0x00}, \
+	{0x040c, IMX477_HI(_w)}, \
+	{0x040d, IMX477_LO(_w)}, \
+	{0x040e, IMX477_HI(_h)}, \
+	{0x040f, IMX477_LO(_h)}, \
+	{0x034c, IMX477_HI(_w)}, \
+	{0x034d, IMX477_LO(_w)}, \
+	{0x034e, IMX477_HI(_h)}, \
+	{0x034f, IMX477_LO(_h)}, \
+	{0x0301, 0x05}, \
+	{0x0303, 0x02}, \
+	{0x0305, 0x02}, \
+	{0x0306, 0x00}, \
+	{0x0307, 0xaf}, \
+	{0x0309, 0x0a}, \
+	{0x030b, 0x02}, \
+	{0x030d, 0x02}, \
+	{0x030e, 0x00}, \
+	{0x030f, 0x96}, \
+	{0x0310, 0x01}, \
+	{0x0820, 0x07}, \
+	{0x0821, 0x08}, \
+	{0x0822, 0x00}, \
+	{0x0823, 0x00}, \
+	{0x080a, 0x00}, \
+	{0x080b, 0x7f}, \
+	{0x080c, 0x00}, \
+	{0x080d, 0x4f}, \
+	{0x080e, 0x00}, \
+	{0x080f, 0x77}, \
+	{0x0810, 0x00}, \
+	{0x0811, 0x5f}, \
+	{0x0812, 0x00}, \
+	{0x0813, 0x57}, \
+	{0x0814, 0x00}, \
+	{0x0815, 0x4f}, \
+	{0x0816, 0x01}, \
+	{0x0817, 0x27}, \
+	{0x0818, 0x00}, \
+	{0x0819, 0x3f}, \
+	{0xe04c, 0x00}, \
+	{0xe04d, 0x5f}, \
+	{0xe04e, 0x00}, \
+	{0xe04f, 0x1f}, \
+	{0x3e20, 0x01}, \
+	{0x3e37, 0x00}, \
+	{0x3f50, 0x00}, \
+	{0x3f56, IMX477_HI(IMX477_BIN2_3F56(_line))}, \
+	{0x3f57, IMX477_LO(IMX477_BIN2_3F56(_line))}, \
+}
+#define IMX477_BIN2_10BIT_REGS(...)	__IMX477_BIN2_10BIT_REGS(__VA_ARGS__)
+
+/*
+ * FIXME: the analog crop rectangle is actually
+ * programmed with a horizontal displacement of 0
+ * pixels, not 4. It gets shrunk after going through
+ * the scaler. Move this information to the compose
+ * rectangle once the driver is expanded to represent
+ * its processing blocks with multiple subdevs.
+ */
+#define __IMX477_BIN2_10BIT_MODE(_w, _h, _x, _y, _line, _fps, _regs) { \
+		.width = _w,                               /* Anchura de la imagen */ \
+		.height = _h,                              /* Altura de la imagen */ \
+		.line_length_pix = _line,                  /* Longitud de línea en píxeles */ \
+		.crop = {                                  /* Campo de visión en el array */ \
+			.left = IMX477_PIXEL_ARRAY_LEFT + (_x), \
+			.top = IMX477_PIXEL_ARRAY_TOP + (_y), \
+			.width = 2 * (_w), \
+			.height = 2 * (_h), \
+		}, \
+		.timeperframe_min = {                      /* Tiempo mínimo por fotograma */ \
+			.numerator = 100, \
+			.denominator = 100 * (_fps) \
+		}, \
+		.timeperframe_default = {                  /* Tiempo por defecto por fotograma */ \
+			.numerator = 100, \
+			.denominator = 100 * (_fps) \
+		}, \
+		.reg_list = {                              /* Lista de registros */ \
+			.num_of_regs = ARRAY_SIZE(_regs), \
+			.regs = _regs, \
+		}, \
+	}
+#define IMX477_BIN2_10BIT_MODE(...)	__IMX477_BIN2_10BIT_MODE(__VA_ARGS__)
+
+/*
+ * Descripciones de los modos de 10 bits. La longitud de línea sale del ancho
+ * de salida, como en las tablas de Sony: una línea tiene que caber en los
+ * 1,8 Gb/s de los dos carriles CSI-2 en su tiempo de línea. 6664 basta hasta
+ * 1332 píxeles, 1920 necesita 6664 * 1920 / 1332, unos 9600.
+ */
+#define IMX477_MODE_1332X990	1332, 990, 696, 528, 6664, 120   // 120fps, recortado al centro
+#define IMX477_MODE_1920X1080	1920, 1080, 108, 440, 9600, 60   // 1080p60, 3840x2160 del centro
+#define IMX477_MODE_1280X720	1280, 720, 748, 800, 6664, 120   // 720p120, 2560x1440 del centro
+
+/* 2x2 binned. 120fps : Lista de Registros en modo 120 fps con unión de pixeles de 2x2p */
+static const struct imx477_reg mode_1332x990_regs[] =
+	IMX477_BIN2_10BIT_REGS(IMX477_MODE_1332X990);
+
+/* 2x2 binned 1080p60 : Lista de Registros en modo 1080p con unión de pixeles de 2x2p */
+static const struct imx477_reg mode_1920x1080_regs[] =
+	IMX477_BIN2_10BIT_REGS(IMX477_MODE_1920X1080);
+
+/* 2x2 binned 720p120 : Lista de Registros en modo 720p con unión de pixeles de 2x2p */
+static const struct imx477_reg mode_1280x720_regs[] =
+	IMX477_BIN2_10BIT_REGS(IMX477_MODE_1280X720);
 
 /* Configuraciones de modos con tamaño de píxel de 12 bits */ 
 static const struct imx477_mode supported_modes_12bit[] = {
@@ -1018,38 +1134,12 @@ static const struct imx477_mode supported_modes_12bit[] = {
 
 /* Configuraciones de modos con tamaño de píxel de 10 bits */
 static const struct imx477_mode supported_modes_10bit[] = {
-	/* Modo 120fps, 2x2 binning y recortado */ {
-		
-		.width = 1332,                             // Anchura de la imagen
-		.height = 990,                             // Altura de la imagen
-		.line_length_pix = 6664,                   // Longitud de línea en píxeles
-		.crop = {                                  // Recorte del sensor
-			/*
-			 * FIXME: the analog crop rectangle is actually
-			 * programmed with a horizontal displacement of 0
-			 * pixels, not 4. It gets shrunk after going through
-			 * the scaler. Move this information to the compose
-			 * rectangle once the driver is expanded to represent
-			 * its processing blocks with multiple subdevs.
-			 */
-			.left = IMX477_PIXEL_ARRAY_LEFT + 696, // Desplazamiento horizontal del recorte
-			.top = IMX477_PIXEL_ARRAY_TOP + 528,   // Desplazamiento vertical del recorte
-			.width = 2664,                         // Anchura del recorte
-			.height = 1980,                        // Altura del recorte
-		},
-		.timeperframe_min = {                       // Tiempo mínimo por fotograma
-			.numerator = 100,
-			.denominator = 12000
-		},
-		.timeperframe_default = {                   // Tiempo por defecto por fotograma
-			.numerator = 100,
-			.denominator = 12000
-		},
-		.reg_list = {                               // Lista de registros
-			.num_of_regs = ARRAY_SIZE(mode_1332x990_regs), // Número de registros
-			.regs = mode_1332x990_regs,            // Puntero a los registros
-		}
-	}
+	/* Modo 120fps, 2x2 binning y recortado */
+	IMX477_BIN2_10BIT_MODE(IMX477_MODE_1332X990, mode_1332x990_regs),
+	/* Modo 1080p60, 2x2 binning y recortado */
+	IMX477_BIN2_10BIT_MODE(IMX477_MODE_1920X1080, mode_1920x1080_regs),
+	/* Modo 720p120, 2x2 binning y recortado */
+	IMX477_BIN2_10BIT_MODE(IMX477_MODE_1280X720, mode_1280x720_regs),
 };
 
 /*
@@ -1142,6 +1232,7 @@ struct imx477 {
 	struct v4l2_ctrl *pixel_rate; 		// Tasa de píxeles
 	struct v4l2_ctrl *link_freq;		// Frecuencia de enlace
 	struct v4l2_ctrl *exposure; 		// Exposición
+	struct v4l2_ctrl *gain; 			// Ganancia analógica, en un cluster con la exposición: deben ir seguidos
 	struct v4l2_ctrl *vflip; 			// Volteo vertical
 	struct v4l2_ctrl *hflip; 			// Volteo horizontal
 	struct v4l2_ctrl *vblank; 			// Vertical blank : Tiempo de inactividad desde el paso de un frame al siguiente (ultima a primera linea)
@@ -1152,6 +1243,7 @@ struct imx477 {
 
 	/* Trigger mode : Modo de disparo (VSYNC) */
 	int trigger_mode_of;  // Modo de operación del disparador de VSYNC (0, 1, 2)
+	int trigger_mode_dev; // El mismo modo fijado por sysfs para este sensor, -1 si no se ha fijado
 
 	/*
 	 * Mutex for serialized access:
@@ -1170,6 +1262,23 @@ struct imx477 {
 
 	/* Any extra information related to different compatible sensors : Información extra de registros compatibles */
 	const struct imx477_compatible_data *compatible_data; //Informacion de sensores adicionales compatibles
+
+	/* Mensajes y buffers de las escrituras en ráfaga, protegidos por el mutex */
+	struct i2c_msg burst_msgs[IMX477_BURST_MSGS];
+	u8 burst_buf[IMX477_BURST_MSGS][IMX477_BURST_LEN + 2];
+
+	/*
+	 * Copia de los valores escritos en el sensor: shadow guarda el byte de
+	 * cada dirección y shadow_valid las direcciones cuyo valor se conoce.
+	 * Se invalida al apagar el sensor, que pierde entonces sus registros.
+	 */
+	u8 *shadow;
+	unsigned long *shadow_valid;
+
+	/* Registros escritos, omitidos por la copia y transferencias I2C desde el último arranque del streaming */
+	unsigned int regs_written;
+	unsigned int regs_skipped;
+	unsigned int i2c_transfers;
 };
 
 // Transforma la structura _sd a una estructura imx477
@@ -1262,12 +1371,55 @@ static int imx477_read_reg(struct imx477 *imx477, u16 reg, u32 len, u32 *val) {
 	return 0;
 }
 
+/* Registros que desencadenan una acción al escribirse, siempre se envían */
+static bool imx477_reg_volatile(u32 reg) {
+	return reg == IMX477_REG_MODE_SELECT || reg == IMX477_REG_GROUP_HOLD;
+}
+
+/**
+ * @brief Comprueba si la copia ya tiene el valor que se va a escribir.
+ *
+ * @param imx477 Estructura que contiene los datos y configuraciones del sensor IMX477.
+ * @param reg Dirección del primer registro.
+ * @param len Longitud del valor en bytes, big-endian como en el sensor.
+ * @param val Valor a escribir.
+ * @return true si todos los bytes son conocidos e iguales, la escritura puede omitirse.
+ */
+static bool imx477_shadow_match(struct imx477 *imx477, u32 reg, u32 len, u32 val) {
+	u32 i;
+
+	if (!reg_cache || reg + len > IMX477_REG_SPACE || imx477_reg_volatile(reg))
+		return false;
+
+	for (i = 0; i < len; i++) {
+		if (!test_bit(reg + i, imx477->shadow_valid) ||
+		    imx477->shadow[reg + i] != ((val >> (8 * (len - 1 - i))) & 0xff))
+			return false;
+	}
+	return true;
+}
+
+/* Guarda en la copia los bytes escritos a partir de reg */
+static void imx477_shadow_store(struct imx477 *imx477, u32 reg, const u8 *data, u32 len) {
+	if (reg + len > IMX477_REG_SPACE || imx477_reg_volatile(reg))
+		return;
+	memcpy(imx477->shadow + reg, data, len);
+	bitmap_set(imx477->shadow_valid, reg, len);
+}
+
+/* Tras un fallo de escritura el valor en el sensor es desconocido */
+static void imx477_shadow_forget(struct imx477 *imx477, u32 reg, u32 len) {
+	if (reg + len <= IMX477_REG_SPACE)
+		bitmap_clear(imx477->shadow_valid, reg, len);
+}
+
 /* Write registers up to 2 at a time */
 /**
  * @brief Escribe un valor en un registro del sensor IMX477 a través de I2C.
  *
  * Esta función envía un valor al registro especificado del dispositivo IMX477
- * a través del bus I2C. Permite escribir hasta 4 bytes de datos.
+ * a través del bus I2C. Permite escribir hasta 4 bytes de datos. La escritura
+ * se omite si la copia de los registros ya tiene ese valor.
  *
  * @param imx477 Estructura que contiene los datos y configuraciones del sensor IMX477.
  * @param reg Dirección del registro al que se desea escribir.
@@ -1287,10 +1439,20 @@ static int imx477_write_reg(struct imx477 *imx477, u16 reg, u32 len, u32 val) {
 	// Coloca el valor a escribir en el buffer, ajustando según la longitud especificada (32 bits)
 	put_unaligned_be32(val << (8 * (4 - len)), buf + 2);
 
+	if (imx477_shadow_match(imx477, reg, len, val)) {
+		imx477->regs_skipped++;
+		return 0;
+	}
+
 	// Envía el buffer al dispositivo I2C y verifica si la longitud del mensaje enviado es correcta
-	if (i2c_master_send(client, buf, len + 2) != len + 2) 
+	imx477->i2c_transfers++;
+	if (i2c_master_send(client, buf, len + 2) != len + 2) {
+		imx477_shadow_forget(imx477, reg, len);
 		return -EIO; // Error Input Output
+	}
 	
+	imx477_shadow_store(imx477, reg, buf + 2, len);
+	imx477->regs_written++;
 	return 0;
 }
 
@@ -1317,8 +1479,8 @@ static int imx477_write_reg(struct imx477 *imx477, u16 reg, u32 len, u32 val) {
  * @param len Longitud de la lista de registros (número de elementos en el array).
  * @return 0 si todas las escrituras fueron exitosas, o un código de error negativo en caso de fallo.
  */
-static int imx477_write_regs(struct imx477 *imx477,
-			     const struct imx477_reg *regs, u32 len) {
+static int imx477_write_regs_single(struct imx477 *imx477,
+				    const struct imx477_reg *regs, u32 len) {
 	struct i2c_client *client = v4l2_get_subdevdata(&imx477->sd); // Obtiene el cliente I2C desde la estructura V4L2
 	unsigned int i;
 	int ret;
@@ -1339,6 +1501,161 @@ static int imx477_write_regs(struct imx477 *imx477,
 	return 0; // Retorna 0 para indicar que todas las escrituras fueron exitosas
 }
 
+/**
+ * @brief Envía los mensajes en ráfaga preparados en una sola transferencia.
+ *
+ * @param imx477 Estructura que contiene los datos y configuraciones del sensor IMX477.
+ * @param msgs Número de mensajes preparados en burst_msgs.
+ * @return 0 si la transferencia fue exitosa, o un código de error negativo en caso de fallo.
+ */
+static int imx477_burst_flush(struct imx477 *imx477, unsigned int msgs) {
+	struct i2c_client *client = v4l2_get_subdevdata(&imx477->sd); // Obtiene el cliente I2C desde la estructura V4L2
+	unsigned int i;
+	int ret;
+
+	if (!msgs)
+		return 0;
+
+	imx477->i2c_transfers++;
+	ret = i2c_transfer(client->adapter, imx477->burst_msgs, msgs);
+	if (ret != (int)msgs) {
+		// No se sabe qué mensajes llegaron al sensor, la copia de todos ellos deja de ser válida
+		for (i = 0; i < msgs; i++)
+			imx477_shadow_forget(imx477, get_unaligned_be16(imx477->burst_buf[i]),
+					     imx477->burst_msgs[i].len - 2);
+		dev_err_ratelimited(&client->dev,
+				    "Failed to write regs from 0x%4.4x. error = %d\n",
+				    get_unaligned_be16(imx477->burst_buf[0]), ret);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	for (i = 0; i < msgs; i++)
+		imx477->regs_written += imx477->burst_msgs[i].len - 2;
+	return 0;
+}
+
+/**
+ * @brief Escribe una lista de registros agrupando las direcciones consecutivas.
+ *
+ * El sensor incrementa la dirección tras cada byte escrito, de modo que una
+ * serie de registros consecutivos de la tabla se envía como un único mensaje
+ * con la dirección del primero y todos sus valores. Los mensajes se envían de
+ * IMX477_BURST_MSGS en IMX477_BURST_MSGS en una sola llamada a i2c_transfer(),
+ * respetando el orden de la tabla.
+ *
+ * Los registros cuyo valor ya está en la copia no se envían, así que al
+ * cambiar de modo solo se escribe la diferencia entre las dos tablas. Con
+ * burst_write a 0, o si el adaptador no admite mensajes I2C arbitrarios,
+ * se escribe registro a registro.
+ *
+ * @param imx477 Estructura que contiene los datos y configuraciones del sensor IMX477.
+ * @param regs Puntero a una lista de estructuras `imx477_reg` que contiene
+ *             los registros y sus valores correspondientes.
+ * @param len Longitud de la lista de registros (número de elementos en el array).
+ * @return 0 si todas las escrituras fueron exitosas, o un código de error negativo en caso de fallo.
+ */
+static int imx477_write_regs(struct imx477 *imx477,
+			     const struct imx477_reg *regs, u32 len) {
+	struct i2c_client *client = v4l2_get_subdevdata(&imx477->sd); // Obtiene el cliente I2C desde la estructura V4L2
+	unsigned int i = 0, msgs = 0;
+	int ret;
+
+	if (!burst_write || !i2c_check_functionality(client->adapter, I2C_FUNC_I2C))
+		return imx477_write_regs_single(imx477, regs, len);
+
+	while (i < len) {
+		struct i2c_msg *msg = &imx477->burst_msgs[msgs];
+		u8 *buf = imx477->burst_buf[msgs];
+		u16 first = regs[i].address;
+		unsigned int count = 0, used = 0;
+
+		// Un registro que ya tiene su valor no abre un mensaje
+		if (imx477_shadow_match(imx477, first, 1, regs[i].val)) {
+			imx477->regs_skipped++;
+			i++;
+			continue;
+		}
+
+		// Dirección del primer registro seguida de los valores de todos los consecutivos,
+		// los que coinciden con la copia al final del grupo no se envían
+		put_unaligned_be16(first, buf);
+		while (i < len && count < IMX477_BURST_LEN &&
+		       regs[i].address == first + count) {
+			if (!imx477_shadow_match(imx477, regs[i].address, 1, regs[i].val))
+				used = count + 1;
+			buf[2 + count++] = regs[i++].val;
+		}
+		imx477->regs_skipped += count - used;
+
+		msg->addr = client->addr;
+		msg->flags = 0;
+		msg->len = used + 2;
+		msg->buf = buf;
+		msgs++;
+		// La copia se actualiza ya, una entrada posterior de la tabla puede volver a escribir el registro
+		imx477_shadow_store(imx477, first, buf + 2, used);
+
+		// Envía el grupo cuando está completo
+		if (msgs == IMX477_BURST_MSGS) {
+			ret = imx477_burst_flush(imx477, msgs);
+			if (ret)
+				return ret;
+			msgs = 0;
+		}
+	}
+
+	return imx477_burst_flush(imx477, msgs);
+}
+
+/**
+ * @brief Escribe un grupo de registros para que el sensor los aplique en el mismo frame.
+ *
+ * Los registros se envían entre la activación y la liberación de la retención
+ * de parámetros agrupados: el sensor los guarda y los aplica todos juntos al
+ * inicio del siguiente frame, nunca la mitad en uno y el resto en el otro.
+ * Con escrituras en ráfaga el grupo entero, retención incluida, es una única
+ * transferencia I2C. Fuera del streaming, o con group_hold a 0, se escriben
+ * sin retención.
+ *
+ * @param imx477 Estructura que contiene los datos y configuraciones del sensor IMX477.
+ * @param regs Registros del grupo, como mucho IMX477_GROUP_MAX.
+ * @param len Número de registros del grupo.
+ * @return 0 si todas las escrituras fueron exitosas, o un código de error negativo en caso de fallo.
+ */
+static int imx477_write_grouped(struct imx477 *imx477,
+				const struct imx477_reg *regs, u32 len) {
+	struct imx477_reg group[IMX477_GROUP_MAX + 2];
+	u32 i;
+	int ret;
+
+	if (WARN_ON(len > IMX477_GROUP_MAX))
+		return -EINVAL;
+
+	// Si el sensor ya tiene todos los valores no hace falta ni la retención
+	for (i = 0; i < len; i++) {
+		if (!imx477_shadow_match(imx477, regs[i].address, 1, regs[i].val))
+			break;
+	}
+	if (i == len)
+		return 0;
+
+	if (!group_hold || !imx477->streaming)
+		return imx477_write_regs(imx477, regs, len);
+
+	group[0].address = IMX477_REG_GROUP_HOLD;
+	group[0].val = 1;
+	memcpy(&group[1], regs, len * sizeof(*regs));
+	group[len + 1].address = IMX477_REG_GROUP_HOLD;
+	group[len + 1].val = 0;
+
+	ret = imx477_write_regs(imx477, group, len + 2);
+	// Con la retención activa el sensor dejaría de aplicar cualquier cambio
+	if (ret)
+		imx477_write_reg(imx477, IMX477_REG_GROUP_HOLD,
+				 IMX477_REG_VALUE_08BIT, 0);
+	return ret;
+}
+
 /* Get bayer order based on flip setting. */
 
 /**
@@ -1463,13 +1780,15 @@ static void imx477_adjust_exposure_range(struct imx477 *imx477) {
  * @brief Establece la longitud de un frame.
  *
  * Ajusta la longitud del frame y el factor de exposición larga si es necesario.
+ * La exposición depende del factor, así que se reescribe en el mismo grupo.
  *
  * @param imx477 Estructura que contiene los datos y configuraciones del sensor IMX477.
  * @param val Nuevo valor de la longitud del frame.
  * @return 0 si la operación fue exitosa, un código de error en caso contrario.
  */
 static int imx477_set_frame_length(struct imx477 *imx477, unsigned int val) {
-	int ret = 0;
+	struct imx477_reg regs[5];
+	u32 exposure;
 
 	imx477->long_exp_shift = 0; // Establecemos la variación de la exposición larga a cero
 
@@ -1479,14 +1798,47 @@ static int imx477_set_frame_length(struct imx477 *imx477, unsigned int val) {
 		val >>= 1; // Divide el número entre dos
 	}
 
-	// Guardamos el valor de la longitud del frame
-	ret = imx477_write_reg(imx477, IMX477_REG_FRAME_LENGTH,
-			       IMX477_REG_VALUE_16BIT, val);
-	if (ret)
-		return ret;
-	// Se registra el valor de la variación en la exposición larga
-	return imx477_write_reg(imx477, IMX477_LONG_EXP_SHIFT_REG,
-				IMX477_REG_VALUE_08BIT, imx477->long_exp_shift);
+	exposure = imx477->exposure->val >> imx477->long_exp_shift;
+
+	// Longitud del frame, variación de la exposición larga y la exposición escalada con ella
+	regs[0].address = IMX477_REG_FRAME_LENGTH;
+	regs[0].val = val >> 8;
+	regs[1].address = IMX477_REG_FRAME_LENGTH + 1;
+	regs[1].val = val & 0xff;
+	regs[2].address = IMX477_LONG_EXP_SHIFT_REG;
+	regs[2].val = imx477->long_exp_shift;
+	regs[3].address = IMX477_REG_EXPOSURE;
+	regs[3].val = exposure >> 8;
+	regs[4].address = IMX477_REG_EXPOSURE + 1;
+	regs[4].val = exposure & 0xff;
+
+	return imx477_write_grouped(imx477, regs, ARRAY_SIZE(regs));
+}
+
+/**
+ * @brief Establece la exposición y la ganancia analógica en el mismo frame.
+ *
+ * Forman un cluster de controles: un cambio de cualquiera de los dos, o de
+ * ambos en la misma petición, llega aquí una sola vez. Los cuatro registros
+ * son consecutivos y van en un único mensaje.
+ *
+ * @param imx477 Estructura que contiene los datos y configuraciones del sensor IMX477.
+ * @return 0 si la operación fue exitosa, un código de error en caso contrario.
+ */
+static int imx477_set_exposure_gain(struct imx477 *imx477) {
+	struct imx477_reg regs[4];
+	u32 exposure = imx477->exposure->val >> imx477->long_exp_shift;
+
+	regs[0].address = IMX477_REG_EXPOSURE;
+	regs[0].val = exposure >> 8;
+	regs[1].address = IMX477_REG_EXPOSURE + 1;
+	regs[1].val = exposure & 0xff;
+	regs[2].address = IMX477_REG_ANALOG_GAIN;
+	regs[2].val = imx477->gain->val >> 8;
+	regs[3].address = IMX477_REG_ANALOG_GAIN + 1;
+	regs[3].val = imx477->gain->val & 0xff;
+
+	return imx477_write_grouped(imx477, regs, ARRAY_SIZE(regs));
 }
 
 /**
@@ -1522,16 +1874,9 @@ static int imx477_set_ctrl(struct v4l2_ctrl *ctrl) {
 
     // Según el ID pasado por el control, se escribe un registro en la cámara
 	switch (ctrl->id) {
-    // Ganancia analógica que afecta a todos los componentes de color en la matriz de píxeles
-	case V4L2_CID_ANALOGUE_GAIN:
-		ret = imx477_write_reg(imx477, IMX477_REG_ANALOG_GAIN,
-				       IMX477_REG_VALUE_16BIT, ctrl->val);
-		break;
-    // Establecer la exposición
+    // Exposición y ganancia analógica, maestro del cluster de ambas
 	case V4L2_CID_EXPOSURE:
-		ret = imx477_write_reg(imx477, IMX477_REG_EXPOSURE,
-				       IMX477_REG_VALUE_16BIT, ctrl->val >>
-							imx477->long_exp_shift);
+		ret = imx477_set_exposure_gain(imx477);
 		break;
     // Ganancia digital que multiplica todos los colores
 	case V4L2_CID_DIGITAL_GAIN:
@@ -2009,7 +2354,12 @@ static int imx477_start_streaming(struct imx477 *imx477) {
 	struct i2c_client *client = v4l2_get_subdevdata(&imx477->sd);
 	const struct imx477_reg_list *reg_list;
 	const struct imx477_reg_list *extra_regs;
+	ktime_t start = ktime_get(); // Inicio de la medida del tiempo de arranque
 	int ret, tm;
+
+	imx477->regs_written = 0;
+	imx477->regs_skipped = 0;
+	imx477->i2c_transfers = 0;
 	
 	// Si los registros comunes no han sido escritos, los configuramos
 	if (!imx477->common_regs_written) {
@@ -2053,8 +2403,11 @@ static int imx477_start_streaming(struct imx477 *imx477) {
 		return ret;
 
 	/* Set vsync trigger mode: 0=standalone, 1=source, 2=sink */
-	// Si el modo de funcionamiento no es standalone lo guardamos, si no indicamos el establecido en trigger_mode
-	tm = (imx477->trigger_mode_of >= 0) ? imx477->trigger_mode_of : trigger_mode;
+	// El de sysfs, si no el del árbol de dispositivos, si no el establecido en trigger_mode
+	if (imx477->trigger_mode_dev >= 0)
+		tm = imx477->trigger_mode_dev;
+	else
+		tm = (imx477->trigger_mode_of >= 0) ? imx477->trigger_mode_of : trigger_mode;
 	// Escribe los registros con distintos modos de funcionamiento
 	imx477_write_reg(imx477, IMX477_REG_MC_MODE,
 			 IMX477_REG_VALUE_08BIT, (tm > 0) ? 1 : 0);
@@ -2067,8 +2420,15 @@ static int imx477_start_streaming(struct imx477 *imx477) {
 
 	/* set stream on register */
 	// Indicamos el modo de funcionamiento como streaming
-	return imx477_write_reg(imx477, IMX477_REG_MODE_SELECT,
-				IMX477_REG_VALUE_08BIT, IMX477_MODE_STREAMING);
+	ret = imx477_write_reg(imx477, IMX477_REG_MODE_SELECT,
+			       IMX477_REG_VALUE_08BIT, IMX477_MODE_STREAMING);
+
+	// Tiempo de arranque del modo, para comparar con y sin escrituras en ráfaga
+	dev_dbg(&client->dev, "%ux%u stream on in %lld us: %u registers in %u I2C transfers, %u unchanged skipped (burst_write=%d reg_cache=%d)\n",
+		imx477->mode->width, imx477->mode->height,
+		ktime_us_delta(ktime_get(), start), imx477->regs_written,
+		imx477->i2c_transfers, imx477->regs_skipped, burst_write, reg_cache);
+	return ret;
 }
 
 /**
@@ -2106,6 +2466,8 @@ static int imx477_set_stream(struct v4l2_subdev *sd, int enable) {
 	struct imx477 *imx477 = to_imx477(sd);
 	// Obtenemos el cliente I2C asociado al subdispositivo V4L2
 	struct i2c_client *client = v4l2_get_subdevdata(sd);
+	ktime_t start = ktime_get(); // Inicio del arranque, para el tiempo hasta el primer frame
+	bool cold;
 	int ret = 0;
 
 	// Obtenemos el lock para asegurar operaciones atómicas
@@ -2118,6 +2480,8 @@ static int imx477_set_stream(struct v4l2_subdev *sd, int enable) {
 	}
 
 	if (enable) {
+		// Arranque en frío si hay que encender el sensor, en caliente si sigue en standby
+		cold = pm_runtime_suspended(&client->dev);
 		// Iniciamos el runtime power management para el dispositivo
 		ret = pm_runtime_get_sync(&client->dev);
 		if (ret < 0) { // Si hay un error al iniciar el runtime power management
@@ -2134,11 +2498,14 @@ static int imx477_set_stream(struct v4l2_subdev *sd, int enable) {
 		ret = imx477_start_streaming(imx477);
 		if (ret)
 			goto err_rpm_put;
+		dev_dbg(&client->dev, "%s start: streaming %lld us after set_stream\n",
+			cold ? "cold" : "warm", ktime_us_delta(ktime_get(), start));
 	} else {
 		// Detenemos el streaming de datos
 		imx477_stop_streaming(imx477);
-		// Liberamos el runtime power management
-		pm_runtime_put(&client->dev);
+		// El sensor queda en standby, con sus registros, hasta que venza el retardo
+		pm_runtime_mark_last_busy(&client->dev);
+		pm_runtime_put_autosuspend(&client->dev);
 	}
 
 	// Actualizamos el estado de streaming en la estructura del sensor
@@ -2156,7 +2523,8 @@ static int imx477_set_stream(struct v4l2_subdev *sd, int enable) {
 
 err_rpm_put:
 	// Liberamos el runtime power management
-	pm_runtime_put(&client->dev);
+	pm_runtime_mark_last_busy(&client->dev);
+	pm_runtime_put_autosuspend(&client->dev);
 err_unlock:
 	// Liberamos el lock
 	mutex_unlock(&imx477->mutex);
@@ -2235,6 +2603,8 @@ static int imx477_power_off(struct device *dev) {
 	/* Force reprogramming of the common registers when powered up again. */
 	// Marcamos que los registros comunes deben ser reprogramados al encender el dispositivo nuevamente
 	imx477->common_regs_written = false;
+	// El sensor apagado pierde sus registros, ningún valor de la copia es válido
+	bitmap_zero(imx477->shadow_valid, IMX477_REG_SPACE);
 
 	return 0;
 }
@@ -2470,9 +2840,9 @@ static int imx477_init_controls(struct imx477 *imx477) {
 					     IMX477_EXPOSURE_DEFAULT);
 	
 	// Prepara los valores de la ganancia analogica
-	v4l2_ctrl_new_std(ctrl_hdlr, &imx477_ctrl_ops, V4L2_CID_ANALOGUE_GAIN,
-			  IMX477_ANA_GAIN_MIN, IMX477_ANA_GAIN_MAX,
-			  IMX477_ANA_GAIN_STEP, IMX477_ANA_GAIN_DEFAULT);
+	imx477->gain = v4l2_ctrl_new_std(ctrl_hdlr, &imx477_ctrl_ops, V4L2_CID_ANALOGUE_GAIN,
+					 IMX477_ANA_GAIN_MIN, IMX477_ANA_GAIN_MAX,
+					 IMX477_ANA_GAIN_STEP, IMX477_ANA_GAIN_DEFAULT);
 
 	// Prepara los valores de la ganancia digital
 	v4l2_ctrl_new_std(ctrl_hdlr, &imx477_ctrl_ops, V4L2_CID_DIGITAL_GAIN,
@@ -2521,6 +2891,8 @@ static int imx477_init_controls(struct imx477 *imx477) {
 			__func__, ret);
 		goto error;
 	}
+	// Exposición y ganancia se aplican juntas, una petición con ambas llega en una sola llamada
+	v4l2_ctrl_cluster(2, &imx477->exposure);
 	// Preparamos y validamos las propiedades del dispositivo del nodo V4L2 y rellena la estructura dev
 	ret = v4l2_fwnode_device_parse(&client->dev, &props);
 	if (ret)
@@ -2666,6 +3038,11 @@ static const struct of_device_id imx477_dt_ids[] = {
 	{ /* sentinel */ }
 };
 
+/* Libera la copia de los registros junto con el dispositivo */
+static void imx477_free_shadow(void *shadow) {
+	vfree(shadow);
+}
+
 /**
  * Función usada para inicializar el dispositivo, preparar los recursos y registrar el dispositivo.
  *
@@ -2703,6 +3080,7 @@ static int imx477_probe(struct i2c_client *client) {
 	/* Default the trigger mode from OF to -1, which means invalid */
 	ret = of_property_read_u32(dev->of_node, "trigger-mode", &tm_of); // Lee la propiedad "trigger-mode".
 	imx477->trigger_mode_of = (ret == 0) ? tm_of : -1; // Guarda el modo de disparo obtenido del árbol.
+	imx477->trigger_mode_dev = -1; // Hasta que se fije por sysfs
 
 	/* Get system clock (xclk) */
 	// Obtenemos el reloj del sistema (xclk).
@@ -2727,6 +3105,17 @@ static int imx477_probe(struct i2c_client *client) {
 		return ret;
 	}
 
+	// Copia de los registros, tiene que existir antes de la primera escritura.
+	imx477->shadow = vzalloc(IMX477_REG_SPACE);
+	if (!imx477->shadow)
+		return -ENOMEM;
+	ret = devm_add_action_or_reset(dev, imx477_free_shadow, imx477->shadow);
+	if (ret)
+		return ret;
+	imx477->shadow_valid = devm_bitmap_zalloc(dev, IMX477_REG_SPACE, GFP_KERNEL);
+	if (!imx477->shadow_valid)
+		return -ENOMEM;
+
 	/* Request optional enable pin */
 	// Solicita el pin de habilitación opcional (reset).
 	imx477->reset_gpio = devm_gpiod_get_optional(dev, "reset",
@@ -2752,6 +3141,9 @@ static int imx477_probe(struct i2c_client *client) {
 	// Habilita el PM en tiempo de ejecución y apaga el dispositivo.
 	pm_runtime_set_active(dev); // Marca el dispositivo como activo.
 	pm_runtime_enable(dev);  // Habilita el PM.
+	// Standby en caliente: al parar el streaming el sensor se apaga tras standby_delay_ms
+	pm_runtime_set_autosuspend_delay(dev, standby_delay_ms);
+	pm_runtime_use_autosuspend(dev);
 	pm_runtime_idle(dev); // Pone el dispositivo en modo suspendido.
 
 	/* This needs the pm runtime to be registered. */
@@ -2792,6 +3184,7 @@ error_handler_free:
 	imx477_free_controls(imx477);
 
 error_power_off:
+	pm_runtime_dont_use_autosuspend(&client->dev);
 	pm_runtime_disable(&client->dev);
 	pm_runtime_set_suspended(&client->dev);
 	imx477_power_off(&client->dev);
@@ -2813,6 +3206,7 @@ static void imx477_remove(struct i2c_client *client) {
 	media_entity_cleanup(&sd->entity); 		// Limpiamos la entidad de medios
 	imx477_free_controls(imx477); 			// Liberamos los controles y el mutex
  
+	pm_runtime_dont_use_autosuspend(&client->dev); 	// Sin standby, el sensor se apaga aquí
 	pm_runtime_disable(&client->dev); 				// Deshabilitamos el PM
 	if (!pm_runtime_status_suspended(&client->dev)) // Si no está suspendido
 		imx477_power_off(&client->dev); 			// Apagamos el dispositivo
@@ -2825,6 +3219,64 @@ static void imx477_remove(struct i2c_client *client) {
  */
 MODULE_DEVICE_TABLE(of, imx477_dt_ids);
 
+/**
+ * @brief Muestra el modo de disparo fijado para este sensor por sysfs.
+ *
+ * @param dev Puntero al dispositivo del sensor.
+ * @param attr Atributo leído.
+ * @param buf Buffer de salida.
+ * @return Número de bytes escritos en el buffer.
+ */
+static ssize_t trigger_mode_show(struct device *dev,
+				 struct device_attribute *attr, char *buf) {
+	struct imx477 *imx477 = to_imx477(i2c_get_clientdata(to_i2c_client(dev)));
+
+	return sysfs_emit(buf, "%d\n", imx477->trigger_mode_dev);
+}
+
+/**
+ * @brief Fija el modo de disparo de este sensor: 0=standalone, 1=source, 2=sink.
+ *
+ * Con varias cámaras sincronizadas cada sensor necesita su propio modo, que
+ * el parámetro trigger_mode del módulo no permite. -1 vuelve al modo del
+ * árbol de dispositivos o del parámetro. Se aplica en el siguiente arranque
+ * del streaming, así que no se puede cambiar mientras el sensor emite.
+ *
+ * @param dev Puntero al dispositivo del sensor.
+ * @param attr Atributo escrito.
+ * @param buf Valor escrito.
+ * @param count Longitud del valor.
+ * @return count si se aceptó, -EINVAL fuera de rango o -EBUSY en streaming.
+ */
+static ssize_t trigger_mode_store(struct device *dev,
+				  struct device_attribute *attr,
+				  const char *buf, size_t count) {
+	struct imx477 *imx477 = to_imx477(i2c_get_clientdata(to_i2c_client(dev)));
+	int tm, ret;
+
+	ret = kstrtoint(buf, 0, &tm);
+	if (ret)
+		return ret;
+	if (tm < -1 || tm > 2)
+		return -EINVAL;
+
+	mutex_lock(&imx477->mutex);
+	if (imx477->streaming)
+		ret = -EBUSY;
+	else
+		imx477->trigger_mode_dev = tm;
+	mutex_unlock(&imx477->mutex);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(trigger_mode);
+
+static struct attribute *imx477_attrs[] = {
+	&dev_attr_trigger_mode.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(imx477);
+
 /**
  * @brief Define las operaciones de gestión de energía del dispositivo IMX477.
  */
@@ -2841,6 +3293,7 @@ static struct i2c_driver imx477_i2c_driver = {
 		.name = "imx477", // Nombre del controlador
 		.of_match_table	= imx477_dt_ids, // Tabla de identificación de dispositivos compatibles
 		.pm = &imx477_pm_ops, // Operaciones de gestión de energía
+		.dev_groups = imx477_groups, // Atributos de sysfs del sensor (trigger_mode)
 	},
 	.probe = imx477_probe, // Función de inicialización del dispositivo
 	.remove = imx477_remove, // Función de eliminación del dispositivo
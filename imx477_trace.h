@@ -0,0 +1,292 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Tracepoints of the IMX477 logging driver (imx477_log.c).
+ *
+ * Sustituyen a los printk de la versión de registro: desactivados cuestan
+ * una rama sobre una static key, así que el mismo módulo puede quedarse en
+ * producción y activarse solo al perfilar:
+ *
+ *   echo mono > /sys/kernel/tracing/trace_clock
+ *   echo 1 > /sys/kernel/tracing/events/imx477/enable
+ *
+ * Con trace_clock mono las marcas de tiempo son CLOCK_MONOTONIC, el mismo
+ * reloj de los timestamps de los buffers de libcamera, y se pueden cruzar
+ * con ellos (imx477_trace.py).
+ *
+ * El módulo se compila con la cabecera en la ruta de inclusión:
+ *   CFLAGS_imx477_log.o := -I$(src)
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM imx477
+
+#if !defined(_IMX477_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _IMX477_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Enumeraciones que libcamera repite al configurar la cámara, a la entrada */
+DECLARE_EVENT_CLASS(imx477_enum,
+	TP_PROTO(u32 pad, u32 index, u32 code),
+	TP_ARGS(pad, index, code),
+
+	TP_STRUCT__entry(
+		__field(u32, pad)
+		__field(u32, index)
+		__field(u32, code)
+	),
+
+	TP_fast_assign(
+		__entry->pad = pad;
+		__entry->index = index;
+		__entry->code = code;
+	),
+
+	TP_printk("pad=%u index=%u code=0x%04x",
+		  __entry->pad, __entry->index, __entry->code)
+);
+
+DEFINE_EVENT(imx477_enum, imx477_enum_mbus_code,
+	TP_PROTO(u32 pad, u32 index, u32 code),
+	TP_ARGS(pad, index, code));
+
+DEFINE_EVENT(imx477_enum, imx477_enum_frame_size,
+	TP_PROTO(u32 pad, u32 index, u32 code),
+	TP_ARGS(pad, index, code));
+
+/* Formato de un pad tal como queda al salir de la operación */
+DECLARE_EVENT_CLASS(imx477_format,
+	TP_PROTO(u32 pad, u32 which, u32 code, u32 width, u32 height),
+	TP_ARGS(pad, which, code, width, height),
+
+	TP_STRUCT__entry(
+		__field(u32, pad)
+		__field(u32, which)
+		__field(u32, code)
+		__field(u32, width)
+		__field(u32, height)
+	),
+
+	TP_fast_assign(
+		__entry->pad = pad;
+		__entry->which = which;
+		__entry->code = code;
+		__entry->width = width;
+		__entry->height = height;
+	),
+
+	TP_printk("pad=%u which=%s code=0x%04x %ux%u",
+		  __entry->pad, __entry->which ? "active" : "try",
+		  __entry->code, __entry->width, __entry->height)
+);
+
+DEFINE_EVENT(imx477_format, imx477_get_pad_format,
+	TP_PROTO(u32 pad, u32 which, u32 code, u32 width, u32 height),
+	TP_ARGS(pad, which, code, width, height));
+
+DEFINE_EVENT(imx477_format, imx477_set_pad_format,
+	TP_PROTO(u32 pad, u32 which, u32 code, u32 width, u32 height),
+	TP_ARGS(pad, which, code, width, height));
+
+TRACE_EVENT(imx477_get_selection,
+	TP_PROTO(u32 pad, u32 which, u32 target),
+	TP_ARGS(pad, which, target),
+
+	TP_STRUCT__entry(
+		__field(u32, pad)
+		__field(u32, which)
+		__field(u32, target)
+	),
+
+	TP_fast_assign(
+		__entry->pad = pad;
+		__entry->which = which;
+		__entry->target = target;
+	),
+
+	TP_printk("pad=%u which=%s target=0x%04x",
+		  __entry->pad, __entry->which ? "active" : "try",
+		  __entry->target)
+);
+
+TRACE_EVENT(imx477_set_stream,
+	TP_PROTO(int enable),
+	TP_ARGS(enable),
+
+	TP_STRUCT__entry(
+		__field(int, enable)
+	),
+
+	TP_fast_assign(
+		__entry->enable = enable;
+	),
+
+	TP_printk("%s", __entry->enable ? "on" : "off")
+);
+
+/* Fin de imx477_start_streaming(), con lo que costó escribir las tablas */
+TRACE_EVENT(imx477_stream_on,
+	TP_PROTO(u32 width, u32 height, s64 duration_us, u32 regs_written,
+		 u32 i2c_transfers, u32 regs_skipped, int ret),
+	TP_ARGS(width, height, duration_us, regs_written, i2c_transfers,
+		regs_skipped, ret),
+
+	TP_STRUCT__entry(
+		__field(u32, width)
+		__field(u32, height)
+		__field(s64, duration_us)
+		__field(u32, regs_written)
+		__field(u32, i2c_transfers)
+		__field(u32, regs_skipped)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->width = width;
+		__entry->height = height;
+		__entry->duration_us = duration_us;
+		__entry->regs_written = regs_written;
+		__entry->i2c_transfers = i2c_transfers;
+		__entry->regs_skipped = regs_skipped;
+		__entry->ret = ret;
+	),
+
+	TP_printk("%ux%u duration=%lld us regs=%u transfers=%u skipped=%u ret=%d",
+		  __entry->width, __entry->height, __entry->duration_us,
+		  __entry->regs_written, __entry->i2c_transfers,
+		  __entry->regs_skipped, __entry->ret)
+);
+
+/*
+ * Fin de un set_stream(1), desde su llamada: en frío incluye el encendido
+ * del sensor, en caliente salía del standby con sus registros.
+ */
+TRACE_EVENT(imx477_stream_start,
+	TP_PROTO(bool cold, s64 duration_us),
+	TP_ARGS(cold, duration_us),
+
+	TP_STRUCT__entry(
+		__field(bool, cold)
+		__field(s64, duration_us)
+	),
+
+	TP_fast_assign(
+		__entry->cold = cold;
+		__entry->duration_us = duration_us;
+	),
+
+	TP_printk("%s duration=%lld us", __entry->cold ? "cold" : "warm",
+		  __entry->duration_us)
+);
+
+/* Cambios de alimentación, por runtime PM o por suspensión del sistema */
+DECLARE_EVENT_CLASS(imx477_power,
+	TP_PROTO(s64 duration_us, int ret),
+	TP_ARGS(duration_us, ret),
+
+	TP_STRUCT__entry(
+		__field(s64, duration_us)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->duration_us = duration_us;
+		__entry->ret = ret;
+	),
+
+	TP_printk("duration=%lld us ret=%d", __entry->duration_us, __entry->ret)
+);
+
+DEFINE_EVENT(imx477_power, imx477_power_on,
+	TP_PROTO(s64 duration_us, int ret),
+	TP_ARGS(duration_us, ret));
+
+DEFINE_EVENT(imx477_power, imx477_power_off,
+	TP_PROTO(s64 duration_us, int ret),
+	TP_ARGS(duration_us, ret));
+
+DEFINE_EVENT(imx477_power, imx477_suspend,
+	TP_PROTO(s64 duration_us, int ret),
+	TP_ARGS(duration_us, ret));
+
+DEFINE_EVENT(imx477_power, imx477_resume,
+	TP_PROTO(s64 duration_us, int ret),
+	TP_ARGS(duration_us, ret));
+
+/* Acceso a un registro de hasta 4 bytes, duration_ns es lo que tardó el bus */
+DECLARE_EVENT_CLASS(imx477_reg,
+	TP_PROTO(u16 reg, u32 len, u32 val, s64 duration_ns, int ret),
+	TP_ARGS(reg, len, val, duration_ns, ret),
+
+	TP_STRUCT__entry(
+		__field(u16, reg)
+		__field(u32, len)
+		__field(u32, val)
+		__field(s64, duration_ns)
+		__field(int, ret)
+	),
+
+	TP_fast_assign(
+		__entry->reg = reg;
+		__entry->len = len;
+		__entry->val = val;
+		__entry->duration_ns = duration_ns;
+		__entry->ret = ret;
+	),
+
+	TP_printk("reg=0x%04x len=%u val=0x%x duration=%lld ns ret=%d",
+		  __entry->reg, __entry->len, __entry->val,
+		  __entry->duration_ns, __entry->ret)
+);
+
+DEFINE_EVENT(imx477_reg, imx477_reg_read,
+	TP_PROTO(u16 reg, u32 len, u32 val, s64 duration_ns, int ret),
+	TP_ARGS(reg, len, val, duration_ns, ret));
+
+DEFINE_EVENT(imx477_reg, imx477_reg_write,
+	TP_PROTO(u16 reg, u32 len, u32 val, s64 duration_ns, int ret),
+	TP_ARGS(reg, len, val, duration_ns, ret));
+
+/*
+ * Un mensaje de una transferencia en ráfaga: los registros consecutivos a
+ * partir de reg. Todos los mensajes de la misma transferencia llevan su
+ * duración total y su posición en ella.
+ */
+TRACE_EVENT(imx477_reg_burst,
+	TP_PROTO(u16 reg, const u8 *data, u32 len, u32 index, u32 msgs,
+		 s64 duration_ns, int ret),
+	TP_ARGS(reg, data, len, index, msgs, duration_ns, ret),
+
+	TP_STRUCT__entry(
+		__field(u16, reg)
+		__field(u32, len)
+		__field(u32, index)
+		__field(u32, msgs)
+		__field(s64, duration_ns)
+		__field(int, ret)
+		__dynamic_array(u8, data, len)
+	),
+
+	TP_fast_assign(
+		__entry->reg = reg;
+		__entry->len = len;
+		__entry->index = index;
+		__entry->msgs = msgs;
+		__entry->duration_ns = duration_ns;
+		__entry->ret = ret;
+		memcpy(__get_dynamic_array(data), data, len);
+	),
+
+	TP_printk("reg=0x%04x len=%u msg=%u/%u duration=%lld ns ret=%d data=%s",
+		  __entry->reg, __entry->len, __entry->index + 1, __entry->msgs,
+		  __entry->duration_ns, __entry->ret,
+		  __print_hex(__get_dynamic_array(data), __entry->len))
+);
+
+#endif /* _IMX477_TRACE_H */
+
+/* Esta parte debe quedar fuera de la protección de la cabecera */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE imx477_trace
+#include <trace/define_trace.h>
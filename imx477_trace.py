@@ -0,0 +1,227 @@
+#!/usr/bin/env python3
+"""
+Correlate the imx477 tracepoints with the frames libcamera delivered.
+
+The trace is the text of /sys/kernel/tracing/trace or of trace-cmd report,
+recorded with the mono trace clock so it shares CLOCK_MONOTONIC with the
+libcamera sensor timestamps:
+
+    echo mono > /sys/kernel/tracing/trace_clock
+    echo 1 > /sys/kernel/tracing/events/imx477/enable
+    ./camera_test_app_video ... --metadata capture.meta
+    cat /sys/kernel/tracing/trace > capture.trace
+    ./imx477_trace.py capture.trace --metadata capture.meta
+
+Without a metadata file only the summary of the driver events is printed.
+With it, the time from each stream on to the first frame, the frame each
+control write landed before, and optionally (--frames) every frame with the
+driver events that happened since the previous one.
+"""
+
+import argparse
+import re
+import struct
+import sys
+from collections import defaultdict
+
+# task-pid [cpu] flags timestamp: event: arguments, flags only in newer kernels
+EVENT = re.compile(r'^\s*(?P<task>.+?)-(?P<pid>\d+)\s+\[(?P<cpu>\d+)\]\s+(?:\S+\s+)?'
+                   r'(?P<time>\d+\.\d+):\s+(?P<event>imx477_\w+):\s*(?P<args>.*)$')
+FIELD = re.compile(r'(\w+)=(\S+)')
+DURATION = re.compile(r'duration=(-?\d+) (ns|us)')
+
+# metadata_log.h: MetadataFileHeader and MetadataRecord, little endian
+HEADER = struct.Struct('<8sIIIIII')
+RECORD = struct.Struct('<qQIiffifffqIIifIi')
+
+# Registers written by the exposure, gain and frame length controls
+CONTROL_REGS = {
+    0x0104: 'group hold',
+    0x0202: 'exposure',
+    0x0204: 'analogue gain',
+    0x0340: 'frame length',
+    0x3100: 'long exposure shift',
+}
+
+PAD_OPS = ('imx477_enum_mbus_code', 'imx477_enum_frame_size', 'imx477_get_pad_format',
+           'imx477_set_pad_format', 'imx477_get_selection')
+
+
+class Event:
+    def __init__(self, time, name, args):
+        self.time = time            # ns, CLOCK_MONOTONIC with the mono trace clock
+        self.name = name
+        self.args = args
+        self.fields = dict(FIELD.findall(args))
+        match = DURATION.search(args)
+        self.duration = 0
+        if match:
+            self.duration = int(match.group(1)) * (1000 if match.group(2) == 'us' else 1)
+
+    def reg(self):
+        value = self.fields.get('reg')
+        return int(value, 16) if value else None
+
+    def regs(self):
+        """Every register the event covers, bursts included"""
+        first = self.reg()
+        if first is None:
+            return []
+        return range(first, first + int(self.fields.get('len', '1')))
+
+
+class Frame:
+    def __init__(self, record):
+        (self.pts, self.timestamp, self.sequence, self.exposure, self.analogueGain,
+         self.digitalGain, self.colourTemperature, self.lux, self.redGain, self.blueGain,
+         self.frameDuration, self.embedded, self.sensorFrameCount, self.sensorExposure,
+         self.sensorGain, self.sensorFrameLength, self.sensorTemperature) = record
+
+
+def read_trace(fileName):
+    events = []
+    with open(fileName, errors='replace') as trace:
+        for line in trace:
+            match = EVENT.match(line)
+            if not match:
+                continue
+            seconds, fraction = match.group('time').split('.')
+            time = int(seconds) * 1_000_000_000 + int(fraction.ljust(9, '0')[:9])
+            events.append(Event(time, match.group('event'), match.group('args')))
+    events.sort(key=lambda event: event.time)
+    return events
+
+
+def read_metadata(fileName):
+    with open(fileName, 'rb') as metadata:
+        header = HEADER.unpack(metadata.read(HEADER.size))
+        if header[0] != b'IMX477MD' or header[1] != 2 or header[2] != RECORD.size:
+            sys.exit(f'{fileName} is not a metadata file of version 2')
+        frames = []
+        while True:
+            data = metadata.read(RECORD.size)
+            if len(data) < RECORD.size:
+                break
+            frames.append(Frame(RECORD.unpack(data)))
+    frames.sort(key=lambda frame: frame.timestamp)
+    return frames
+
+
+def next_frame(frames, time):
+    """First frame whose sensor timestamp comes after time, binary search"""
+    low, high = 0, len(frames)
+    while low < high:
+        middle = (low + high) // 2
+        if frames[middle].timestamp <= time:
+            low = middle + 1
+        else:
+            high = middle
+    return frames[low] if low < len(frames) else None
+
+
+def print_summary(events):
+    stats = defaultdict(lambda: [0, 0, 0])
+    for event in events:
+        # The messages of a burst share the duration of their transfer, counted once
+        if event.name == 'imx477_reg_burst' and not event.fields.get('msg', '1/').startswith('1/'):
+            stats[event.name][0] += 1
+            continue
+        entry = stats[event.name]
+        entry[0] += 1
+        entry[1] += event.duration
+        entry[2] = max(entry[2], event.duration)
+
+    print(f'{"event":<24}{"count":>8}{"total us":>12}{"mean us":>10}{"max us":>10}')
+    for name, (count, total, maximum) in sorted(stats.items(), key=lambda item: -item[1][1]):
+        print(f'{name:<24}{count:>8}{total / 1000:>12.1f}{total / count / 1000:>10.1f}{maximum / 1000:>10.1f}')
+
+    # Configuration calls of libcamera ahead of each stream on
+    calls = 0
+    since = events[0].time
+    for event in events:
+        if event.name in PAD_OPS:
+            calls += 1
+        elif event.name == 'imx477_set_stream':
+            if event.args == 'on':
+                print(f'stream on at {event.time / 1e9:.6f}: {calls} pad operations in the '
+                      f'{(event.time - since) / 1e6:.1f} ms before it')
+            calls = 0
+            since = event.time
+
+
+def print_correlation(events, frames):
+    # Stream on to the first frame, the time to first frame of the driver side
+    for event in events:
+        if event.name == 'imx477_stream_on':
+            frame = next_frame(frames, event.time)
+            if frame:
+                print(f'mode {event.args.split()[0]} at {event.time / 1e9:.6f}: '
+                      f'{event.duration / 1000:.0f} us of register writes, first frame {frame.sequence} '
+                      f'{(frame.timestamp - event.time) / 1e6:.2f} ms later')
+        elif event.name == 'imx477_stream_start':
+            # Emitted once streaming, the set_stream call was duration earlier
+            frame = next_frame(frames, event.time)
+            if frame:
+                print(f'{event.args.split()[0]} start at {(event.time - event.duration) / 1e9:.6f}: '
+                      f'first frame {(frame.timestamp - event.time + event.duration) / 1e6:.2f} ms '
+                      f'after set_stream')
+
+    # Control writes against the frame they had to make
+    writes = [event for event in events
+              if event.name in ('imx477_reg_write', 'imx477_reg_burst') and
+              any(reg in CONTROL_REGS for reg in event.regs())]
+    streaming = [event for event in writes if frames and frames[0].timestamp <= event.time <= frames[-1].timestamp]
+    if streaming:
+        print(f'\n{"time":>16}  {"registers":<40}{"next frame":>12}{"headroom ms":>13}')
+    for event in streaming:
+        frame = next_frame(frames, event.time)
+        names = sorted({CONTROL_REGS[reg] for reg in event.regs() if reg in CONTROL_REGS})
+        print(f'{event.time / 1e9:>16.6f}  {", ".join(names):<40}{frame.sequence if frame else "-":>12}'
+              f'{(frame.timestamp - event.time) / 1e6 if frame else 0:>13.2f}')
+
+
+def print_frames(events, frames):
+    index = 0
+    previous = None
+    for frame in frames:
+        gap = f' +{(frame.timestamp - previous.timestamp) / 1e6:.2f} ms' if previous else ''
+        sensor = (f', sensor frame {frame.sensorFrameCount} exposure {frame.sensorExposure} us '
+                  f'gain {frame.sensorGain:.2f}' if frame.embedded else '')
+        print(f'frame {frame.sequence} at {frame.timestamp / 1e9:.6f}{gap}: exposure {frame.exposure} us, '
+              f'gain {frame.analogueGain:.2f}, duration {frame.frameDuration} us{sensor}')
+        while index < len(events) and events[index].time <= frame.timestamp:
+            event = events[index]
+            if previous and event.time > previous.timestamp:
+                print(f'    {(event.time - frame.timestamp) / 1e6:+9.3f} ms {event.name} {event.args}')
+            index += 1
+        previous = frame
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Correlate imx477 tracepoints with libcamera frames')
+    parser.add_argument('trace', help='text of the trace buffer or of trace-cmd report')
+    parser.add_argument('--metadata', help='metadata file of camera_test_app_video (--metadata)')
+    parser.add_argument('--frames', action='store_true', help='list every frame with the driver events before it')
+    args = parser.parse_args()
+
+    events = read_trace(args.trace)
+    if not events:
+        sys.exit(f'No imx477 events in {args.trace}')
+    print_summary(events)
+
+    if not args.metadata:
+        return
+    frames = read_metadata(args.metadata)
+    if not frames:
+        sys.exit(f'No frames in {args.metadata}')
+    if frames[0].timestamp > events[-1].time or frames[-1].timestamp < events[0].time:
+        print('\nThe frames are outside the trace, was the trace clock set to mono?')
+    print()
+    print_correlation(events, frames)
+    if args.frames:
+        print()
+        print_frames(events, frames)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <unordered_map>
+#include <vector>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <libcamera/libcamera.h>
+
+/*
+ * Keeps every plane of the allocator buffers mapped for the whole capture
+ * session, so the per-frame path is a lookup instead of an mmap/munmap pair.
+ *
+ * Planes sharing a dmabuf are covered by a single mapping of that dmabuf and
+ * addressed through their plane offset, mmap() itself only takes page
+ * aligned offsets.
+ */
+class MappedBufferCache {
+    public:
+        struct Plane {
+            uint8_t *data;
+            size_t length;
+        };
+
+        ~MappedBufferCache() {
+            unmapAll();
+        }
+
+        int map(const libcamera::FrameBuffer *buffer) {
+            if (planes.count(buffer))
+                return 0;
+
+            // Size of each dmabuf, large enough for every plane living in it
+            std::unordered_map<int, size_t> fdLength;
+            for (const libcamera::FrameBuffer::Plane &plane : buffer->planes()) {
+                size_t end = static_cast<size_t>(plane.offset) + plane.length;
+                size_t &length = fdLength[plane.fd.get()];
+                if (end > length)
+                    length = end;
+            }
+
+            std::unordered_map<int, uint8_t *> fdAddress;
+            for (const auto &[fd, length] : fdLength) {
+                void *address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (address == MAP_FAILED) {
+                    int ret = -errno;
+                    std::cerr << "Failed to mmap buffer: " << strerror(-ret) << std::endl;
+                    return ret;
+                }
+                mappings.push_back({ address, length });
+                fdAddress[fd] = static_cast<uint8_t *>(address);
+            }
+
+            std::vector<Plane> &mapped = planes[buffer];
+            for (const libcamera::FrameBuffer::Plane &plane : buffer->planes())
+                mapped.push_back({ fdAddress[plane.fd.get()] + plane.offset, plane.length });
+
+            return 0;
+        }
+
+        /* Planes of a buffer previously passed to map(), empty if it wasn't */
+        const std::vector<Plane> &find(const libcamera::FrameBuffer *buffer) const {
+            static const std::vector<Plane> none;
+            auto it = planes.find(buffer);
+            return it != planes.end() ? it->second : none;
+        }
+
+        void unmapAll() {
+            for (const Mapping &mapping : mappings) {
+                if (munmap(mapping.address, mapping.length) == -1)
+                    std::cerr << "Failed to unmap buffer" << std::endl;
+            }
+            mappings.clear();
+            planes.clear();
+        }
+
+    private:
+        struct Mapping {
+            void *address;
+            size_t length;
+        };
+
+        std::unordered_map<const libcamera::FrameBuffer *, std::vector<Plane>> planes;
+        std::vector<Mapping> mappings;
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+
+#include "frame_queue.h"
+#include "thread_util.h"
+
+/*
+ * Sidecar file of the recording: this header, then one MetadataRecord per
+ * frame handed to the encoder, in pts order. The records have a fixed size
+ * so the file can be mapped and indexed directly, or searched by pts, which
+ * only grows. All fields little endian.
+ */
+struct MetadataFileHeader {
+    char magic[8];              // "IMX477MD"
+    uint32_t version;           // 2, version 1 records end at frameDuration
+    uint32_t recordSize;        // sizeof(MetadataRecord)
+    uint32_t width;
+    uint32_t height;
+    uint32_t fps;               // Nominal rate of the sensor mode
+    uint32_t reserved;
+};
+
+struct MetadataRecord {
+    int64_t pts;                // Of the encoded frame, us
+    uint64_t timestamp;         // Sensor timestamp, ns
+    uint32_t sequence;
+    int32_t exposure;           // us, -1 when not reported
+    float analogueGain;         // 0 when not reported, as every field below
+    float digitalGain;
+    int32_t colourTemperature;  // K
+    float lux;
+    float colourGains[2];       // Red, blue
+    int64_t frameDuration;      // us
+    // From the frame's embedded data line, all 0 when it wasn't read
+    uint32_t embedded;          // 1 when the fields below are set
+    uint32_t sensorFrameCount;  // Frame counter of the sensor, 0-255
+    int32_t sensorExposure;     // us, as the sensor applied it
+    float sensorGain;
+    uint32_t sensorFrameLength; // Lines
+    int32_t sensorTemperature;  // Degrees C
+};
+
+static_assert(sizeof(MetadataRecord) == 80, "metadata records must keep their on-disk size");
+
+/*
+ * Writes the metadata records on a background thread. log() is called by a
+ * single producer, the encoder thread, and only pushes to a ring: a full
+ * ring drops the record instead of holding the frame up. The writer drains
+ * the ring a few times a second and flushes each batch, so what reached it
+ * survives a crash of the recorder.
+ */
+class MetadataLog {
+    public:
+        ~MetadataLog() {
+            close();
+        }
+
+        int open(const std::string &fileName, const MetadataFileHeader &fileHeader) {
+            file = fopen(fileName.c_str(), "wb");
+            if (!file) {
+                int ret = -errno;
+                std::cerr << "Failed to open metadata file " << fileName << ": " << strerror(-ret) << std::endl;
+                return ret;
+            }
+
+            MetadataFileHeader header = fileHeader;
+            memcpy(header.magic, "IMX477MD", sizeof(header.magic));
+            header.version = 2;
+            header.recordSize = sizeof(MetadataRecord);
+            if (fwrite(&header, sizeof(header), 1, file) != 1) {
+                std::cerr << "Failed to write metadata file " << fileName << std::endl;
+                fclose(file);
+                file = nullptr;
+                return -EIO;
+            }
+
+            ring = std::make_unique<SpscRing<MetadataRecord>>(kRecords);
+            batch.resize(kRecords);
+            written = 0;
+            stopping = false;
+            writer = std::thread(&MetadataLog::writeLoop, this);
+            return 0;
+        }
+
+        bool isOpen() const { return file != nullptr; }
+
+        void log(const MetadataRecord &record) {
+            if (file)
+                ring->push(record);
+        }
+
+        /* Write what is left in the ring and close the file */
+        void close() {
+            if (!file)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            wake.notify_one();
+            writer.join();
+            fclose(file);
+            file = nullptr;
+        }
+
+        uint64_t recordsWritten() const { return written; }
+        uint64_t recordsDropped() const { return ring ? ring->drops() : 0; }
+
+    private:
+        // A good 8 s of frames at 120 fps
+        static constexpr size_t kRecords = 1024;
+
+        FILE *file = nullptr;
+        std::unique_ptr<SpscRing<MetadataRecord>> ring;
+        std::vector<MetadataRecord> batch;
+        std::thread writer;
+        std::mutex mtx;
+        std::condition_variable wake;
+        bool stopping = false;
+        uint64_t written = 0;
+
+        void writeLoop() {
+            StageThread stage("metadata");
+            while (true) {
+                bool last;
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    wake.wait_for(lock, std::chrono::milliseconds(200), [this]() { return stopping; });
+                    last = stopping;
+                }
+
+                size_t count = 0;
+                while (count < batch.size() && ring->pop(batch[count]))
+                    count++;
+                if (count) {
+                    if (fwrite(batch.data(), sizeof(MetadataRecord), count, file) != count)
+                        std::cerr << "Failed to write metadata records" << std::endl;
+                    fflush(file);
+                    written += count;
+                }
+
+                if (last && ring->empty())
+                    return;
+            }
+        }
+};
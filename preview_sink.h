@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* One frame of the preview stream, valid for the duration of the sink call */
+struct PreviewFrame {
+    const uint8_t *data;
+    size_t size;
+    unsigned int width;
+    unsigned int height;
+    unsigned int stride;
+    uint32_t fourcc;
+    uint32_t sequence;
+    uint64_t timestamp;
+};
+
+/*
+ * Layout of the shared memory segment: this header then the pixels of the
+ * latest preview frame. generation is a seqlock, odd while a frame is being
+ * copied in, so a reader copies the frame out and retries if generation
+ * changed or was odd meanwhile.
+ */
+struct PreviewShmHeader {
+    std::atomic<uint32_t> generation;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t fourcc;
+    uint32_t sequence;
+    uint64_t timestamp;
+    uint64_t size;
+};
+
+/*
+ * Default preview consumer, keeps the latest preview frame in a POSIX shared
+ * memory segment (/dev/shm) for analysis processes to pick up.
+ */
+class ShmPreviewSink {
+    public:
+        ~ShmPreviewSink() {
+            close();
+        }
+
+        int open(const std::string &shmName, size_t frameSize) {
+            int fd = shm_open(shmName.c_str(), O_CREAT | O_RDWR, 0644);
+            if (fd < 0) {
+                int ret = -errno;
+                std::cerr << "Failed to open shared memory " << shmName << ": " << strerror(-ret) << std::endl;
+                return ret;
+            }
+
+            length = sizeof(PreviewShmHeader) + frameSize;
+            if (ftruncate(fd, length) < 0) {
+                int ret = -errno;
+                std::cerr << "Failed to size shared memory " << shmName << ": " << strerror(-ret) << std::endl;
+                ::close(fd);
+                return ret;
+            }
+
+            void *address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (address == MAP_FAILED) {
+                int ret = -errno;
+                std::cerr << "Failed to map shared memory " << shmName << ": " << strerror(-ret) << std::endl;
+                return ret;
+            }
+
+            header = static_cast<PreviewShmHeader *>(address);
+            header->generation.store(0, std::memory_order_relaxed);
+            header->size = 0;
+            name = shmName;
+            return 0;
+        }
+
+        void write(const PreviewFrame &frame) {
+            if (!header || sizeof(PreviewShmHeader) + frame.size > length)
+                return;
+
+            uint32_t generation = header->generation.load(std::memory_order_relaxed);
+            header->generation.store(generation + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            header->width = frame.width;
+            header->height = frame.height;
+            header->stride = frame.stride;
+            header->fourcc = frame.fourcc;
+            header->sequence = frame.sequence;
+            header->timestamp = frame.timestamp;
+            header->size = frame.size;
+            memcpy(reinterpret_cast<uint8_t *>(header + 1), frame.data, frame.size);
+
+            header->generation.store(generation + 2, std::memory_order_release);
+        }
+
+        void close() {
+            if (!header)
+                return;
+            munmap(header, length);
+            shm_unlink(name.c_str());
+            header = nullptr;
+        }
+
+    private:
+        PreviewShmHeader *header = nullptr;
+        size_t length = 0;
+        std::string name;
+};
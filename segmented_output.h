@@ -0,0 +1,293 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+/*
+ * Recording split over several files, for long unattended runs.
+ *
+ * A new segment starts on the first keyframe once the current one is
+ * segmentSeconds long, each one a complete file with its timestamps starting
+ * from zero. MP4 and MOV segments are fragmented, so even the segment being
+ * written when the process dies can be played up to its last keyframe.
+ * When the closed segments and the one being written go beyond maxBytes
+ * altogether, closed segments are deleted, oldest first.
+ *
+ * With a pre-roll the packets only go to memory, the last preRollSeconds of
+ * them from a keyframe on, until trigger() is called: the buffered packets
+ * then open a new segment and recording carries on live until postRollSeconds
+ * after the last trigger.
+ *
+ * write() is called from the one thread producing packets, trigger() may be
+ * called from anywhere, a signal handler included.
+ */
+class SegmentedOutput {
+    public:
+        struct Options {
+            // output.mp4 gives output_00001.mp4, output_00002.mp4...
+            std::string fileName;
+            const char *format = nullptr;
+            int segmentSeconds = 0;     // 0: a segment per event, or a single one
+            uint64_t maxBytes = 0;      // 0: no cap
+            int preRollSeconds = 0;     // 0: always recording
+            int postRollSeconds = 0;
+        };
+
+        ~SegmentedOutput() {
+            close();
+        }
+
+        /* Called once the stream parameters, extradata included, are known */
+        void start(const Options &opts, const AVCodecParameters *par, AVRational packetTimeBase, AVRational frameRate) {
+            options = opts;
+            parameters = avcodec_parameters_alloc();
+            if (!parameters || avcodec_parameters_copy(parameters, par) < 0)
+                throw std::runtime_error("Failed to copy codec parameters");
+            timeBase = packetTimeBase;
+            rate = frameRate;
+
+            size_t dot = options.fileName.rfind('.');
+            if (dot == std::string::npos || options.fileName.find('/', dot) != std::string::npos)
+                dot = options.fileName.size();
+            stem = options.fileName.substr(0, dot);
+            extension = options.fileName.substr(dot);
+
+            live = options.preRollSeconds == 0;
+            triggered = false;
+            nextIndex = 1;
+            closed.clear();
+            closedBytes = 0;
+            segmentCount = 0;
+            deletedCount = 0;
+            triggerCount = 0;
+        }
+
+        void trigger() { triggered = true; }
+
+        void write(const AVPacket *pkt) {
+            bool keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+            int64_t time = av_rescale_q(pkt->pts, timeBase, { 1, 1000 });
+
+            if (options.preRollSeconds > 0) {
+                if (triggered.exchange(false)) {
+                    liveUntil = time + options.postRollSeconds * 1000;
+                    triggerCount++;
+                    if (!live) {
+                        live = true;
+                        flushPreRoll();
+                    }
+                }
+                // Back to buffering on a keyframe, which then heads the pre-roll
+                if (live && time >= liveUntil && keyframe) {
+                    closeSegment();
+                    live = false;
+                }
+                if (!live) {
+                    buffer(pkt, time);
+                    return;
+                }
+            }
+
+            writeLive(pkt, time);
+        }
+
+        void close() {
+            closeSegment();
+            for (AVPacket *&packet : preRoll)
+                av_packet_free(&packet);
+            preRoll.clear();
+            avcodec_parameters_free(&parameters);
+        }
+
+        unsigned int segmentsWritten() const { return segmentCount; }
+        unsigned int segmentsDeleted() const { return deletedCount; }
+        unsigned int triggers() const { return triggerCount; }
+
+    private:
+        struct Segment {
+            std::string fileName;
+            uint64_t bytes;
+        };
+
+        Options options;
+        AVCodecParameters *parameters = nullptr;
+        AVRational timeBase = { 1, 1'000'000 };
+        AVRational rate = { 0, 1 };
+        std::string stem;
+        std::string extension;
+
+        AVFormatContext *context = nullptr;
+        AVStream *stream = nullptr;
+        std::string currentName;
+        int64_t segmentStart = 0;       // ms, for the rotation
+        int64_t timestampOffset = 0;    // In timeBase, makes each segment start at zero
+        unsigned int nextIndex = 1;
+        std::deque<Segment> closed;
+        uint64_t closedBytes = 0;
+
+        bool live = true;
+        int64_t liveUntil = 0;
+        std::atomic<bool> triggered{false};
+        std::deque<AVPacket *> preRoll;
+
+        unsigned int segmentCount = 0;
+        unsigned int deletedCount = 0;
+        unsigned int triggerCount = 0;
+
+        void writeLive(const AVPacket *pkt, int64_t time) {
+            bool keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+            if (context && options.segmentSeconds > 0 && keyframe &&
+                time - segmentStart >= options.segmentSeconds * 1000)
+                closeSegment();
+
+            // Segments can only start on a keyframe, what comes before it is lost
+            if (!context) {
+                if (!keyframe || !openSegment(pkt, time))
+                    return;
+            }
+
+            AVPacket *packet = av_packet_clone(pkt);
+            if (!packet)
+                return;
+            packet->stream_index = stream->index;
+            packet->pts -= timestampOffset;
+            if (packet->dts != AV_NOPTS_VALUE)
+                packet->dts -= timestampOffset;
+            av_packet_rescale_ts(packet, timeBase, stream->time_base);
+            if (av_interleaved_write_frame(context, packet) < 0)
+                std::cerr << "Failed to write packet to " << currentName << std::endl;
+            av_packet_free(&packet);
+
+            // The live segment counts too, or it could fill the disk before it rotates
+            if (options.maxBytes && context->pb)
+                deleteOldest(avio_tell(context->pb), 0);
+        }
+
+        /* Keep the last preRollSeconds of packets, always starting on a keyframe */
+        void buffer(const AVPacket *pkt, int64_t time) {
+            if (preRoll.empty() && !(pkt->flags & AV_PKT_FLAG_KEY))
+                return;
+            AVPacket *packet = av_packet_clone(pkt);
+            if (!packet)
+                return;
+            preRoll.push_back(packet);
+
+            // Drop the oldest GOP while the ones after it still cover the pre-roll
+            int64_t keep = options.preRollSeconds * 1000;
+            while (true) {
+                size_t next = 1;
+                while (next < preRoll.size() && !(preRoll[next]->flags & AV_PKT_FLAG_KEY))
+                    next++;
+                if (next == preRoll.size() ||
+                    time - av_rescale_q(preRoll[next]->pts, timeBase, { 1, 1000 }) < keep)
+                    break;
+                for (size_t i = 0; i < next; i++)
+                    av_packet_free(&preRoll[i]);
+                preRoll.erase(preRoll.begin(), preRoll.begin() + next);
+            }
+        }
+
+        void flushPreRoll() {
+            for (AVPacket *&packet : preRoll) {
+                writeLive(packet, av_rescale_q(packet->pts, timeBase, { 1, 1000 }));
+                av_packet_free(&packet);
+            }
+            preRoll.clear();
+        }
+
+        bool openSegment(const AVPacket *first, int64_t time) {
+            char index[16];
+            snprintf(index, sizeof(index), "_%05u", nextIndex++);
+            currentName = stem + index + extension;
+
+            if (avformat_alloc_output_context2(&context, nullptr, options.format, currentName.c_str()) < 0) {
+                std::cerr << "Could not allocate format context for " << currentName << std::endl;
+                context = nullptr;
+                return false;
+            }
+            stream = avformat_new_stream(context, nullptr);
+            if (!stream || avcodec_parameters_copy(stream->codecpar, parameters) < 0) {
+                std::cerr << "Failed to create stream in " << currentName << std::endl;
+                avformat_free_context(context);
+                context = nullptr;
+                return false;
+            }
+            stream->time_base = timeBase;
+            stream->avg_frame_rate = rate;
+
+            if (!(context->oformat->flags & AVFMT_NOFILE) &&
+                avio_open(&context->pb, currentName.c_str(), AVIO_FLAG_WRITE) < 0) {
+                std::cerr << "Failed to open output file " << currentName << std::endl;
+                avformat_free_context(context);
+                context = nullptr;
+                return false;
+            }
+
+            AVDictionary *muxerOptions = nullptr;
+            const char *name = context->oformat->name;
+            if (!strcmp(name, "mp4") || !strcmp(name, "mov"))
+                av_dict_set(&muxerOptions, "movflags", "+frag_keyframe+empty_moov+default_base_moof", 0);
+            int ret = avformat_write_header(context, &muxerOptions);
+            av_dict_free(&muxerOptions);
+            if (ret < 0) {
+                std::cerr << "Failed to write header of " << currentName << std::endl;
+                avio_closep(&context->pb);
+                avformat_free_context(context);
+                context = nullptr;
+                return false;
+            }
+
+            segmentStart = time;
+            timestampOffset = first->dts != AV_NOPTS_VALUE ? first->dts : first->pts;
+            return true;
+        }
+
+        void closeSegment() {
+            if (!context)
+                return;
+
+            av_write_trailer(context);
+            bool file = !(context->oformat->flags & AVFMT_NOFILE);
+            avio_closep(&context->pb);
+            avformat_free_context(context);
+            context = nullptr;
+            segmentCount++;
+            if (!file)
+                return;
+
+            struct stat info;
+            uint64_t bytes = stat(currentName.c_str(), &info) == 0 ? info.st_size : 0;
+            closed.push_back({ currentName, bytes });
+            closedBytes += bytes;
+
+            // The newest segment stays, even on its own above the cap
+            deleteOldest(0, 1);
+        }
+
+        /* Deletes closed segments while they and liveBytes are above the cap, keeping the last keep */
+        void deleteOldest(int64_t liveBytes, size_t keep) {
+            uint64_t live = liveBytes > 0 ? liveBytes : 0;
+            while (options.maxBytes && closedBytes + live > options.maxBytes && closed.size() > keep) {
+                const Segment &oldest = closed.front();
+                if (unlink(oldest.fileName.c_str()) < 0)
+                    std::cerr << "Failed to delete " << oldest.fileName << ": " << strerror(errno) << std::endl;
+                else
+                    deletedCount++;
+                closedBytes -= oldest.bytes;
+                closed.pop_front();
+            }
+        }
+};
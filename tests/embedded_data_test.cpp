@@ -0,0 +1,199 @@
+/*
+ * EmbeddedDataParser on synthetic SMIA lines, built the way the IMX477
+ * packs them: tag and value pairs with a 0x55 filler at every 5th byte in
+ * RAW10 and every 3rd byte in RAW12. Checks the decoding of each field, the
+ * long exposure shift, the fast path that reads a known layout straight from
+ * its offsets, a layout change, and the lines that must be refused.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../embedded_data.h"
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+/* A line as the sensor sends it, the fillers added as the bytes go in */
+class LineBuilder {
+    public:
+        explicit LineBuilder(int bits) : bitsPerPixel(bits) {
+            put(0x0a);
+        }
+
+        LineBuilder &address(uint16_t reg) {
+            put(0xaa);
+            put(reg >> 8);
+            put(0xa5);
+            put(reg & 0xff);
+            return *this;
+        }
+
+        LineBuilder &value(uint8_t byte) {
+            put(0x5a);
+            put(byte);
+            return *this;
+        }
+
+        /* A register the sensor leaves out, the address still moves on */
+        LineBuilder &skip() {
+            put(0x55);
+            put(0x00);
+            return *this;
+        }
+
+        std::vector<uint8_t> end() {
+            put(0x07);
+            return bytes;
+        }
+
+        std::vector<uint8_t> bytes;
+
+    private:
+        int bitsPerPixel;
+
+        void put(uint8_t byte) {
+            bytes.push_back(byte);
+            size_t period = bitsPerPixel == 10 ? 5 : 3;
+            while ((bytes.size() + 1) % period == 0)
+                bytes.push_back(0x55);
+        }
+};
+
+struct Registers {
+    uint8_t frameCount = 17;
+    int8_t temperature = 42;
+    uint16_t exposureLines = 0x1234;
+    uint16_t gainCode = 0x200;          // 2x
+    uint16_t frameLength = 0x0c00;
+    uint16_t lineLength = 0x5dc0;       // 24000
+    int shift = -1;                     // -1: 0x3100 left out of the line
+    bool withTemperature = true;
+};
+
+static std::vector<uint8_t> makeLine(int bits, const Registers &r, bool padded = false) {
+    LineBuilder line(bits);
+    if (padded)
+        line.address(0x0000).value(0).value(0);
+    line.address(0x0003).value(0).skip().value(r.frameCount);
+    if (r.withTemperature)
+        line.address(0x013a).value(r.temperature);
+    line.address(0x0202).value(r.exposureLines >> 8).value(r.exposureLines & 0xff)
+        .value(r.gainCode >> 8).value(r.gainCode & 0xff);
+    line.address(0x0340).value(r.frameLength >> 8).value(r.frameLength & 0xff)
+        .value(r.lineLength >> 8).value(r.lineLength & 0xff);
+    if (r.shift >= 0)
+        line.address(0x3100).value(r.shift);
+    return line.end();
+}
+
+static void checkDecoding(int bits) {
+    EmbeddedDataParser parser;
+    parser.setBitDepth(bits);
+    EmbeddedData data = {};
+
+    Registers r;
+    std::vector<uint8_t> line = makeLine(bits, r);
+    CHECK(parser.parse(line.data(), line.size(), data));
+    CHECK(data.frameCount == 17);
+    CHECK(data.temperature == 42);
+    CHECK(data.exposureLines == 0x1234);
+    CHECK(data.gainCode == 0x200);
+    CHECK(data.analogueGain() == 2.0f);
+    CHECK(data.frameLength == 0x0c00);
+    CHECK(data.lineLength == 24000);
+    CHECK(data.exposureShift == 0);
+    // 4660 lines of 24000 clocks at 840 MHz
+    CHECK(data.exposure() == 133142);
+    CHECK(data.frameLines() == 0x0c00);
+
+    // Same layout, new values: read from the offsets found on the first line
+    r.frameCount = 18;
+    r.temperature = -5;
+    r.gainCode = 0xfc00 | 0x300;        // Only the low 10 bits are the gain
+    std::vector<uint8_t> next = makeLine(bits, r);
+    CHECK(next.size() == line.size());
+    CHECK(parser.parse(next.data(), next.size(), data));
+    CHECK(data.frameCount == 18);
+    CHECK(data.temperature == -5);
+    CHECK(data.gainCode == 0x300);
+    CHECK(data.analogueGain() == 4.0f);
+
+    // A long exposure: both counts in units of 4 lines
+    r.shift = 2;
+    std::vector<uint8_t> shifted = makeLine(bits, r);
+    CHECK(parser.parse(shifted.data(), shifted.size(), data));
+    CHECK(data.exposureShift == 2);
+    CHECK(data.exposure() == 532571);
+    CHECK(data.frameLines() == 0x3000);
+
+    // The layout moved, after a mode change: the line is walked again
+    std::vector<uint8_t> moved = makeLine(bits, r, true);
+    CHECK(parser.parse(moved.data(), moved.size(), data));
+    CHECK(data.frameCount == 18);
+    CHECK(data.exposureShift == 2);
+}
+
+static void checkRefused(int bits) {
+    EmbeddedData data = {};
+    Registers r;
+
+    {
+        EmbeddedDataParser parser;
+        parser.setBitDepth(bits);
+        std::vector<uint8_t> line = makeLine(bits, r);
+        line[0] = 0x0b;
+        CHECK(!parser.parse(line.data(), line.size(), data));
+    }
+    {
+        // A filler that isn't 0x55, the packing is not what the bit depth says
+        EmbeddedDataParser parser;
+        parser.setBitDepth(bits);
+        std::vector<uint8_t> line = makeLine(bits, r);
+        line[bits == 10 ? 4 : 2] = 0x00;
+        CHECK(!parser.parse(line.data(), line.size(), data));
+    }
+    {
+        // A required register missing
+        EmbeddedDataParser parser;
+        parser.setBitDepth(bits);
+        Registers missing;
+        missing.withTemperature = false;
+        std::vector<uint8_t> line = makeLine(bits, missing);
+        CHECK(!parser.parse(line.data(), line.size(), data));
+    }
+    {
+        // Cut short before the last register
+        EmbeddedDataParser parser;
+        parser.setBitDepth(bits);
+        std::vector<uint8_t> line = makeLine(bits, r);
+        CHECK(!parser.parse(line.data(), line.size() - 4, data));
+    }
+    {
+        // The other bit depth puts the fillers elsewhere
+        EmbeddedDataParser parser;
+        parser.setBitDepth(bits == 10 ? 12 : 10);
+        std::vector<uint8_t> line = makeLine(bits, r);
+        CHECK(!parser.parse(line.data(), line.size(), data));
+    }
+}
+
+int main() {
+    for (int bits : { 10, 12 }) {
+        checkDecoding(bits);
+        checkRefused(bits);
+    }
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All embedded data lines parsed as expected\n");
+    return 0;
+}
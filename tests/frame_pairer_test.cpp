@@ -0,0 +1,122 @@
+/*
+ * FramePairer on made-up sensor timestamps: regular frames of two and three
+ * cameras with a fixed skew, a frame one camera drops, a camera that stops
+ * delivering, and the pair file the writer thread produces.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+
+#include "../frame_pairer.h"
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+        if (!(condition)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #condition); \
+            failures++; \
+        } \
+    } while (0)
+
+// 30 fps, pairs within half a frame as multiCapture() sets them up
+static constexpr uint64_t kFrame = 33'333'333;
+static constexpr int64_t kWindow = kFrame / 2;
+
+static void checkRegular() {
+    FramePairer pairer;
+    CHECK(pairer.open(nullptr, 3, kWindow) == 0);
+    for (uint32_t i = 0; i < 100; i++) {
+        uint64_t t = 1'000'000'000 + i * kFrame;
+        pairer.add(0, i, t);
+        pairer.add(2, i, t + 50'000);
+        pairer.add(1, i, t + 30'000);
+    }
+    CHECK(pairer.pairs() == 100);
+    for (size_t camera = 0; camera < 3; camera++)
+        CHECK(pairer.unpaired(camera) == 0);
+    CHECK(pairer.skew().count() == 100);
+    CHECK(pairer.skew().max() == 50'000);
+}
+
+static void checkDropped() {
+    FramePairer pairer;
+    CHECK(pairer.open(nullptr, 2, kWindow) == 0);
+    for (uint32_t i = 0; i < 10; i++) {
+        uint64_t t = i * kFrame;
+        pairer.add(0, i, t);
+        // Camera 1 loses frame 4, camera 0's frame 4 can't pair with its frame 5
+        if (i != 4)
+            pairer.add(1, i, t + 20'000);
+    }
+    CHECK(pairer.pairs() == 9);
+    CHECK(pairer.unpaired(0) == 1);
+    CHECK(pairer.unpaired(1) == 0);
+    CHECK(pairer.skew().max() == 20'000);
+}
+
+static void checkStalled() {
+    FramePairer pairer;
+    CHECK(pairer.open(nullptr, 2, kWindow) == 0);
+    // Camera 1 never delivers, camera 0 only keeps the last few frames waiting
+    for (uint32_t i = 0; i < 20; i++)
+        pairer.add(0, i, i * kFrame);
+    CHECK(pairer.pairs() == 0);
+    CHECK(pairer.unpaired(0) == 12);
+
+    // Out of range cameras are ignored, the count is capped to kMaxCameras
+    pairer.add(5, 0, 0);
+    CHECK(pairer.unpaired(5) == 0);
+    FramePairer many;
+    CHECK(many.open(nullptr, 8, kWindow) == 0);
+    many.add(FramePairer::kMaxCameras, 0, 0);
+    CHECK(many.pairs() == 0);
+}
+
+static void checkFile() {
+    char name[] = "/tmp/frame_pairer_test_XXXXXX";
+    int fd = mkstemp(name);
+    CHECK(fd >= 0);
+    if (fd < 0)
+        return;
+    close(fd);
+
+    {
+        FramePairer pairer;
+        CHECK(pairer.open(name, 2, kWindow) == 0);
+        for (uint32_t i = 0; i < 50; i++) {
+            pairer.add(0, i, i * kFrame);
+            pairer.add(1, i + 100, i * kFrame + 10'000);
+        }
+        pairer.close();
+        CHECK(pairer.pairs() == 50);
+    }
+
+    std::ifstream file(name);
+    std::string line;
+    CHECK(std::getline(file, line) && line == "pair,skew_us,sequence0,timestamp0,sequence1,timestamp1");
+    int rows = 0;
+    std::string last;
+    while (std::getline(file, line)) {
+        rows++;
+        last = line;
+    }
+    CHECK(rows == 50);
+    CHECK(last == "49,10.000,49," + std::to_string(49 * kFrame) + ",149," + std::to_string(49 * kFrame + 10'000));
+    unlink(name);
+}
+
+int main() {
+    checkRegular();
+    checkDropped();
+    checkStalled();
+    checkFile();
+    if (failures) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return EXIT_FAILURE;
+    }
+    printf("All frames paired as expected\n");
+    return 0;
+}
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Where a thread may run and whether it runs SCHED_FIFO, empty leaves it to the kernel */
+struct ThreadPolicy {
+    std::vector<int> cpus;
+    int priority = 0;           // SCHED_FIFO 1-99, 0 for SCHED_OTHER
+
+    bool empty() const { return cpus.empty() && !priority; }
+
+    std::string toString() const {
+        std::ostringstream out;
+        out << "cpus ";
+        if (cpus.empty())
+            out << "any";
+        for (size_t i = 0; i < cpus.size(); i++)
+            out << (i ? "," : "") << cpus[i];
+        if (priority)
+            out << ", fifo " << priority;
+        return out.str();
+    }
+};
+
+/* cpus[:priority], the cpus a comma separated list of numbers and ranges: 2-3, 0,2:50, :60 */
+inline bool parseThreadPolicy(const std::string &text, ThreadPolicy &policy) {
+    policy = ThreadPolicy();
+    size_t colon = text.find(':');
+    std::stringstream list(text.substr(0, colon));
+    std::string range;
+    while (std::getline(list, range, ',')) {
+        int first, last;
+        char dash;
+        std::stringstream item(range);
+        if (!(item >> first))
+            return false;
+        last = first;
+        if (item >> dash && (dash != '-' || !(item >> last) || item >> dash))
+            return false;
+        if (first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (int cpu = first; cpu <= last; cpu++)
+            policy.cpus.push_back(cpu);
+    }
+    if (colon != std::string::npos) {
+        const char *start = text.c_str() + colon + 1;
+        char *end;
+        errno = 0;
+        long priority = strtol(start, &end, 10);
+        if (errno || end == start || *end || priority < sched_get_priority_min(SCHED_FIFO) ||
+            priority > sched_get_priority_max(SCHED_FIFO) || priority < 1)
+            return false;
+        policy.priority = priority;
+    }
+    return !policy.empty();
+}
+
+/* CPU time a thread used up to a point, from its clock */
+struct ThreadSample {
+    pid_t tid;
+    std::string stage;
+    double cpuSeconds;
+};
+
+/*
+ * The named threads of the process, each one a stage of the pipeline.
+ *
+ * A thread joins with add(), which names it after its stage and applies the
+ * policy set for that stage, or the one of "other" if there is none. Stage
+ * threads of every session and helper register the same way, so pinning the
+ * pipeline only takes setPolicy() calls before the threads start. sample()
+ * reads the clocks of all of them at once, two samples give the share of a
+ * core each thread had in between.
+ */
+class ThreadRegistry {
+    public:
+        static ThreadRegistry &instance() {
+            static ThreadRegistry registry;
+            return registry;
+        }
+
+        void setPolicy(const std::string &stage, const ThreadPolicy &policy) {
+            std::lock_guard<std::mutex> lock(mtx);
+            policies[stage] = policy;
+        }
+
+        ThreadPolicy policy(const std::string &stage) const {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = policies.find(stage);
+            if (it == policies.end())
+                it = policies.find("other");
+            return it == policies.end() ? ThreadPolicy() : it->second;
+        }
+
+        /* Name the calling thread, apply the policy of its stage and keep track of it */
+        void add(const std::string &stage) {
+            // Thread names are at most 15 characters
+            pthread_setname_np(pthread_self(), stage.substr(0, 15).c_str());
+            ThreadPolicy stagePolicy = policy(stage);
+            apply(stage, stagePolicy);
+
+            clockid_t clock;
+            if (pthread_getcpuclockid(pthread_self(), &clock))
+                return;
+            std::lock_guard<std::mutex> lock(mtx);
+            threads[currentTid()] = { stage, clock, stagePolicy };
+        }
+
+        /* Forget the calling thread, before it exits and its clock goes away */
+        void remove() {
+            std::lock_guard<std::mutex> lock(mtx);
+            threads.erase(currentTid());
+        }
+
+        std::vector<ThreadSample> sample() const {
+            std::vector<ThreadSample> samples;
+            std::lock_guard<std::mutex> lock(mtx);
+            for (const auto &[tid, thread] : threads) {
+                timespec ts;
+                if (clock_gettime(thread.clock, &ts) == 0)
+                    samples.push_back({ tid, thread.stage, ts.tv_sec + ts.tv_nsec / 1e9 });
+            }
+            return samples;
+        }
+
+        /* One line per thread alive at the end: its share of a core since before, and its policy */
+        std::string report(const std::vector<ThreadSample> &before, double seconds) const {
+            std::vector<ThreadSample> after = sample();
+            std::ostringstream out;
+            out.setf(std::ios::fixed);
+            out.precision(1);
+            for (const ThreadSample &now : after) {
+                double start = 0;
+                for (const ThreadSample &then : before) {
+                    if (then.tid == now.tid)
+                        start = then.cpuSeconds;
+                }
+                ThreadPolicy threadPolicy;
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    auto it = threads.find(now.tid);
+                    if (it != threads.end())
+                        threadPolicy = it->second.policy;
+                }
+                out << "  " << now.stage << " (" << now.tid << "): "
+                    << (seconds > 0 ? 100.0 * (now.cpuSeconds - start) / seconds : 0) << "% of a core, "
+                    << threadPolicy.toString() << "\n";
+            }
+            return out.str();
+        }
+
+    private:
+        struct Thread {
+            std::string stage;
+            clockid_t clock;
+            ThreadPolicy policy;
+        };
+
+        mutable std::mutex mtx;
+        std::map<std::string, ThreadPolicy> policies;
+        std::map<pid_t, Thread> threads;
+
+        static pid_t currentTid() { return static_cast<pid_t>(syscall(SYS_gettid)); }
+
+        static void apply(const std::string &stage, const ThreadPolicy &policy) {
+            if (!policy.cpus.empty()) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (int cpu : policy.cpus)
+                    CPU_SET(cpu, &set);
+                int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                if (ret)
+                    std::cerr << "Failed to pin the " << stage << " thread: " << strerror(ret) << std::endl;
+            }
+            if (policy.priority) {
+                sched_param param = {};
+                param.sched_priority = policy.priority;
+                int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+                // Real-time scheduling needs CAP_SYS_NICE or an rtprio limit, the thread carries on without it
+                if (ret)
+                    std::cerr << "Failed to make the " << stage << " thread SCHED_FIFO: " << strerror(ret) << std::endl;
+            }
+        }
+};
+
+/* Registration of a stage thread for its lifetime, the first thing its loop creates */
+class StageThread {
+    public:
+        explicit StageThread(const char *stage) {
+            ThreadRegistry::instance().add(stage);
+        }
+
+        ~StageThread() {
+            ThreadRegistry::instance().remove();
+        }
+
+        StageThread(const StageThread &) = delete;
+        StageThread &operator=(const StageThread &) = delete;
+};
+
+/*
+ * Affinity of the calling thread for a scope, given back on exit. Threads
+ * created in the meantime inherit it, which is how the worker threads of a
+ * library follow the stage that opened it.
+ */
+class ScopedAffinity {
+    public:
+        explicit ScopedAffinity(const ThreadPolicy &policy) {
+            if (policy.cpus.empty())
+                return;
+            if (pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved))
+                return;
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            for (int cpu : policy.cpus)
+                CPU_SET(cpu, &set);
+            restore = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+        }
+
+        ~ScopedAffinity() {
+            if (restore)
+                pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+        }
+
+        ScopedAffinity(const ScopedAffinity &) = delete;
+        ScopedAffinity &operator=(const ScopedAffinity &) = delete;
+
+    private:
+        cpu_set_t saved;
+        bool restore = false;
+};
@@ -0,0 +1,346 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <linux/videodev2.h>
+
+#include "thread_util.h"
+
+/*
+ * H.264 encoder driving a V4L2 memory-to-memory device, the bcm2835-codec
+ * encoder (/dev/video11) on the Raspberry Pi.
+ *
+ * Camera buffers are imported on the OUTPUT queue as dmabufs, the picture
+ * never goes through user space. Only the bitstream buffers of the CAPTURE
+ * queue are mapped. Both queues are serviced by a poll thread that reports
+ * back through inputDone (the camera buffer may be reused) and outputReady
+ * (an encoded frame is available, valid until the callback returns).
+ */
+class V4L2Encoder {
+    public:
+        struct Config {
+            const char *device;
+            int width;
+            int height;
+            int stride;
+            uint32_t fourcc;
+            int bitrate;
+            bool constantBitrate;
+            int gop;
+            int fps;
+        };
+
+        std::function<void(void *cookie)> inputDone;
+        std::function<void(const uint8_t *data, size_t size, int64_t pts, bool keyframe)> outputReady;
+
+        ~V4L2Encoder() {
+            close();
+        }
+
+        int open(const Config &config) {
+            fd = ::open(config.device, O_RDWR | O_NONBLOCK);
+            if (fd < 0) {
+                int ret = -errno;
+                std::cerr << "Failed to open " << config.device << ": " << strerror(-ret) << std::endl;
+                return ret;
+            }
+
+            int ret = setControl(V4L2_CID_MPEG_VIDEO_BITRATE_MODE,
+                                 config.constantBitrate ? V4L2_MPEG_VIDEO_BITRATE_MODE_CBR
+                                                        : V4L2_MPEG_VIDEO_BITRATE_MODE_VBR);
+            if (!ret)
+                ret = setControl(V4L2_CID_MPEG_VIDEO_BITRATE, config.bitrate);
+            if (!ret && config.gop > 0)
+                ret = setControl(V4L2_CID_MPEG_VIDEO_H264_I_PERIOD, config.gop);
+            // In-band SPS/PPS in front of every I frame, the muxer picks them up from the first one
+            if (!ret)
+                ret = setControl(V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, 1);
+            if (ret) {
+                std::cerr << "Failed to set encoder controls" << std::endl;
+                close();
+                return ret;
+            }
+
+            v4l2_format fmt = {};
+            fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            fmt.fmt.pix_mp.width = config.width;
+            fmt.fmt.pix_mp.height = config.height;
+            fmt.fmt.pix_mp.pixelformat = config.fourcc;
+            fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+            fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_REC709;
+            fmt.fmt.pix_mp.num_planes = 1;
+            fmt.fmt.pix_mp.plane_fmt[0].bytesperline = config.stride;
+            if (xioctl(VIDIOC_S_FMT, &fmt) < 0)
+                return fail("Failed to set encoder input format");
+
+            fmt = {};
+            fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            fmt.fmt.pix_mp.width = config.width;
+            fmt.fmt.pix_mp.height = config.height;
+            fmt.fmt.pix_mp.pixelformat = V4L2_PIX_FMT_H264;
+            fmt.fmt.pix_mp.field = V4L2_FIELD_ANY;
+            fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_DEFAULT;
+            fmt.fmt.pix_mp.num_planes = 1;
+            fmt.fmt.pix_mp.plane_fmt[0].sizeimage = kBitstreamBufferSize;
+            if (xioctl(VIDIOC_S_FMT, &fmt) < 0)
+                return fail("Failed to set encoder output format");
+
+            v4l2_streamparm parm = {};
+            parm.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            parm.parm.output.timeperframe.numerator = 1;
+            parm.parm.output.timeperframe.denominator = config.fps;
+            if (xioctl(VIDIOC_S_PARM, &parm) < 0)
+                return fail("Failed to set encoder frame rate");
+
+            v4l2_requestbuffers reqbufs = {};
+            reqbufs.count = kInputBuffers;
+            reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            reqbufs.memory = V4L2_MEMORY_DMABUF;
+            if (xioctl(VIDIOC_REQBUFS, &reqbufs) < 0)
+                return fail("Failed to request encoder input buffers");
+            cookies.assign(reqbufs.count, nullptr);
+            for (unsigned int i = 0; i < reqbufs.count; i++)
+                freeInputs.push_back(i);
+
+            reqbufs = {};
+            reqbufs.count = kOutputBuffers;
+            reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            reqbufs.memory = V4L2_MEMORY_MMAP;
+            if (xioctl(VIDIOC_REQBUFS, &reqbufs) < 0)
+                return fail("Failed to request encoder output buffers");
+
+            for (unsigned int i = 0; i < reqbufs.count; i++) {
+                v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+                v4l2_buffer buf = {};
+                buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+                buf.memory = V4L2_MEMORY_MMAP;
+                buf.index = i;
+                buf.length = 1;
+                buf.m.planes = planes;
+                if (xioctl(VIDIOC_QUERYBUF, &buf) < 0)
+                    return fail("Failed to query encoder output buffer");
+
+                void *address = mmap(nullptr, planes[0].length, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED, fd, planes[0].m.mem_offset);
+                if (address == MAP_FAILED)
+                    return fail("Failed to mmap encoder output buffer");
+                bitstream.push_back({ static_cast<uint8_t *>(address), planes[0].length });
+
+                if (xioctl(VIDIOC_QBUF, &buf) < 0)
+                    return fail("Failed to queue encoder output buffer");
+            }
+
+            v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            if (xioctl(VIDIOC_STREAMON, &type) < 0)
+                return fail("Failed to start encoder input");
+            type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            if (xioctl(VIDIOC_STREAMON, &type) < 0)
+                return fail("Failed to start encoder output");
+
+            abort = false;
+            lastBuffer = false;
+            pollThread = std::thread(&V4L2Encoder::pollLoop, this);
+            return 0;
+        }
+
+        /*
+         * Queue a camera dmabuf for encoding. The cookie is handed back through
+         * inputDone once the encoder is done reading the buffer. Returns -EAGAIN
+         * when every input slot is busy.
+         */
+        int encode(int dmabuf, size_t offset, size_t size, int64_t pts, void *cookie) {
+            unsigned int index;
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                if (freeInputs.empty())
+                    return -EAGAIN;
+                index = freeInputs.back();
+                freeInputs.pop_back();
+                cookies[index] = cookie;
+            }
+
+            v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+            v4l2_buffer buf = {};
+            buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            buf.memory = V4L2_MEMORY_DMABUF;
+            buf.index = index;
+            buf.field = V4L2_FIELD_NONE;
+            buf.length = 1;
+            buf.m.planes = planes;
+            // The driver hands the timestamp back with the encoded frame, it carries the pts
+            buf.timestamp.tv_sec = pts / 1000000;
+            buf.timestamp.tv_usec = pts % 1000000;
+            planes[0].m.fd = dmabuf;
+            planes[0].data_offset = offset;
+            planes[0].bytesused = offset + size;
+            planes[0].length = offset + size;
+
+            if (xioctl(VIDIOC_QBUF, &buf) < 0) {
+                int ret = -errno;
+                std::lock_guard<std::mutex> lock(mtx);
+                freeInputs.push_back(index);
+                return ret;
+            }
+            return 0;
+        }
+
+        /* Drain the frames still in the encoder, then release the device */
+        void close() {
+            if (fd < 0)
+                return;
+
+            if (pollThread.joinable()) {
+                v4l2_encoder_cmd cmd = {};
+                cmd.cmd = V4L2_ENC_CMD_STOP;
+                if (xioctl(VIDIOC_ENCODER_CMD, &cmd) == 0) {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    drained.wait_for(lock, std::chrono::seconds(1), [this]() { return lastBuffer; });
+                }
+                abort = true;
+                pollThread.join();
+            }
+
+            v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            xioctl(VIDIOC_STREAMOFF, &type);
+            type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            xioctl(VIDIOC_STREAMOFF, &type);
+
+            for (const Bitstream &b : bitstream)
+                munmap(b.data, b.length);
+            bitstream.clear();
+
+            v4l2_requestbuffers reqbufs = {};
+            reqbufs.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+            reqbufs.memory = V4L2_MEMORY_DMABUF;
+            xioctl(VIDIOC_REQBUFS, &reqbufs);
+            reqbufs = {};
+            reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+            reqbufs.memory = V4L2_MEMORY_MMAP;
+            xioctl(VIDIOC_REQBUFS, &reqbufs);
+
+            ::close(fd);
+            fd = -1;
+            freeInputs.clear();
+            cookies.clear();
+        }
+
+    private:
+        static constexpr unsigned int kInputBuffers = 16;
+        static constexpr unsigned int kOutputBuffers = 12;
+        static constexpr unsigned int kBitstreamBufferSize = 2 << 20;
+
+        struct Bitstream {
+            uint8_t *data;
+            size_t length;
+        };
+
+        int fd = -1;
+        std::vector<Bitstream> bitstream;
+        std::vector<unsigned int> freeInputs;
+        std::vector<void *> cookies;
+
+        std::thread pollThread;
+        std::atomic<bool> abort;
+        std::mutex mtx;
+        std::condition_variable drained;
+        bool lastBuffer;
+
+        int xioctl(unsigned long request, void *arg) {
+            int ret;
+            do {
+                ret = ioctl(fd, request, arg);
+            } while (ret == -1 && errno == EINTR);
+            return ret;
+        }
+
+        int setControl(uint32_t id, int32_t value) {
+            v4l2_control ctrl = {};
+            ctrl.id = id;
+            ctrl.value = value;
+            return xioctl(VIDIOC_S_CTRL, &ctrl) < 0 ? -errno : 0;
+        }
+
+        int fail(const char *message) {
+            int ret = -errno;
+            std::cerr << message << ": " << strerror(errno) << std::endl;
+            close();
+            return ret;
+        }
+
+        void pollLoop() {
+            StageThread stage("v4l2-encoder");
+            while (!abort) {
+                pollfd p = { fd, POLLIN | POLLOUT, 0 };
+                int ret = poll(&p, 1, 200);
+                if (ret < 0 && errno != EINTR) {
+                    std::cerr << "Encoder poll failed: " << strerror(errno) << std::endl;
+                    break;
+                }
+                if (ret <= 0)
+                    continue;
+
+                // Camera buffers the encoder finished reading
+                while (true) {
+                    v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+                    v4l2_buffer buf = {};
+                    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+                    buf.memory = V4L2_MEMORY_DMABUF;
+                    buf.length = 1;
+                    buf.m.planes = planes;
+                    if (xioctl(VIDIOC_DQBUF, &buf) < 0)
+                        break;
+
+                    void *cookie;
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        cookie = cookies[buf.index];
+                        freeInputs.push_back(buf.index);
+                    }
+                    if (inputDone)
+                        inputDone(cookie);
+                }
+
+                // Encoded frames
+                while (true) {
+                    v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+                    v4l2_buffer buf = {};
+                    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+                    buf.memory = V4L2_MEMORY_MMAP;
+                    buf.length = 1;
+                    buf.m.planes = planes;
+                    if (xioctl(VIDIOC_DQBUF, &buf) < 0)
+                        break;
+
+                    size_t size = planes[0].bytesused - planes[0].data_offset;
+                    int64_t pts = buf.timestamp.tv_sec * 1000000LL + buf.timestamp.tv_usec;
+                    if (size && outputReady)
+                        outputReady(bitstream[buf.index].data + planes[0].data_offset, size, pts,
+                                    buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+
+                    if (buf.flags & V4L2_BUF_FLAG_LAST) {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        lastBuffer = true;
+                        drained.notify_one();
+                        continue;
+                    }
+
+                    planes[0].bytesused = 0;
+                    xioctl(VIDIOC_QBUF, &buf);
+                }
+            }
+        }
+};